@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+"""Effect of illumina8 quality binning (call --qualBins) on SNV calls and
+pileup size, on simulated pileup columns.
+
+Ports the parts of LoFreq that binning touches: merging of mapping and base
+quality (mergeQuals in processor.nim, MAPQ 60, no BAQ), binning
+(ILLUMINA8_BINS in qualBins.nim, applied to merged qualities), the pruned
+Poisson-binomial DP and the quality of the alt count (prunedProbDist,
+probvecTailSum and prob2qual in call.nim). Calls are filtered like in
+tests/denv2-simulation.sh, i.e. QUAL > 60 with minAF 0.
+
+Columns have a given coverage and a true alt allele frequency (0: errors
+only). Base qualities follow QUAL_WEIGHTS, roughly a HiSeq profile. Each
+base is a sequencing error with the probability of its quality (errors go
+to one of three other bases), otherwise it shows its true allele. Bases
+below minBQ 3 are ignored, as in call.
+
+Run from the repository root:
+
+    python3 experiments/2026-10-19-qualbins.py
+
+Prints one line per setting: calls without and with binning, calls only
+made by one of them, largest QUAL difference of calls made by both,
+histogram entries (distinct allele, strand and quality) per column without
+and with binning, and the time spent in the DP.
+"""
+
+import math
+import random
+import time
+
+MIN_BQ = 3
+MAPQ = 60
+MIN_QUAL = 60
+ILLUMINA8_BINS = [(2, 9, 6), (10, 19, 15), (20, 24, 22), (25, 29, 27),
+                  (30, 34, 33), (35, 39, 37), (40, 100, 40)]
+# base quality: weight
+QUAL_WEIGHTS = {2: 4, 7: 1, 12: 1, 15: 2, 18: 2, 22: 3, 25: 3, 27: 4, 30: 6,
+                32: 8, 33: 10, 34: 12, 35: 14, 36: 12, 37: 10, 38: 8, 39: 6,
+                40: 5, 41: 4}
+NEG_INF = -float(2**63 - 1)
+
+
+def qual2prob(q):
+    return 10.0 ** (-q / 10.0)
+
+
+def prob2qual(e):
+    return round(-10.0 * math.log10(e)) if e > 0 else 2**63 - 1
+
+
+def merge_quals(q_m, q_b):
+    p_m = qual2prob(q_m)
+    return prob2qual(p_m + (1 - p_m) * qual2prob(q_b))
+
+
+def bin_qual(q):
+    for lo, hi, b in ILLUMINA8_BINS:
+        if lo <= q <= hi:
+            return b
+    return q
+
+
+def log_sum(a, b):
+    if a > b:
+        return a + math.log(1.0 + math.exp(b - a))
+    return b + math.log(1.0 + math.exp(a - b))
+
+
+def pruned_prob_dist(err_probs, k_max, sig):
+    """as prunedProbDist (bonf 1)"""
+    prev = [0.0] + [0.0] * k_max
+    cur = [0.0] * (k_max + 1)
+    for n in range(1, len(err_probs) + 1):
+        pn = err_probs[n - 1]
+        log_pn = math.log(pn) if pn > 0 else NEG_INF
+        log_1_pn = math.log(1.0 - pn) if pn < 1 else NEG_INF
+        if n < k_max:
+            prev[n] = NEG_INF
+        for k in range(min(n, k_max - 1), 0, -1):
+            cur[k] = log_sum(prev[k] + log_1_pn, prev[k - 1] + log_pn)
+        cur[0] = prev[0] + log_1_pn
+        if n == k_max:
+            cur[k_max] = prev[k_max - 1] + log_pn
+        elif n > k_max:
+            cur[k_max] = log_sum(prev[k_max], prev[k_max - 1] + log_pn)
+            if math.exp(cur[k_max]) > sig:
+                return cur[:k_max + 1]
+        prev, cur = cur, prev
+    return prev[:k_max + 1]
+
+
+def call_qual(quals, alt_count):
+    """QUAL of the alt count at a column with the given merged qualities"""
+    if alt_count == 0:
+        return 0
+    probs = pruned_prob_dist([qual2prob(q) for q in quals], alt_count,
+                             sig=qual2prob(MIN_QUAL))
+    return prob2qual(math.exp(probs[alt_count]))
+
+
+def simulate_column(rng, coverage, af):
+    """(allele, reverse, base quality) per base, allele 0 is ref, 1 alt"""
+    qs, ws = zip(*QUAL_WEIGHTS.items())
+    column = []
+    for bq in rng.choices(qs, ws, k=coverage):
+        allele = 1 if rng.random() < af else 0
+        if rng.random() < qual2prob(bq):
+            # error: alt with probability 1/3 if ref, ref if alt and so on
+            allele = rng.choice([a for a in range(4) if a != allele])
+        column.append((allele, rng.random() < 0.5, bq))
+    return column
+
+
+def run(seed, num_columns, coverage, af):
+    rng = random.Random(seed)
+    calls = [0, 0]
+    only = [0, 0]
+    max_diff = 0
+    entries = [0, 0]
+    dp_time = [0.0, 0.0]
+    for _ in range(num_columns):
+        column = [(a, r, merge_quals(MAPQ, bq)) for a, r, bq in
+                  simulate_column(rng, coverage, af) if bq >= MIN_BQ]
+        # alt: most frequent non-ref allele
+        counts = [sum(1 for a, _, _ in column if a == b) for b in range(4)]
+        alt = max(range(1, 4), key=lambda b: counts[b])
+        quals = []
+        for i, binning in enumerate([False, True]):
+            col = [(a, r, bin_qual(q) if binning else q) for a, r, q in column]
+            entries[i] += len(set(col))
+            t = time.perf_counter()
+            quals.append(call_qual([q for _, _, q in col], counts[alt]))
+            dp_time[i] += time.perf_counter() - t
+        called = [q > MIN_QUAL for q in quals]
+        for i in range(2):
+            calls[i] += called[i]
+            only[i] += called[i] and not called[1 - i]
+        if all(called):
+            max_diff = max(max_diff, abs(quals[0] - quals[1]))
+    print(f"cov={coverage} af={af}: columns={num_columns}"
+          f" calls={calls[0]}/{calls[1]} only={only[0]}/{only[1]}"
+          f" max. QUAL diff={max_diff}"
+          f" histogram entries/column={entries[0]/num_columns:.1f}"
+          f"/{entries[1]/num_columns:.1f}"
+          f" DP time={dp_time[0]:.1f}s/{dp_time[1]:.1f}s")
+
+
+def main():
+    for seed, (num_columns, coverage, af) in enumerate([
+            (200, 1000, 0.0),
+            (200, 1000, 0.01),
+            (200, 1000, 0.02),
+            (100, 5000, 0.0),
+            (100, 5000, 0.002),
+            (100, 5000, 0.005),
+            (100, 5000, 0.01)]):
+        run(seed, num_columns, coverage, af)
+
+
+if __name__ == "__main__":
+    main()
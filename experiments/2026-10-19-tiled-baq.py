@@ -0,0 +1,287 @@
+#!/usr/bin/env python3
+"""Agreement of tiled (src/lofreqpkg/tiledbaq.nim) and whole-read alignment
+qualities on simulated long reads.
+
+Calls the C kernels (bam_md_ext.c, kprobaln_ext.c) directly via ctypes. The
+tiling (cut points, tiles, CIGAR clipping, stitching, drift band) is a line
+by line port of tiledbaq.nim, for use without a Nim toolchain. Keep the two
+in sync.
+
+Build the kernels and run from the repository root:
+
+    gcc -O2 -shared -fPIC -o /tmp/libbaq.so src/lofreqpkg/bam_md_ext.c \
+        src/lofreqpkg/kprobaln_ext.c -lm
+    python3 experiments/2026-10-19-tiled-baq.py /tmp/libbaq.so
+
+Prints one line per setting: reads, tiles, refused reads, fraction of
+identical BAQ/AI/AD values (and separately of AI/AD values at indels, where
+they aren't just '~') and the largest HMM memory (forward, backward and
+posterior matrices) of whole-read vs. tiled processing. The whole-read
+baseline is what alnqual computes without --tileLen, i.e. with the default
+band of bam_prob_realn_core_ext (min_bw 0). For comparison, also prints
+the agreement of whole-read processing with the tiles' drift band with that
+baseline, i.e. how much of the difference is due to the band alone, and
+its agreement with the tiles.
+"""
+
+import ctypes
+import random
+import sys
+
+# as in tiledbaq.nim
+TILE_LEN = 2000
+MARGIN = 250
+ANCHOR_FLANK = 8
+MAX_TILE_BAND = 250
+MAX_TILE_FACTOR = 2
+M, I, D, N, S = 0, 1, 2, 3, 4
+
+
+class BamLf(ctypes.Structure):
+    _fields_ = [("cigar", ctypes.POINTER(ctypes.c_uint32)),
+                ("qual", ctypes.POINTER(ctypes.c_uint8)),
+                ("seq", ctypes.POINTER(ctypes.c_uint8)),
+                ("pos", ctypes.c_int32),
+                ("l_qseq", ctypes.c_int32),
+                ("n_cigar", ctypes.c_uint32, 16)]
+
+
+def hmm_mem(n, bw):
+    """bytes allocated by kpa_ext_glocal for a read of length n (f, b, pd)"""
+    return 3 * (n + 1) * ((2 * bw + 1) * 3 + 6) * 8
+
+
+def aln_quals(lib, cigar, packed, qual, pos, ref, min_bw):
+    n = len(qual)
+    c = (ctypes.c_uint32 * len(cigar))(*cigar)
+    p = (ctypes.c_uint8 * len(packed))(*packed)
+    q = (ctypes.c_uint8 * n)(*qual)
+    blf = BamLf(ctypes.cast(c, ctypes.POINTER(ctypes.c_uint32)),
+                ctypes.cast(q, ctypes.POINTER(ctypes.c_uint8)),
+                ctypes.cast(p, ctypes.POINTER(ctypes.c_uint8)),
+                pos, n, len(cigar))
+    baq, ai, ad = (ctypes.create_string_buffer(n + 1) for _ in range(3))
+    # argument order of the C function: baq, ad, ai
+    rc = lib.bam_prob_realn_core_bw_ext(ctypes.byref(blf), ref, 1, 1, 1,
+                                        baq, ad, ai, min_bw)
+    assert rc == 0
+    unset = lambda s: s.raw[:n] if s.raw[0] != 0 else b""
+    return unset(baq), unset(ai), unset(ad)
+
+
+def drift_band(cigar):
+    drift = max_drift = 0
+    for c in cigar:
+        op, l = c & 0xf, c >> 4
+        if op == I:
+            drift -= l
+        elif op in (D, N):
+            drift += l
+        max_drift = max(max_drift, abs(drift))
+    return min(3 * max_drift + 3, MAX_TILE_BAND)
+
+
+def default_band(cigar):
+    """band bam_prob_realn_core_ext uses without min_bw (approximately: it
+    takes the net length difference of the aligned ref and query span)"""
+    net = 0
+    for c in cigar:
+        op, l = c & 0xf, c >> 4
+        if op == I:
+            net -= l
+        elif op in (D, N):
+            net += l
+    return max(7, abs(net) + 3)
+
+
+def cut_points(cigar, n, margin):
+    cuts, y = [0], 0
+    for c in cigar:
+        op, l = c & 0xf, c >> 4
+        if op == M:
+            cut = max(y + ANCHOR_FLANK, cuts[-1] + margin)
+            while cut <= y + l - ANCHOR_FLANK:
+                cuts.append(cut)
+                cut += margin
+        if op in (M, I, S):
+            y += l
+    if len(cuts) > 1 and n - cuts[-1] < margin // 2:
+        cuts.pop()
+    cuts.append(n)
+    return cuts
+
+
+def tiles(cuts, tile_len):
+    n_seg, a, result = len(cuts) - 1, 0, []
+    while True:
+        b = min(a + 3, n_seg)
+        while b < n_seg and cuts[b + 1] - cuts[a] <= tile_len:
+            b += 1
+        result.append((cuts[a], cuts[b],
+                       cuts[0] if a == 0 else cuts[a + 1],
+                       cuts[n_seg] if b == n_seg else cuts[b - 1]))
+        if b == n_seg:
+            return result
+        a = b - 2
+
+
+def clip_cigar(cigar, pos, qs, qe):
+    x, y, sub_pos, result = pos, 0, -1, []
+    for c in cigar:
+        op, l = c & 0xf, c >> 4
+        if op in (M, I, S):
+            s, e = max(y, qs), min(y + l, qe)
+            if e > s:
+                if op == M and sub_pos < 0:
+                    sub_pos = x + s - y
+                result.append(((e - s) << 4) | op)
+            if op == M:
+                x += l
+            y += l
+        elif op in (D, N):
+            if qs < y < qe:
+                result.append(c)
+            x += l
+    return result, sub_pos
+
+
+def pack_seq(packed, qs, qe):
+    result = [0] * ((qe - qs + 1) // 2)
+    for i in range(qs, qe):
+        nt = (packed[i >> 1] >> (((~i) & 1) << 2)) & 0xf
+        j = i - qs
+        result[j >> 1] |= nt << (((~j) & 1) << 2)
+    return result
+
+
+def tiled_aln_quals(lib, cigar, packed, qual, pos, ref):
+    """returns (baq, ai, ad), number of tiles (0: refused), max. HMM memory"""
+    n = len(qual)
+    if n <= TILE_LEN:
+        return (aln_quals(lib, cigar, packed, qual, pos, ref, 0), 1,
+                hmm_mem(n, default_band(cigar)))
+    cuts = cut_points(cigar, n, MARGIN)
+    if len(cuts) - 1 < 3:
+        return (b"", b"", b""), 0, 0
+    ts = tiles(cuts, TILE_LEN)
+    if any(qe - qs > MAX_TILE_FACTOR * TILE_LEN for qs, qe, _, _ in ts):
+        return (b"", b"", b""), 0, 0
+    baq, ai, ad = bytearray(n), bytearray(n), bytearray(n)
+    has_baq = has_ins = has_del = False
+    mem = 0
+    for qs, qe, cs, ce in ts:
+        sub_cigar, sub_pos = clip_cigar(cigar, pos, qs, qe)
+        bw = drift_band(sub_cigar)
+        mem = max(mem, hmm_mem(qe - qs, bw))
+        t = aln_quals(lib, sub_cigar, pack_seq(packed, qs, qe), qual[qs:qe],
+                      sub_pos, ref, bw)
+        has_baq |= len(t[0]) > 0
+        has_ins |= len(t[1]) > 0
+        has_del |= len(t[2]) > 0
+        for i in range(cs, ce):
+            j = i - qs
+            if t[0]:
+                baq[i] = t[0][j]
+            ai[i] = t[1][j] if t[1] else ord("~")
+            ad[i] = t[2][j] if t[2] else ord("~")
+    return ((bytes(baq) if has_baq else b"", bytes(ai) if has_ins else b"",
+             bytes(ad) if has_del else b""), len(ts), mem)
+
+
+def simulate(rng, ref, pos, read_len, err_rate, indel_rate):
+    """read from ref[pos:] with substitutions and 1-3bp indels, as in the
+    testblock of tiledbaq.nim"""
+    nt16 = [1, 2, 4, 8]
+    bases, cigar, x, last = [], [], pos, S
+
+    def add_op(op):
+        nonlocal last
+        if op == last:
+            cigar[-1] += 1 << 4
+        else:
+            cigar.append((1 << 4) | op)
+        last = op
+
+    while len(bases) < read_len:
+        r = rng.random()
+        if r < indel_rate / 2 and last == M:
+            for _ in range(rng.randint(1, 3)):
+                bases.append(nt16[rng.randint(0, 3)])
+                add_op(I)
+            continue
+        elif r < indel_rate and last == M:
+            for _ in range(rng.randint(1, 3)):
+                add_op(D)
+                x += 1
+            continue
+        b = "ACGT".find(chr(ref[x]))
+        if rng.random() < err_rate:
+            b = (b + 1 + rng.randint(0, 2)) % 4
+        bases.append(nt16[b])
+        add_op(M)
+        x += 1
+    qual = [20 + rng.randint(0, 20) for _ in bases]
+    packed = [0] * ((len(bases) + 1) // 2)
+    for i, b in enumerate(bases):
+        packed[i >> 1] |= b << (((~i) & 1) << 2)
+    return cigar, packed, qual, pos
+
+
+def run(lib, seed, num_reads, read_len, err_rate, indel_rate):
+    rng = random.Random(seed)
+    ref = "".join(rng.choice("ACGT")
+                  for _ in range(read_len * 2 + num_reads * 1000)).encode()
+    total = same_baq = same_ai = same_ad = num_tiles = refused = 0
+    num_indel = same_indel = 0  # AI/AD values other than '~' only
+    same_baq_drift = 0  # whole read with drift band vs. baseline
+    same_baq_tiled_drift = 0  # tiled vs. whole read with drift band
+    mem_whole = mem_tiled = 0
+    for k in range(num_reads):
+        cigar, packed, qual, pos = simulate(rng, ref, 1000 + k * 1000,
+                                            read_len, err_rate, indel_rate)
+        tiled, nt, mem = tiled_aln_quals(lib, cigar, packed, qual, pos, ref)
+        if nt == 0:
+            # alnqual falls back to the whole read, i.e. the baseline
+            refused += 1
+            continue
+        num_tiles += nt
+        mem_tiled = max(mem_tiled, mem)
+        mem_whole = max(mem_whole, hmm_mem(len(qual), default_band(cigar)))
+        whole = aln_quals(lib, cigar, packed, qual, pos, ref, 0)
+        drift = aln_quals(lib, cigar, packed, qual, pos, ref, drift_band(cigar))
+        assert [len(s) for s in tiled] == [len(s) for s in whole]
+        for i in range(len(qual)):
+            total += 1
+            same_baq += tiled[0][i] == whole[0][i]
+            same_baq_drift += drift[0][i] == whole[0][i]
+            same_baq_tiled_drift += tiled[0][i] == drift[0][i]
+            same_ai += tiled[1][i] == whole[1][i]
+            same_ad += tiled[2][i] == whole[2][i]
+            for t, w in ((tiled[1], whole[1]), (tiled[2], whole[2])):
+                if w[i] != ord("~"):
+                    num_indel += 1
+                    same_indel += t[i] == w[i]
+    print(f"len={read_len} err={err_rate} indel={indel_rate}: reads={num_reads}"
+          f" tiles={num_tiles} refused={refused}"
+          f" identical BAQ={same_baq/total:.5f} AI={same_ai/total:.5f}"
+          f" AD={same_ad/total:.5f}"
+          f" (at indels {same_indel}/{num_indel})"
+          f" whole-read drift band BAQ={same_baq_drift/total:.5f}"
+          f" (vs. tiled {same_baq_tiled_drift/total:.5f})"
+          f" max. HMM memory whole={mem_whole/2**20:.0f}MB"
+          f" tiled={mem_tiled/2**20:.0f}MB")
+
+
+def main():
+    lib = ctypes.CDLL(sys.argv[1] if len(sys.argv) > 1 else "/tmp/libbaq.so")
+    for seed, (num_reads, read_len, err_rate, indel_rate) in enumerate([
+            (4, 8000, 0.02, 0.002),
+            (4, 8000, 0.05, 0.004),
+            (4, 10000, 0.05, 0.005),
+            (3, 20000, 0.05, 0.01),
+            (3, 20000, 0.08, 0.01)]):
+        run(lib, seed, num_reads, read_len, err_rate, indel_rate)
+
+
+if __name__ == "__main__":
+    main()
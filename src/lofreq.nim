@@ -14,27 +14,44 @@ import lofreqpkg/pileup/algorithm# because const in pileup.call() exposed here a
 import lofreqpkg/viterbi as lofreq_viterbi
 import lofreqpkg/indelqual as lofreq_indelqual
 import lofreqpkg/alnqual as lofreq_alnqual
+import lofreqpkg/shard as lofreq_shard
+import lofreqpkg/packedref as lofreq_packedref
+import lofreqpkg/serve as lofreq_serve
 
 when isMainModule:
   dispatch_multi(
     [alnqual,
       help = {"faFname": "fasta reference (indexed)",
-              "bamInFname": "BAM input (\"-\" for stdin)"},
+              "bamInFname": "BAM input (\"-\" for stdin)",
+              "cacheSize": "max. number of cached results for duplicate alignments (0: no cache)",
+              "cacheWindow": "evict cached results more than this many bases behind the current read",
+              "tileLen": "process reads longer than this in overlapping tiles with bounded memory (0: off; e.g. 2000 for long reads)",
+              "htsThreads": "htslib I/O threads (-1: auto, 0: none)"},
       short = {"faFname": 'f',
                "bamInFname": 'b',
                }],
    [indelqual,
       help = {"faFname": "fasta reference (indexed)",
               "bamInFname": "BAM input (\"-\" for stdin)",
-              "uniform": "Instead of Dindel (default), add his indel quality uniformly (format: indel or ins,del)"},
+              "uniform": "Instead of Dindel (default), add his indel quality uniformly (format: indel or ins,del)",
+              "htsThreads": "htslib I/O threads (-1: auto, 0: none)"},
       short = {"faFname": 'f',
                "bamInFname": 'b',
                "uniform": 'u',
                }],
+    [packref,
+      help = {"faFname": "fasta reference (indexed)",
+              "homopolymers": "also embed the homopolymer runs used by indelqual",
+              "outFname": "output file (default: <faFname>.lf2b, where other commands find it automatically)"},
+      short = {"faFname": 'f',
+               "outFname": 'o',
+               }],
     [viterbi,
       help = {"faFname": "fasta reference (indexed)",
               "bamInFname": "BAM input (\"-\" for stdin)",
-              "refPadding": "Padding for reference context"},
+              "refPadding": "Padding for reference context",
+              "localized": "Only realign windows around indels that aren't left-aligned or anchored by matches",
+              "htsThreads": "htslib I/O threads (-1: auto, 0: none)"},
       short = {"faFname": 'f',
                "bamInFname": 'b',
                "refPadding": 'p',
@@ -43,19 +60,77 @@ when isMainModule:
       help = {"plpFname": "pileup file name (LoFreq JSON format)",
               "minVarQual": "minimum variant quality",
               "minAF": "minimum variant frequency"}],
+    [recall,
+      help = {"plpStore": "pileup store written by call --plpStore",
+              "regions": "Regions in the form of sq:s-e. Separate multiple regions with comma.",
+              "bedFname": "BED file listing regions",
+              "minVarQual": "minimum variant quality",
+              "minAF": "minimum variant frequency",
+              "sig": "significance level for Bonferroni corrected p-values (1.0: off)",
+              "bonf": "Bonferroni factor: 'dynamic' (number of tests performed in total) or a number"},
+      short = {"plpStore": 's',
+               "regions": 'r',
+               "bedFname": 'l',
+               "minVarQual": 'v',
+               "minAF": 'a',
+               }],
+    [shard,
+      help = {"bamFname": "BAM file (indexed)",
+              "numShards": "number of shards",
+              "regions": "Regions in the form of sq:s-e. Separate multiple regions with comma.",
+              "bedFname": "BED file listing regions",
+              "manifest": "output manifest (\"-\" for stdout)"},
+      short = {"bamFname": 'b',
+               "numShards": 'n',
+               "regions": 'r',
+               "bedFname": 'l',
+               "manifest": 'm',
+               }],
+    [serve,
+      help = {"faFname": "fasta reference (indexed)",
+              "bamFnames": "BAM or CRAM files (indexed) to serve, separated by comma",
+              "socket": "Unix socket to listen on",
+              "workers": "number of worker processes, i.e. of requests computed concurrently",
+              "maxPending": "max. number of connections waiting for a free worker",
+              "readTimeout": "close connections idle (or not reading results) for this many seconds",
+              "htsThreads": "htslib I/O threads (-1: auto, 0: none)",
+              "logLevel": "1: notice, 2: also log every request"},
+      short = {"faFname": 'f',
+               "bamFnames": 'b',
+               "socket": 's',
+               }],
+    [merge,
+      help = {"manifest": "shard manifest the outputs were created with",
+              "fnames": "per-shard outputs (VCF or pileup JSON) of call"},
+      short = {"manifest": 'm'}],
     [call,
-      help = {"bamFname": "BAM file",
+      help = {"bamFname": "BAM or CRAM file (CRAM needs faFname). Separate multiple files with comma for a joint pileup (needs outPrefix)",
               "faFname": "fasta reference (indexed)",
               "regions": "Regions in the form of sq:s-e. Separate multiple regions with comma.",
               "bedFname": "BED file listing regions",
               "minVarQual": "minimum variant quality (applied at calling stage)",
               "minAF": "minimum variant frequency for variants (applied at calling stage)",
+              "sig": "significance level for Bonferroni corrected p-values (1.0: off, i.e. only minVarQual applies)",
+              "bonf": "Bonferroni factor: 'dynamic' (number of tests performed in total, counted over all samples) or a number",
               "maxCov": "ignore positions with coverage above this value (applied at pileup stage)",
               "minCov": "ignore positions with coverage below this value (applied at pileup stage)",
               "minBQ": "ignore bases with base quality below this value (applied at pileup stage)",
               "noMQ": "ignore mapping quality (applied at pileup stage)",
               "pileup": "Don't call variants, but print pileup as JSON instead. See also 'pretty')",
-              "pretty": "pretty JSON output (cannot be used with callNow)"},
+              "pretty": "pretty JSON output (cannot be used with callNow)",
+              "stats": "write counters and timers as JSON to this file (\"-\" for stderr)",
+              "trace": "write a Chrome trace-event timeline of regions to this file",
+              "htsThreads": "htslib I/O threads shared by all inputs (-1: auto, 0: none)",
+              "outPrefix": "with multiple BAM files: write output to <outPrefix><sample>.vcf (or .json)",
+              "checkpointDir": "write results per region chunk to this directory and skip chunks completed by a previous run",
+              "chunkSize": "size of region chunks (in bp) when checkpointing",
+              "plpStore": "also write the pileup to this indexed store (bgzip compressed), for use with recall",
+              "stream": "read coordinate sorted input in file order without index (implied if bamFname is \"-\", i.e. stdin)",
+              "collapseReads": "process identical reads (same start, CIGAR, sequence, strand and qualities) only once. Speeds up ultra-deep amplicon data without changing results",
+              "shardManifest": "shard manifest written by shard (use with shardId instead of regions)",
+              "shardId": "id of shard to process (see shardManifest)",
+              "qualBins": "bin merged qualities at pileup stage: 'illumina8' or a map like '0-19:10,20-:30' (default: no binning)",
+              "sites": "VCF file of known sites: report statistics for their alleles only, but always (i.e. regardless of minVarQual, minAF and sig)"},
       short = {"bamFname": 'b',
                "faFname": 'f',
                "regions": 'r',
@@ -67,5 +142,6 @@ when isMainModule:
                "minCov": 'c',
                "minVarQual": 'v',
                "noMQ": 'M',
-               "pretty": 'P',}]
+               "pretty": 'P',
+               "outPrefix": 'o',}]
   )
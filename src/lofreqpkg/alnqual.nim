@@ -7,6 +7,7 @@
 # standard
 import tables
 import strutils
+import deques
 #import strformat
 
 # third party
@@ -16,6 +17,9 @@ import hts
 # project specific
 #import utils
 import bam_md_ext
+import htspool
+import packedref
+import tiledbaq
 
 
 const AI_TAG* = "ai"
@@ -35,6 +39,83 @@ template bam_get_qual*(b: untyped): untyped =
   cast[ptr uint8](cast[uint]((b).data) + uint(uint((b).core.n_cigar shl 2) + uint((b).core.l_qname) + uint((b.core.l_qseq + 1) shr 1)))
 
 
+type AlnQualCache = object
+  ## Bounded cache of computed tag strings for duplicate alignments, i.e.
+  ## those with identical chromosome, position, cigar, sequence and
+  ## qualities (the key). Input is sorted, so entries are evicted in input
+  ## order once they are more than window bases behind the current position
+  ## or if the cache is full.
+  maxSize: int
+  window: int64
+  entries: Table[string, aln_qual_strgs]
+  order: Deque[(int64, string)]
+  lookups: int
+  hits: int
+
+
+proc initAlnQualCache(maxSize: int, window: int64): AlnQualCache =
+  AlnQualCache(maxSize: maxSize, window: window,
+               entries: initTable[string, aln_qual_strgs](),
+               order: initDeque[(int64, string)]())
+
+
+proc enabled(self: AlnQualCache): bool {.inline.} =
+  self.maxSize > 0
+
+
+proc evict(self: var AlnQualCache, pos: int64) =
+  # drops entries outside the window. pos moving backwards means a new
+  # chromosome
+  while len(self.order) > 0:
+    let oldest = self.order.peekFirst()
+    if oldest[0] >= pos - self.window and oldest[0] <= pos and
+       len(self.order) < self.maxSize:
+      break
+    self.entries.del(oldest[1])
+    discard self.order.popFirst()
+
+
+proc get(self: var AlnQualCache, key: string, aqs: var aln_qual_strgs): bool =
+  inc self.lookups
+  if self.entries.hasKey(key):
+    aqs = self.entries[key]
+    inc self.hits
+    return true
+  return false
+
+
+proc put(self: var AlnQualCache, pos: int64, key: string, aqs: aln_qual_strgs) =
+  self.evict(pos)
+  self.entries[key] = aqs
+  self.order.addLast((pos, key))
+
+
+proc hitRate(self: AlnQualCache): float =
+  if self.lookups == 0: 0.0 else: self.hits / self.lookups
+
+
+proc cacheKey(rec: Record, key: var string) =
+  # chromosome, position and raw cigar, sequence and quality bytes
+  let nCigar = int(rec.b.core.n_cigar) * sizeof(uint32)
+  let nSeq = (int(rec.b.core.l_qseq) + 1) shr 1
+  let nQual = int(rec.b.core.l_qseq)
+  var pos = int32(rec.start)
+  key.setLen(0)
+  key.add(rec.chrom)
+  key.add('\0')
+  let off = len(key)
+  key.setLen(off + sizeof(pos) + nCigar + nSeq + nQual)
+  copyMem(addr key[off], addr pos, sizeof(pos))
+  var o = off + sizeof(pos)
+  if nCigar > 0:
+    copyMem(addr key[o], bam_get_cigar(rec.b), nCigar)
+    o += nCigar
+  if nQual > 0:
+    copyMem(addr key[o], bam_get_seq(rec.b), nSeq)
+    o += nSeq
+    copyMem(addr key[o], bam_get_qual(rec.b), nQual)
+
+
 proc skipRead(rec: Record): bool =
   if rec.flag.secondary or rec.flag.qcfail or rec.flag.dup or rec.flag.unmapped:
     return true
@@ -75,18 +156,29 @@ proc createRec(rec: Record, aqs: aln_qual_strgs): string =
     result = recSplit.join("\t")
 
 
-proc alnqual*(faFname: string, bamInFname: string) =
+proc alnqual*(faFname: string, bamInFname: string, cacheSize = 10000,
+              cacheWindow = 500, tileLen = 0, htsThreads = AUTO_HTS_THREADS) =
+  ## Adds BAQ and indel alignment qualities. Results for duplicate
+  ## alignments are taken from a cache of up to cacheSize entries, which
+  ## follows the sorted input with a window of cacheWindow bases (cacheSize
+  ## 0 disables the cache). Reads longer than tileLen (if > 0) are processed
+  ## in overlapping tiles with bounded memory (see tiledbaq). Reads that
+  ## can't be tiled are processed as a whole, as without tileLen.
 
-  var fai: Fai
   var iBam: Bam
   #var oBam: Bam
   # keeping all observed reference sequences in memory for speedup
   var refs = initTable[string, string]()
+  var cache = initAlnQualCache(cacheSize, cacheWindow)
+  var key: string
+  var numTiled = 0
+  var numRefused = 0
 
-  if not open(fai, faFname):
-    quit("Could not open reference sequence file: " & faFname)
+  let fa = openReference(faFname)# packed if available
 
-  open(iBam, bamInFname, fai=faFname)
+  initHtsPool(htsThreads)
+  if not openBam(iBam, bamInFname, faFname):
+    quit("Could not open BAM file " & bamInFname)
   
   stdout.write($iBam.hdr)
   #assert outFormat in @["BAM", "SAM", "CRAM"]
@@ -107,13 +199,17 @@ proc alnqual*(faFname: string, bamInFname: string) =
     var chrom = rec.chrom
     if not refs.hasKey(chrom):
       #stderr.writeLine("DEBUG Loading " & chrom)
-      refs[chrom] = fai.get(chrom)
+      refs[chrom] = fa.get(chrom)
 
-    const baq_flag = 1
-    const baq_extended = 1
-    const idaq_flag = 1
     var query: string
     discard rec.sequence(query)
+
+    var aqs: aln_qual_strgs
+    if cache.enabled:
+      cacheKey(rec, key)
+      if cache.get(key, aqs):
+        echo createRec(rec, aqs)
+        continue
     
 
     # bam_lf_t is actually an abstraction of bam1_t that's used everywhere in htslib.
@@ -128,30 +224,63 @@ proc alnqual*(faFname: string, bamInFname: string) =
     bam_lf.cigar = bam_get_cigar(rec.b)
     bam_lf.qual = bam_get_qual(rec.b)
     bam_lf.seq = bam_get_seq(rec.b)
-    var aqs: aln_qual_strgs
-    aqs.ai_str = newString(len(query))
-    aqs.ad_str = newString(len(query))
-    aqs.baq_str = newString(len(query))
-    
-    var rc = bam_prob_realn_core_ext(addr bam_lf, refs[chrom], 
-                            baq_flag, baq_extended, idaq_flag, aqs)
-    doAssert rc == 0
-
-    # fix overallocated strings.
-    if aqs.ad_str[0] == '\0':
-      aqs.ad_str.setlen(0)
-    if aqs.ai_str[0] == '\0':
-      aqs.ai_str.setlen(0)
-    if aqs.baq_str[0] == '\0':
-      aqs.baq_str.setlen(0)
+    if tileLen > 0 and len(query) > tileLen:
+      let numTiles = tiledAlnQuals(bam_lf, refs[chrom], aqs, tileLen)
+      if numTiles > 1:
+        inc numTiled
+      elif numTiles == 0:
+        stderr.writeLine("WARNING: alnqual can't cut " & rec.qname &
+          " into tiles of bounded size (too few matches); processing it as a whole")
+        alnQuals(bam_lf, refs[chrom], aqs)
+        inc numRefused
+    else:
+      alnQuals(bam_lf, refs[chrom], aqs)
+    if cache.enabled:
+      cache.put(rec.start, key, aqs)
     echo createRec(rec, aqs)
     #obam.write(createRec(rec, ad_str, ai_str, baq_str))
 
   #oBam.close()
+  if cache.enabled:
+    stderr.writeLine("INFO: alnqual cache hits: " & $cache.hits & " of " &
+      $cache.lookups & " (" & formatFloat(100.0 * cache.hitRate, ffDecimal, 1) & "%)")
+  if tileLen > 0:
+    stderr.writeLine("INFO: alnqual reads processed in tiles: " & $numTiled &
+      ", processed as a whole instead: " & $numRefused)
   
   
 when isMainModule:
+  import utils
+
   #testblock "findHomopolymerRuns":
   #  let x = findHomopolymerRuns("AACCCTTTTA")
   #  doAssert x == @[2, 1, 3, 1, 1, 4, 1, 1, 1, 1]
-  echo "OK: no tests"
+
+  testblock "cache":
+    var cache = initAlnQualCache(3, 10)
+    var aqs = aln_qual_strgs(ai_str: "II", ad_str: "DD", baq_str: "BB")
+    var found: aln_qual_strgs
+    doAssert not cache.get("a", found)
+    cache.put(100, "a", aqs)
+    doAssert cache.get("a", found)
+    doAssert found == aqs
+    # window follows position
+    cache.put(105, "b", aqs)
+    cache.put(111, "c", aqs)
+    doAssert not cache.get("a", found)
+    doAssert cache.get("b", found)
+    # size bound
+    cache.put(112, "d", aqs)
+    cache.put(113, "e", aqs)
+    doAssert not cache.get("b", found)
+    doAssert cache.get("e", found)
+    # new chromosome, i.e. position moves backwards
+    cache.put(1, "f", aqs)
+    doAssert not cache.get("e", found)
+    doAssert cache.lookups == 7 and cache.hits == 3
+    doAssert cache.hitRate == 3/7
+
+  testblock "disabled cache":
+    doAssert not initAlnQualCache(0, 10).enabled
+
+  echo "OK: all tests passed"
@@ -0,0 +1,195 @@
+## LoFreq: library interface for using pileup and calling from other
+## programs without going through the command line and text output (see
+## module 'capi' for the C ABI). A 'LoFreq' handle opens BAM file and
+## reference once and can then be queried for any number of regions. Each
+## handle has its own pileup and call parameters, i.e. doesn't use the
+## globals plpParams and callParams of the command line tools. Note that
+## with a dynamic Bonferroni factor the number of tests performed so far
+## accumulates over all queries of a handle (see 'resetTests'), and that
+## calls of a query are then only filtered for significance at its end (see
+## call.filterSignificant), i.e. the variant iterators only yield once all
+## regions of the query are done. Handles are not thread-safe: use one per
+## thread.
+##
+## Regions are piled up in batches of 'batchSize' positions, so that memory
+## stays bounded for large regions. The most recently used chromosome of
+## the reference is kept in memory (or the reference is memory-mapped if
+## packed, see packref), so that repeated queries on the same chromosome
+## don't load it again.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+
+# standard
+import os
+# third party
+import hts
+# project specific
+import region
+import packedref
+import vcf
+import call
+import htspool
+import pileup/algorithm
+import pileup/recordFilter
+import pileup/storage/slidingDeque
+import pileup/storage/containers/positionData
+
+export region.Region, vcf.Variant, vcf.`$`, positionData.PositionData
+export algorithm.PileupParams, algorithm.defaultPileupParams
+export call.CallParams, call.defaultCallParams, call.setBonf, call.defersCalls
+
+
+const DEFAULT_BATCH_SIZE* = 100_000# positions piled up at once by the iterators
+
+
+type LoFreq* = ref object
+  ## Handle for repeated queries on one BAM file
+  bam: Bam
+  fa: Reference
+  ownsRef: bool# reference was opened by (and is closed with) this handle
+  plpParams*: PileupParams
+  callParams*: CallParams
+  batchSize*: Positive
+
+
+proc openLoFreq*(bamFname: string, fa: Reference, faFname: string,
+                 plpParams = defaultPileupParams(),
+                 callParams = defaultCallParams()): LoFreq =
+  ## Opens an indexed BAM/CRAM file, using an already opened reference
+  ## (faFname is needed for CRAM decoding), e.g. shared by several handles
+  ## (see openSharedReference). Raises IOError if the file can't be opened.
+  result = LoFreq(plpParams: plpParams, callParams: callParams,
+                  batchSize: DEFAULT_BATCH_SIZE, fa: fa)
+  if not openBam(result.bam, bamFname, faFname, index=true):
+    raise newException(IOError, "Could not open BAM file " & bamFname)
+
+
+proc openSharedReference*(faFname: string): Reference =
+  ## Opens a reference for use by several handles. Raises IOError if it
+  ## can't be opened.
+  if not fileExists(faFname):
+    raise newException(IOError, "Could not open reference " & faFname)
+  result = openReference(faFname)# packed if available
+  result.enableCache()
+
+
+proc openLoFreq*(bamFname: string, faFname: string,
+                 plpParams = defaultPileupParams(),
+                 callParams = defaultCallParams()): LoFreq =
+  ## Opens an indexed BAM/CRAM file and the (indexed) reference. Raises
+  ## IOError if either can't be opened.
+  let fa = openSharedReference(faFname)
+  result = openLoFreq(bamFname, fa, faFname, plpParams, callParams)
+  result.ownsRef = true
+
+
+proc close*(self: LoFreq) =
+  self.bam.close()
+  if self.ownsRef:
+    self.fa.close()
+
+
+proc hasChrom*(self: LoFreq, chrom: string): bool =
+  ## Whether chrom is known to both BAM file and reference. Queries on other
+  ## chromosomes fail
+  if not self.fa.hasSeq(chrom):
+    return false
+  for t in targets(self.bam.hdr):
+    if t.name == chrom:
+      return true
+
+
+proc resetTests*(self: LoFreq) =
+  ## Resets the number of tests performed so far (dynamic Bonferroni)
+  if self.callParams.dynamicBonf:
+    self.callParams.bonf = 0.0
+
+
+proc pileupBatch(self: LoFreq, reg: Region, handler: DataToVoid) =
+  let records = newRecordFilter(self.bam, reg.sq, reg.s, reg.e)
+  algorithm.pileup(self.fa, records, reg, handler, self.plpParams)
+
+
+proc pileupPositions*(self: LoFreq, reg: Region): seq[PositionData] =
+  ## Batch API: pileup of all positions in reg (passing coverage filters)
+  var batch: seq[PositionData]
+  self.pileupBatch(reg, proc(pd: PositionData) = batch.add(pd))
+  batch
+
+
+proc callVariantsUnfiltered(self: LoFreq, reg: Region): seq[Variant] =
+  # without the final filter for dynamic Bonferroni correction
+  var batch: seq[Variant]
+  let handle = self
+  self.pileupBatch(reg, proc(pd: PositionData) =
+    for v in callAtPos(pd, handle.callParams):
+      batch.add(v))
+  batch
+
+
+proc callVariants*(self: LoFreq, reg: Region): seq[Variant] =
+  ## Batch API: variants called in reg
+  filterSignificant(self.callVariantsUnfiltered(reg), self.callParams)
+
+
+iterator positions*(self: LoFreq, reg: Region): PositionData =
+  ## Pileup of all positions in reg, computed in batches
+  for chunk in reg.chunks(self.batchSize):
+    for pd in self.pileupPositions(chunk):
+      yield pd
+
+
+iterator variants*(self: LoFreq, regs: seq[Region]): Variant =
+  ## Variants called in regs, computed in batches
+  var deferred: seq[Variant]
+  for reg in regs:
+    for chunk in reg.chunks(self.batchSize):
+      for v in self.callVariantsUnfiltered(chunk):
+        if self.callParams.defersCalls:
+          deferred.add(v)
+        else:
+          yield v
+  for v in filterSignificant(deferred, self.callParams):
+    yield v
+
+
+iterator variants*(self: LoFreq, reg: Region): Variant =
+  ## As above for a single region
+  for v in self.variants(@[reg]):
+    yield v
+
+
+iterator variants*(self: LoFreq, regionsStr: string): Variant =
+  ## As above for regions in the form of sq:s-e, separated by comma
+  var regs: seq[Region]
+  for reg in parseRegionsStr(regionsStr):
+    regs.add(reg)
+  for v in self.variants(regs):
+    yield v
+
+
+when isMainModule:
+  import utils
+
+  testblock "open failure":
+    var failed = false
+    try:
+      discard openLoFreq("does-not-exist.bam", "does-not-exist.fa")
+    except IOError:
+      failed = true
+    doAssert failed
+
+  testblock "params":
+    var params = defaultCallParams()
+    params.setBonf("10")
+    doAssert params.bonf == 10.0 and not params.dynamicBonf
+    var failed = false
+    try:
+      params.setBonf("0.5")
+    except ValueError:
+      failed = true
+    doAssert failed
+
+  echo "OK: all tests passed"
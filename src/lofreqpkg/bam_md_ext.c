@@ -329,13 +329,18 @@ void idaq(const bam_lf_t *blf, const char *ref, double **pd, int xe, int xb, int
  * lofreq3: made bam1_t *b const, to prevent changes here 
  * we should return baq, ai and ad as encoded strings
  * need to be preallocated and of length c->l_qseq
+ *
+ * lofreq3: min_bw is the minimum band width (0: none). the band is
+ * otherwise only set from the net indel length, which the alignment can
+ * exceed in between (long reads, see tiledbaq.nim)
  * 
  */
-int bam_prob_realn_core_ext(const bam_lf_t *blf, 
-                            const char *ref, 
-                            int baq_flag, int baq_extended,
-                            int idaq_flag, 
-                            char *baq_str, char *ad_str, char *ai_str)
+int bam_prob_realn_core_bw_ext(const bam_lf_t *blf, 
+                               const char *ref, 
+                               int baq_flag, int baq_extended,
+                               int idaq_flag, 
+                               char *baq_str, char *ad_str, char *ai_str,
+                               int min_bw)
 {
 /*#define ORIG_BAQ 1*/
      int k, i, bw, x, y, yb, ye, xb, xe;
@@ -433,6 +438,8 @@ int bam_prob_realn_core_ext(const bam_lf_t *blf,
 	bw = 7;
 	if (abs((xe - xb) - (ye - yb)) > bw)
 		bw = abs((xe - xb) - (ye - yb)) + 3;
+	if (bw < min_bw)
+		bw = min_bw;
 	conf.bw = bw;
 	xb -= yb + bw/2; if (xb < 0) xb = 0;
 	xe += blf->l_qseq - ye + bw/2;
@@ -548,3 +555,13 @@ int bam_prob_realn_core_ext(const bam_lf_t *blf,
 	return 0;
 }
 
+
+int bam_prob_realn_core_ext(const bam_lf_t *blf, 
+                            const char *ref, 
+                            int baq_flag, int baq_extended,
+                            int idaq_flag, 
+                            char *baq_str, char *ad_str, char *ai_str)
+{
+     return bam_prob_realn_core_bw_ext(blf, ref, baq_flag, baq_extended, idaq_flag,
+                                       baq_str, ad_str, ai_str, 0);
+}
@@ -57,4 +57,11 @@ int bam_prob_realn_core_ext(const bam_lf_t *b, /*const int32 *qseq, const uint8
                             int idaq_flag, 
                             char *baq_str, char *ai_str, char *ad_str);
 
+/* as above with a minimum band width (0: none) */
+int bam_prob_realn_core_bw_ext(const bam_lf_t *b, const char *ref,
+                               int baq_flag, int baq_extended,
+                               int idaq_flag,
+                               char *baq_str, char *ai_str, char *ad_str,
+                               int min_bw);
+
 #endif
@@ -20,12 +20,13 @@ type aln_qual_strgs* = object
                    
 proc bam_prob_realn_core_ext(b: ptr bam_lf_t; `ref`: cstring; baq_flag: cint;
                              baq_extended: cint; idaq_flag: cint; baq_str: cstring;
-                             ad_str: cstring; ai_str: cstring): cint {.cdecl, importc: "bam_prob_realn_core_ext".}
+                             ad_str: cstring; ai_str: cstring; min_bw: cint): cint {.cdecl, importc: "bam_prob_realn_core_bw_ext".}
 
 
 proc bam_prob_realn_core_ext*(b: ptr bam_lf_t; `ref`: cstring; baq_flag: cint;
-                             baq_extended: cint; idaq_flag: cint; aqs: aln_qual_strgs): int =
-  result = bam_prob_realn_core_ext(b, `ref`, baq_flag, baq_extended, idaq_flag, aqs.baq_str, aqs.ad_str, aqs.ai_str)
+                             baq_extended: cint; idaq_flag: cint; aqs: aln_qual_strgs;
+                             min_bw: cint = 0): int =
+  result = bam_prob_realn_core_ext(b, `ref`, baq_flag, baq_extended, idaq_flag, aqs.baq_str, aqs.ad_str, aqs.ai_str, min_bw)
 
 
 
@@ -11,28 +11,46 @@ import strutils
 import logging
 import strformat
 # third party
-from hts/stats import fishers_exact_test
+# /
 # project specific
 import vcf
 import utils
+import perfstats
+import region
+import plpstore
+import strandbias
+import sites
 import pileup/storage/containers/operationData
 import pileup/storage/containers/qualityHistogram
 import pileup/storage/containers/positionData
+import pileup/storage/containers/allele
 
 type VarType = enum snp, ins, del
 
 const
   DEFAULT_MIN_VARQUAL* = 20
   DEFAULT_MIN_AF* = 0.005
+  DEFAULT_SIG* = 1.0# i.e. no multiple testing correction, only minVarQual
+  DEFAULT_BONF* = "dynamic"
 
 type CallParams* = object
   minVarQual*: Natural
   minAF*: float
+  sig*: float# significance level for Bonferroni corrected p-values
+  bonf*: float# Bonferroni factor
+  dynamicBonf*: bool# bonf is the number of tests performed so far
+
+
+proc defaultCallParams*(): CallParams =
+  CallParams(minVarQual:DEFAULT_MIN_VAR_QUAL,
+             minAF:DEFAULT_MIN_AF,
+             sig:DEFAULT_SIG,
+             bonf:0.0,
+             dynamicBonf:true)
 
 
 var callParams*: CallParams
-callParams = CallParams(minVarQual:DEFAULT_MIN_VAR_QUAL,
-                        minAF:DEFAULT_MIN_AF)
+callParams = defaultCallParams()
 
 var logger = newConsoleLogger(fmtStr = verboseFmtStr,
                               useStderr = true)
@@ -67,6 +85,8 @@ proc probvecTailSum(probVec: openArray[float], tailStartIndex: int): float =
 proc prunedProbDist(errProbs: openArray[float],# FIXME use ref to safe mem?
                      K: Natural, bonf = 1.0, sig = 1.0): seq[float] =
   assert K > 0
+  count(cDpCalls)
+  count(cDpObservations, errProbs.len)
   var probVec = newSeq[float64](K+1)
   var probVecPrev = newSeq[float64](K+1)
 
@@ -128,27 +148,108 @@ proc prunedProbDist(errProbs: openArray[float],# FIXME use ref to safe mem?
 
       # early exit
       if pvalue * bonf > sig:
+        count(cDpEarlyExits)
+        count(cDpObservationsUsed, n)
+        count(cDpCells, n * (K+1))
         # explicitly limiting to valid range
         return probvec[0..K]
     swap(probvec, probVecPrev)
 
+  count(cDpObservationsUsed, errProbs.len)
+  count(cDpCells, errProbs.len * (K+1))
   # return prev because we just swapped (if not pruned)
   # explicitly limiting to valid range
   return probVecPrev[0..K]
 
 
+proc setBonf*(params: var CallParams, bonf: string) =
+  ## Sets the Bonferroni factor: "dynamic" (number of tests performed so far,
+  ## as in LoFreq 2) or a fixed number. Raises ValueError if invalid.
+  if bonf == "dynamic":
+    params.dynamicBonf = true
+    params.bonf = 0.0
+  else:
+    try:
+      params.bonf = parseFloat(bonf)
+    except ValueError:
+      raise newException(ValueError, "Invalid Bonferroni factor " & bonf)
+    if params.bonf < 1.0:
+      raise newException(ValueError, "Bonferroni factor must be at least 1")
+    params.dynamicBonf = false
+
+
+proc setBonf*(bonf: string) =
+  ## Like above for the global callParams. Quits if invalid.
+  try:
+    callParams.setBonf(bonf)
+  except ValueError:
+    quit(getCurrentExceptionMsg())
+
+
+proc countTests(params: var CallParams, vartype: VarType) =
+  ## Dynamic Bonferroni: one test per possible alternate allele
+  if params.dynamicBonf:
+    params.bonf += (if vartype == snp: 3.0 else: 1.0)
+
+
+proc countTests(vartype: VarType) =
+  countTests(callParams, vartype)
+
+
+proc defersCalls*(params: CallParams): bool =
+  ## With dynamic Bonferroni correction, calls can only be filtered for
+  ## significance once all tests are counted (see filterSignificant), i.e.
+  ## they have to be held back until then
+  params.dynamicBonf and params.sig < 1.0
+
+
+proc defersCalls*(): bool =
+  defersCalls(callParams)
+
+
+proc filterSignificant*(variants: seq[Variant], params: CallParams): seq[Variant] =
+  ## Final multiple testing filter with the number of tests of the whole run,
+  ## as in LoFreq 2. callAtPos only drops calls that aren't significant with
+  ## the number of tests counted so far, which can only grow, so the result
+  ## doesn't depend on the order in which positions were called.
+  for v in variants:
+    if params.sig >= 1.0 or v.pvalue * max(1.0, params.bonf) <= params.sig:
+      result.add(v)
+
+
+proc filterSignificant*(variants: seq[Variant]): seq[Variant] =
+  filterSignificant(variants, callParams)
+
+
+proc maxPValue(params: CallParams): float =
+  ## Largest p-value that can still lead to a call, given minVarQual and,
+  ## if enabled, the Bonferroni corrected significance level
+  # prob2qual(p) >= minVarQual <=> -10*log10(p) >= minVarQual-0.5 (rounding)
+  result = pow(10.0, -(float(params.minVarQual) - 0.5) / 10.0)
+  result *= 1.0 + 1e-9# don't prune at the exact rounding boundary
+  if params.sig < 1.0:
+    result = min(result, params.sig / max(1.0, params.bonf))
+
+
+proc maxPValue(): float =
+  maxPValue(callParams)
+
+
 ## brief parse quality histogram for all operations from json node
 ## and populate opsData using its set function
-proc parseOperationData(node: JsonNode, opsData: var OperationData[string]) =
+proc parseOperationData(node: JsonNode, opsData: var OperationData[Allele],
+                        alleles: AlleleDict) =
   for event, qHist in node.pairs():
+    let allele = alleles.parse(event)
     for qual, count in qHist.pairs():
       let q = parseInt($qual)
       let c = count.getInt
-      opsData.set(event, q, c)
+      opsData.set(allele, q, c)
 
 
-## brief parse pileup object from json
-proc parsePlpJson(jsonString: string): PositionData =
+## brief parse pileup object from json. alleles are interned in the given
+## dictionary, which should be shared by all positions of a chromosome
+proc parsePlpJson*(jsonString: string, alleles: AlleleDict): PositionData =
   let dataJson = parseJson(jsonString)
   # the following assert is also used in 'nim in action' after parsing json string
   assert dataJson.kind == JObject
@@ -156,96 +257,123 @@ proc parsePlpJson(jsonString: string): PositionData =
   let refIndex = dataJson["POS"].getInt
   let refBase = dataJson["REF"].getStr[0]
   let chromosome = dataJson["CHROM"].getStr
-  result = newPositionData(refIndex, refBase, chromosome)
+  result = newPositionData(refIndex, refBase, chromosome, alleles)
 
-  parseOperationData(dataJson["M"], result.matches)
-  parseOperationData(dataJson["I"], result.insertions)
-  parseOperationData(dataJson["D"], result.deletions)
+  parseOperationData(dataJson["M"], result.matches, alleles)
+  parseOperationData(dataJson["I"], result.insertions, alleles)
+  parseOperationData(dataJson["D"], result.deletions, alleles)
 
   # FIXME what about extra keys?
   # FIXME what about missing keys? try here?
 
 
-proc setVarInfo(af: float, coverage: int, refBase: char, altBase: string,
-  baseCountsStranded: CountTable[string], vtype: VarType): InfoField =
+proc setVarInfo(af: float, coverage: int, refAllele: Allele, altAllele: Allele,
+  baseCountsStranded: CountTable[Allele], vtype: VarType): InfoField =
   result.af = af
   result.dp = coverage
   var dp4: Dp4
-  dp4.refForward = baseCountsStranded.getOrDefault($refBase.toUpperAscii)
-  dp4.refReverse = baseCountsStranded.getOrDefault($refBase.toLowerAscii)
-  dp4.altForward = baseCountsStranded.getOrDefault(altBase.toUpperAscii)
-  dp4.altReverse = baseCountsStranded.getOrDefault(altBase.toLowerAscii)
+  var refAllele = refAllele
   if vtype == ins or vtype == del:# indel
-    dp4.refForward = baseCountsStranded.getOrDefault($REF_SYMBOL_AT_INDEL_FW)
-    dp4.refReverse = baseCountsStranded.getOrDefault($REF_SYMBOL_AT_INDEL_RV)
+    refAllele = INDEL_REF_ALLELE
+  dp4.refForward = baseCountsStranded.getOrDefault(refAllele)
+  dp4.refReverse = baseCountsStranded.getOrDefault(refAllele.withStrand(true))
+  dp4.altForward = baseCountsStranded.getOrDefault(altAllele)
+  dp4.altReverse = baseCountsStranded.getOrDefault(altAllele.withStrand(true))
   result.dp4 = dp4
-  var f = fishers_exact_test(dp4.refForward, dp4.refReverse,
+  result.sb = strandBiasQual(dp4.refForward, dp4.refReverse,
     dp4.altForward, dp4.altReverse)
-  result.sb = prob2qual(f.two)
   result.vtype = $vtype
 
 
 proc getCountsAndEProbs[T](opData: T, vartype: VarType):
-  (seq[float], Natural, CountTable[string], CountTable[string]) =
+  (seq[float], Natural, CountTable[Allele], CountTable[Allele]) =
   # fill array of error probabilities, set baseCounts and baseCountsStranded.
-  # note that base's strand is indicated by its case.
+  # note that the strand is encoded in the allele.
   var eProbs: seq[float] = @[]# base error probabilites
-  var baseCounts = initCountTable[string]()# base counts
-  var baseCountsStranded = initCountTable[string]()# strand aware counts
+  var baseCounts = initCountTable[Allele]()# base counts
+  var baseCountsStranded = initCountTable[Allele]()# strand aware counts
   var coverage: Natural = 0
 
   for base, qhist in pairs(opData.histogram):
     var thisBaseCount = 0
-    if vartype == snp:
-      assert len(base) == 1
     for qual, count in qhist:
       assert count>=0
       thisBaseCount += count
       # snp: '*' are deletions, i.e. physical coverage (count) with q=-1 (ignore)
-      if vartype == snp and $base == $DEFAULT_BLANK_SYMBOL:
+      if vartype == snp and base == BLANK_ALLELE:
         continue
       assert qual>=0
       let e = qual2prob(qual)
       for i in countup(1, count):
         eProbs.add(e)
-    baseCountsStranded.inc($base, thisBaseCount)
-    baseCounts.inc($base.toUpperAscii, thisBaseCount)
+    baseCountsStranded.inc(base, thisBaseCount)
+    baseCounts.inc(base.forward, thisBaseCount)
     coverage += thisBaseCount
 
   return (eProbs, coverage, baseCounts, baseCountsStranded)
 
 
+proc countsStr(counts: CountTable[Allele], alleles: AlleleDict): string =
+  # for debugging output only
+  for a, c in counts:
+    result.add(alleles.toString(a) & ":" & $c & " ")
+
+
+proc opData(plp: PositionData, vartype: VarType): var OperationData[Allele] =
+  case vartype
+  of snp: plp.matches
+  of ins: plp.insertions
+  of del: plp.deletions
+
+
+proc aggregateMaxAltCount(opData: OperationData[Allele], vartype: VarType,
+                          refAllele: Allele): int =
+  # count of the most frequent alt allele, taken from the running aggregates,
+  # i.e. without a walk over the quality histogram
+  for a, c in opData.callableCounts:
+    let b = a.forward
+    if vartype == snp and (b == refAllele or b == N_ALLELE):
+      continue
+    if b == BLANK_ALLELE or b == INDEL_REF_ALLELE:
+      continue
+    result = max(result, opData.alleleCount(b))
+
+
 ## result is a sequence, because we might return multiple variants for this position
-proc callAtPos*(plp: PositionData): seq[Variant] =
+proc callAtPos*(plp: PositionData, params: var CallParams): seq[Variant] =
+  ## Calls variants at one position with the given parameters (which are
+  ## updated if dynamicBonf is set)
   var eprobs: seq[float]
   var coverage: Natural
-  var baseCounts: CountTable[string]
-  var baseCountsStranded: CountTable[string]
+  var baseCounts: CountTable[Allele]
+  var baseCountsStranded: CountTable[Allele]
 
   if plp.refBase notin "ACGT":
     return
+  let refAllele = plp.alleles.baseAllele(plp.refBase)
 
   for vartype in low(VarType)..high(VarType):
-    # FIXME there got to be an easier way to do this
-    if vartype == snp:
-      plp.matches.clean()
-      (eprobs, coverage, baseCounts, baseCountsStranded) = getCountsAndEProbs(plp.matches, snp)
-    elif vartype == ins:
-      plp.insertions.clean()
-      (eprobs, coverage, baseCounts, baseCountsStranded) = getCountsAndEProbs(plp.insertions, ins)
-    elif vartype == del:
-      plp.deletions.clean()
-      (eprobs, coverage, baseCounts, baseCountsStranded) = getCountsAndEProbs(plp.deletions, del)
-    else:
-      raise newException(ValueError, "Illegal vartype" & $vartype)
+    # coverage and counts are known from the aggregates. only walk the
+    # histogram (clean and eprobs) if minAF can be reached at all
+    if plp.opData(vartype).callableCoverage == 0:
+      continue
+    params.countTests(vartype)
+    let aggMaxAltCount = aggregateMaxAltCount(plp.opData(vartype), vartype, refAllele)
+    if aggMaxAltCount == 0 or
+       aggMaxAltCount/plp.opData(vartype).callableCoverage < params.minAF:
+      count(cTestsSkipped)
+      continue
+    plp.opData(vartype).clean()
+    (eprobs, coverage, baseCounts, baseCountsStranded) = getCountsAndEProbs(plp.opData(vartype), vartype)
+    assert coverage == plp.opData(vartype).callableCoverage
 
     # determine valid alt bases and max alt count (not merged into above for readability)
-    var altBases: seq[string]
+    var altBases: seq[Allele]
     var maxAltCount = 0
     for b, c in pairs(baseCounts):
-      if vartype == snp and (b[0] == plp.refBase or b[0] == 'N'):
+      if vartype == snp and (b == refAllele or b == N_ALLELE):
         continue
-      if b[0] in @[DEFAULT_BLANK_SYMBOL, REF_SYMBOL_AT_INDEL_FW, REF_SYMBOL_AT_INDEL_RV]:
+      if b == BLANK_ALLELE or b == INDEL_REF_ALLELE:
         continue
       altBases.add(b)
       if c > maxAltCount:
@@ -253,10 +381,15 @@ proc callAtPos*(plp: PositionData): seq[Variant] =
 
     # loop over altBases and determine whether they are variants
     let maxAF = maxAltCount/coverage
-    if maxAF >= callParams.minAF and maxAltCount > 0:# don't even compute probDist if we can't reach minAF with most abundant base
-      logger.log(lvlDebug, fmt"Testing {vartype} at {plp.chromosome}:{plp.refIndex}: {baseCounts}")
+    if maxAF >= params.minAF and maxAltCount > 0:# don't even compute probDist if we can't reach minAF with most abundant base
+      logger.log(lvlDebug, fmt"Testing {vartype} at {plp.chromosome}:{plp.refIndex}: " & countsStr(baseCounts, plp.alleles))
       #logger.log(lvlDebug, fmt"eprobs  {eprobs}")
-      let probVec = prunedProbDist(eProbs, maxAltCount)# FIXME call "by reference" to safe memory?
+      # the p-value for maxAltCount only grows with every observation, so the
+      # DP stops as soon as it exceeds the largest p-value that could still
+      # be called. probVec is then incomplete, but the first (most frequent)
+      # alt base fails the quality check below in that case anyway.
+      let probVec = prunedProbDist(eProbs, maxAltCount, bonf = 1.0,
+                                   sig = maxPValue(params))# FIXME call "by reference" to safe memory?
       var prevAltCount = high(int)# paranoid check to ensure sorting of pairs and early exit
       sort(baseCounts)
       for altBase, altCount in pairs(baseCounts):
@@ -269,41 +402,76 @@ proc callAtPos*(plp: PositionData): seq[Variant] =
 
         # need to check minAF again, because test above was for most frequent base only
         let af = altCount/coverage
-        if af < callParams.minAF or altCount == 0:
+        if af < params.minAF or altCount == 0:
           #echo "DEBUG af<minAF for " & altBase & ":" & $altCount & " = " & $af & "<" & $minAF
           break# early exit possible since baseCounts are sorted
 
         # for maxAltCount exp(probVec[altCount]) == exp(probvecTailSum(probVec, altCount))
         let pvalue = exp(probvecTailSum(probVec, altCount))
         let qual = prob2qual(pvalue)
-        logger.log(lvlDebug, fmt"af={af:.6f} altCount={altCount} for {vartype} {altBase} gives qual={qual}")
-        if qual < callParams.minVarQual:
+        let altStr = plp.alleles.toString(altBase)
+        logger.log(lvlDebug, fmt"af={af:.6f} altCount={altCount} for {vartype} {altStr} gives qual={qual}")
+        if qual < params.minVarQual:
           #echo "DEBUG qual<minQual for " & altBase & ":" & $altCount & " = " & $qual & "<" & $minQual
           break# early exit possible since baseCounts are sorted
+        if params.sig < 1.0 and pvalue * max(1.0, params.bonf) > params.sig:
+          break# not significant after multiple testing correction (with a dynamic factor see filterSignificant)
 
         var varRefBase, varAltBase: string
         if vartype == snp:
           varRefBase = $plp.refBase
-          varAltBase = altBase
+          varAltBase = altStr
         elif vartype == ins:
           varRefBase = $plp.refBase
-          varAltBase = $plp.refBase & altBase
+          varAltBase = $plp.refBase & altStr
         elif vartype == del:
-          varRefBase = $plp.refBase & altBase
+          varRefBase = $plp.refBase & altStr
           varAltBase = $plp.refBase
         else:
           raise newException(ValueError, "Illegal vartype" & $vartype)
 
         var vcfVar = Variant(chrom : plp.chromosome, pos : plp.refIndex,
           id : ".", refBase : varRefBase, alt : varAltBase, qual : qual,
-          filter : ".")
-        vcfVar.info = setVarInfo(af, coverage, plp.refBase, altBase,
+          filter : ".", pvalue : pvalue)
+        vcfVar.info = setVarInfo(af, coverage, refAllele, altBase,
           baseCountsStranded, vartype)
         result.add(vcfVar)
 
 
-proc call_from_plp*(plpFname: string, minVarQual: int = DEFAULT_MIN_VAR_QUAL,
-                  minAF: float = DEFAULT_MIN_AF, logLevel = 0) =
+proc callAtPos*(plp: PositionData): seq[Variant] =
+  ## Calls variants at one position with the global callParams
+  callAtPos(plp, callParams)
+
+
+proc forceCallAtPos*(plp: PositionData, site: Site): Variant =
+  ## Statistics for the allele of a known site, reported regardless of
+  ## minVarQual, minAF and significance (and without counting a test). plp is
+  ## the pileup at the site or nil if there is none, which gives DP=0.
+  result = Variant(chrom: site.chrom, pos: site.pos, id: site.id,
+    refBase: site.refBase, alt: site.alt, qual: 0, filter: ".")
+  let vartype = case site.kind
+    of skSnp: snp
+    of skIns: ins
+    of skDel: del
+  result.info.vtype = $vartype
+  if plp.isNil:
+    return
+
+  plp.opData(vartype).clean()
+  let (eprobs, coverage, baseCounts, baseCountsStranded) =
+    getCountsAndEProbs(plp.opData(vartype), vartype)
+  let altBase = plp.alleles.intern(site.allele)
+  let altCount = baseCounts.getOrDefault(altBase)
+  let af = if coverage > 0: altCount/coverage else: 0.0
+  if altCount > 0:
+    # no pruning: the p-value is needed whatever it is
+    let probVec = prunedProbDist(eprobs, altCount)
+    result.qual = prob2qual(exp(probvecTailSum(probVec, altCount)))
+  result.info = setVarInfo(af, coverage, plp.alleles.baseAllele(plp.refBase),
+    altBase, baseCountsStranded, vartype)
+
+
+proc setLogLevel(logLevel: int) =
   if logLevel >= 3:
     setLogFilter(lvlDebug)
   elif logLevel == 2:
@@ -315,6 +483,55 @@ proc call_from_plp*(plpFname: string, minVarQual: int = DEFAULT_MIN_VAR_QUAL,
   else:
     quit("Invalid log level")
 
+
+proc recall*(plpStore: string, regions = "", bedFname = "",
+             minVarQual: int = DEFAULT_MIN_VAR_QUAL,
+             minAF: float = DEFAULT_MIN_AF,
+             sig: float = DEFAULT_SIG, bonf = DEFAULT_BONF, logLevel = 0) =
+  ## Calls variants from a pileup store (see 'call --plpStore'), optionally
+  ## limited to regions, without redoing the pileup
+  setLogLevel(logLevel)
+  if len(regions) != 0 and len(bedFname) != 0:
+    quit("Can't read regions from bed and string at the same time")
+
+  var regs: seq[Region]
+  if len(regions) != 0:
+    for reg in parseRegionsStr(regions):
+      regs.add(reg)
+  elif len(bedFname) != 0:
+    for reg in getBedRegions(bedFname):
+      regs.add(reg)
+  else:
+    for reg in storedRegions(plpStore):
+      regs.add(reg)
+
+  echo vcfHeader()
+
+  callParams.minVarQual = minVarQual
+  callParams.minAF = minAF
+  callParams.sig = sig
+  setBonf(bonf)
+
+  var deferred: seq[Variant]
+  for reg in regs:
+    logger.log(lvlInfo, "Recalling " & $reg)
+    let alleles = newAlleleDict()
+    for plpJson in queryPlpStore(plpStore, reg):
+      var plp = parsePlpJson(plpJson, alleles)
+      for v in callAtPos(plp):
+        if defersCalls():
+          deferred.add(v)
+        else:
+          echo $v
+  for v in filterSignificant(deferred):
+    echo $v
+  logger.log(lvlDebug, "Done. Goodbye")
+
+
+proc call_from_plp*(plpFname: string, minVarQual: int = DEFAULT_MIN_VAR_QUAL,
+                  minAF: float = DEFAULT_MIN_AF, logLevel = 0) =
+  setLogLevel(logLevel)
+
   echo vcfHeader()
 
   callParams.minVarQual = minVarQual
@@ -325,8 +542,9 @@ proc call_from_plp*(plpFname: string, minVarQual: int = DEFAULT_MIN_VAR_QUAL,
     if plpFh != stdin:
       plpFh.close
 
+  let alleles = newAlleleDict()
   for line in plpFh.lines:
-    var plp = parsePlpJson(line)
+    var plp = parsePlpJson(line, alleles)
     for v in callAtPos(plp):
       echo $v
   logger.log(lvlDebug, "Done. Goodbye")
@@ -377,5 +595,70 @@ when isMainModule:
     pvalue = exp(probvec[num_failures]);
     #echo("DEBUG num_failures=" & $num_failures & " pvalue=" & $pvalue  & " prob2qual=" & $prob2qual(pvalue))
     doAssert abs(pvalue - 0.02240387) < 1e-6
-  
+
+  testblock "maxPValue":
+    callParams.minVarQual = 20
+    callParams.sig = 1.0
+    doAssert prob2qual(maxPValue() * 0.999) >= 20
+    doAssert prob2qual(maxPValue() * 1.001) < 20
+    callParams.sig = 0.01
+    setBonf("100")
+    doAssert abs(maxPValue() - 0.0001) < 1e-12
+    setBonf("dynamic")
+    countTests(snp)
+    countTests(ins)
+    doAssert callParams.bonf == 4.0
+    callParams.sig = DEFAULT_SIG
+
+  testblock "filterSignificant":
+    var params = defaultCallParams()
+    params.sig = 0.05
+    doAssert params.defersCalls
+    var vars: seq[Variant]
+    for p in [0.001, 0.01, 0.02]:
+      vars.add(Variant(pvalue: p))
+    # same verdict whatever the number of tests was during calling
+    params.bonf = 4.0
+    doAssert filterSignificant(vars, params).len == 2
+    params.bonf = 10.0
+    doAssert filterSignificant(vars, params).len == 1
+    params.setBonf("10")
+    doAssert not params.defersCalls
+
+  testblock "early exit on noisy data":
+    var eprobs = newSeq[float](1000)
+    for i in 0..<len(eprobs):
+      eprobs[i] = 0.1
+    num_failures = 10
+    let maxP = qual2prob(20)
+    probvec = pruned_prob_dist(eprobs, num_failures, bonf=1.0, sig=maxP)
+    doAssert len(probvec) == num_failures+1
+    # pruned result is still conclusive: not significant
+    doAssert exp(probvec[num_failures]) > maxP
+
+  testblock "forceCallAtPos":
+    var plp = newPositionData(10, 'A', "chr1", newAlleleDict())
+    let c = plp.alleles.baseAllele('C')
+    plp.addMatch(plp.alleles.baseAllele('A'), 30, false, 8)
+    plp.addMatch(plp.alleles.baseAllele('A'), 30, true, 8)
+    plp.addMatch(c, 30, false, 3)
+    plp.addMatch(c, 30, true, 1)
+    let site = Site(chrom: "chr1", pos: 10, id: "mut1", refBase: "A",
+                    alt: "C", kind: skSnp, allele: "C")
+    let v = forceCallAtPos(plp, site)
+    doAssert v.id == "mut1" and v.pos == 10 and v.qual > 0
+    doAssert v.info.dp == 20 and abs(v.info.af - 0.2) < 1e-9
+    doAssert v.info.dp4 == Dp4(refForward: 8, refReverse: 8, altForward: 3, altReverse: 1)
+    # same as a regular call, which ignores thresholds here
+    callParams.minVarQual = 0
+    callParams.minAF = 0.0
+    doAssert callAtPos(plp)[0].qual == v.qual
+    callParams = defaultCallParams()
+    # allele not seen and no pileup at all: reported anyway
+    let absent = forceCallAtPos(plp, Site(chrom: "chr1", pos: 10, refBase: "A",
+                                          alt: "AT", kind: skIns, allele: "T"))
+    doAssert absent.qual == 0 and absent.info.af == 0.0 and absent.info.vtype == "ins"
+    let noData = forceCallAtPos(nil, site)
+    doAssert noData.info.dp == 0 and noData.qual == 0 and $noData != ""
+
   echo "OK: all tests passed"
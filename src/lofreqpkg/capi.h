@@ -0,0 +1,50 @@
+/* LoFreq: C interface for calling variants in-process (see capi.nim)
+ *
+ * - License: The MIT License
+ */
+
+#ifndef LOFREQ_CAPI_H
+#define LOFREQ_CAPI_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lofreq_variant {
+     const char *chrom;
+     int64_t pos;
+     const char *ref;
+     const char *alt;
+     int qual;
+     double af;
+     int dp;
+     int dp4[4]; /* ref-fw, ref-rv, alt-fw, alt-rv */
+     int sb;
+     const char *type;
+} lofreq_variant_t;
+
+/* opaque handle for an indexed BAM file and its (indexed) reference. NULL on error */
+void *lofreq_open(const char *bam_fname, const char *fa_fname);
+void lofreq_close(void *handle);
+
+/* max_cov <= 0 means no limit. returns 0 on success, -1 on error */
+int lofreq_set_pileup_params(void *handle, int min_cov, int max_cov, int min_bq, int use_mq);
+/* bonf: "dynamic" or a number. returns 0 on success, -1 on error */
+int lofreq_set_call_params(void *handle, int min_var_qual, double min_af, double sig, const char *bonf);
+
+/* calls variants in chrom:start-end (zero-based, half-open) and returns their
+ * number or -1 on error. results are owned by the handle and valid until the
+ * next call or lofreq_close() */
+int lofreq_call_region(void *handle, const char *chrom, int64_t start, int64_t end);
+int lofreq_get_variant(void *handle, int i, lofreq_variant_t *variant);
+
+/* message of the last error */
+const char *lofreq_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,141 @@
+## LoFreq: C ABI of the library interface (module 'api'), declared in
+## capi.h. Build a shared library with
+##
+##   nim c --app:lib -d:release -o:liblofreq.so src/lofreqpkg/capi.nim
+##
+## Handles are opaque. Variants of the last query are owned by the handle
+## and stay valid until the next query or lofreq_close(). Functions return
+## -1 (or NULL) on error, see lofreq_last_error().
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+
+# project specific
+import api
+import region
+import vcf
+
+
+type CHandle = ref object
+  lofreq: LoFreq
+  variants: seq[Variant]
+
+type CVariant {.bycopy.} = object
+  ## Mirrors lofreq_variant_t in capi.h
+  chrom: cstring
+  pos: int64
+  refBase: cstring
+  alt: cstring
+  qual: cint
+  af: cdouble
+  dp: cint
+  dp4: array[4, cint]
+  sb: cint
+  vtype: cstring
+
+
+var lastError = ""
+
+
+proc lofreq_last_error(): cstring {.exportc, dynlib, cdecl.} =
+  cstring(lastError)
+
+
+proc lofreq_open(bamFname, faFname: cstring): pointer {.exportc, dynlib, cdecl.} =
+  try:
+    let h = CHandle(lofreq: openLoFreq($bamFname, $faFname))
+    GC_ref(h)
+    return cast[pointer](h)
+  except CatchableError:
+    lastError = getCurrentExceptionMsg()
+    return nil
+
+
+proc lofreq_close(handle: pointer) {.exportc, dynlib, cdecl.} =
+  let h = cast[CHandle](handle)
+  h.lofreq.close()
+  GC_unref(h)
+
+
+proc lofreq_set_pileup_params(handle: pointer, minCov, maxCov, minBQ,
+                              useMQ: cint): cint {.exportc, dynlib, cdecl.} =
+  ## maxCov <= 0 means no limit
+  let h = cast[CHandle](handle)
+  if minCov < 0 or minBQ < 0:
+    lastError = "Invalid pileup parameters"
+    return -1
+  h.lofreq.plpParams.minCov = minCov
+  h.lofreq.plpParams.maxCov = if maxCov <= 0: high(int) else: maxCov
+  h.lofreq.plpParams.minBQ = minBQ
+  h.lofreq.plpParams.useMQ = useMQ != 0
+  return 0
+
+
+proc lofreq_set_call_params(handle: pointer, minVarQual: cint, minAF: cdouble,
+                            sig: cdouble, bonf: cstring): cint {.exportc, dynlib, cdecl.} =
+  ## bonf is "dynamic" or a number (see call)
+  let h = cast[CHandle](handle)
+  if minVarQual < 0:
+    lastError = "Invalid minimum variant quality"
+    return -1
+  try:
+    h.lofreq.callParams.setBonf($bonf)
+  except ValueError:
+    lastError = getCurrentExceptionMsg()
+    return -1
+  h.lofreq.callParams.minVarQual = minVarQual
+  h.lofreq.callParams.minAF = minAF
+  h.lofreq.callParams.sig = sig
+  return 0
+
+
+proc lofreq_call_region(handle: pointer, chrom: cstring,
+                        start, stop: int64): cint {.exportc, dynlib, cdecl.} =
+  ## Calls variants in chrom:start-stop (zero-based, half-open). Returns the
+  ## number of variants
+  let h = cast[CHandle](handle)
+  h.variants.setLen(0)
+  if start < 0 or stop <= start:
+    lastError = "Invalid region"
+    return -1
+  try:
+    let reg = Region(sq: $chrom, s: Natural(start), e: Natural(stop))
+    for v in h.lofreq.variants(reg):
+      h.variants.add(v)
+  except CatchableError:
+    lastError = getCurrentExceptionMsg()
+    return -1
+  return cint(len(h.variants))
+
+
+proc lofreq_get_variant(handle: pointer, i: cint,
+                        v: ptr CVariant): cint {.exportc, dynlib, cdecl.} =
+  ## Fills v with variant i of the last query
+  let h = cast[CHandle](handle)
+  if i < 0 or i >= len(h.variants):
+    lastError = "Invalid variant index"
+    return -1
+  let src = h.variants[i]
+  v.chrom = cstring(src.chrom)
+  v.pos = src.pos
+  v.refBase = cstring(src.refBase)
+  v.alt = cstring(src.alt)
+  v.qual = cint(src.qual)
+  v.af = src.info.af
+  v.dp = cint(src.info.dp)
+  v.dp4 = [cint(src.info.dp4.refForward), cint(src.info.dp4.refReverse),
+           cint(src.info.dp4.altForward), cint(src.info.dp4.altReverse)]
+  v.sb = cint(src.info.sb)
+  v.vtype = cstring(src.info.vtype)
+  return 0
+
+
+when isMainModule:
+  import utils
+
+  testblock "open failure":
+    doAssert lofreq_open("does-not-exist.bam", "does-not-exist.fa").isNil
+    doAssert len($lofreq_last_error()) > 0
+
+  echo "OK: all tests passed"
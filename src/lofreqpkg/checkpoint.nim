@@ -0,0 +1,150 @@
+## LoFreq: checkpointing of results per region chunk
+##
+## Results of every completed region chunk are written to their own file in
+## the checkpoint directory and recorded in a small manifest. A restarted run
+## (with identical parameters) skips chunks that are listed there. Once all
+## chunks are done, they are concatenated in coordinate order.
+##
+## Manifest format (tab separated): a first line with magic string and
+## parameter fingerprint, followed by one line per completed chunk: chunk
+## index, region and file name.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+# standard
+import os
+import sets
+import strutils
+import strformat
+# third party
+# /
+# project specific
+import region
+
+
+const MANIFEST_NAME = "manifest.tsv"
+const MANIFEST_MAGIC = "#lofreq-checkpoint"
+
+
+type Checkpoint* = object
+  dir*: string
+  ext: string# chunk file extension
+  done: HashSet[int]
+
+
+proc manifestPath(cp: Checkpoint): string =
+  joinPath(cp.dir, MANIFEST_NAME)
+
+
+proc chunkFname*(cp: Checkpoint, idx: int): string =
+  joinPath(cp.dir, fmt"chunk-{idx:06}{cp.ext}")
+
+
+proc openCheckpoint*(dir: string, fingerprint: string, chunks: seq[Region],
+                     ext = ".vcf"): Checkpoint =
+  ## Opens (or creates) a checkpoint directory. Chunks listed in an existing
+  ## manifest are considered done, if the fingerprint (i.e. parameters) and
+  ## the chunk's region didn't change.
+  result.dir = dir
+  result.ext = ext
+  result.done = initHashSet[int]()
+  if not dirExists(dir):
+    createDir(dir)
+
+  let manifest = result.manifestPath()
+  if not fileExists(manifest):
+    writeFile(manifest, MANIFEST_MAGIC & "\t" & fingerprint & "\n")
+    return
+
+  var first = true
+  for line in lines(manifest):
+    let fields = line.split('\t')
+    if first:
+      if len(fields) != 2 or fields[0] != MANIFEST_MAGIC:
+        quit("Not a valid checkpoint manifest: " & manifest)
+      if fields[1] != fingerprint:
+        quit("Checkpoint in " & dir & " was created with different parameters")
+      first = false
+      continue
+    if len(fields) != 3:
+      continue# incomplete line from an interrupted write
+    let idx = parseInt(fields[0])
+    if idx < len(chunks) and fields[1] == $chunks[idx] and
+       fileExists(joinPath(dir, fields[2])):
+      result.done.incl(idx)
+
+
+proc isDone*(cp: Checkpoint, idx: int): bool =
+  idx in cp.done
+
+
+proc numDone*(cp: Checkpoint): int =
+  len(cp.done)
+
+
+proc tmpChunkFname*(cp: Checkpoint, idx: int): string =
+  ## File to write the chunk to. Only renamed to its final name by markDone()
+  cp.chunkFname(idx) & ".tmp"
+
+
+proc markDone*(cp: var Checkpoint, idx: int, reg: Region) =
+  ## Moves the completed tmp chunk file in place and records it in the manifest
+  let fname = cp.chunkFname(idx)
+  moveFile(cp.tmpChunkFname(idx), fname)
+  var fh = open(cp.manifestPath(), fmAppend)
+  fh.writeLine($idx & "\t" & $reg & "\t" & extractFilename(fname))
+  fh.close()
+  cp.done.incl(idx)
+
+
+proc concatChunks*(cp: Checkpoint, numChunks: int, dst: File) =
+  ## Writes all chunks in order to dst
+  const bufSize = 1 shl 16
+  var buf = newString(bufSize)
+  for idx in 0..<numChunks:
+    doAssert cp.isDone(idx), "Chunk " & $idx & " not done"
+    var fh = open(cp.chunkFname(idx))
+    while true:
+      let n = fh.readBuffer(addr buf[0], bufSize)
+      if n == 0:
+        break
+      discard dst.writeBuffer(addr buf[0], n)
+    fh.close()
+
+
+when isMainModule:
+  import sequtils
+  import utils
+
+  testblock "chunks":
+    let reg = Region(sq: "chr1", s: 0, e: 25)
+    let chunks = toSeq(reg.chunks(10))
+    doAssert len(chunks) == 3
+    doAssert chunks[0].s == 0 and chunks[0].e == 10
+    doAssert chunks[2].s == 20 and chunks[2].e == 25
+
+  testblock "manifest roundtrip":
+    let dir = joinPath(getTempDir(), "lofreq-checkpoint-test-" & $getCurrentProcessId())
+    let chunks = toSeq(Region(sq: "chr1", s: 0, e: 25).chunks(10))
+    var cp = openCheckpoint(dir, "params", chunks)
+    doAssert cp.numDone() == 0
+    writeFile(cp.tmpChunkFname(1), "B\n")
+    cp.markDone(1, chunks[1])
+
+    var cp2 = openCheckpoint(dir, "params", chunks)
+    doAssert cp2.isDone(1)
+    doAssert not cp2.isDone(0)
+    writeFile(cp2.tmpChunkFname(0), "A\n")
+    cp2.markDone(0, chunks[0])
+    writeFile(cp2.tmpChunkFname(2), "C\n")
+    cp2.markDone(2, chunks[2])
+
+    let outFname = joinPath(dir, "out.txt")
+    var fh = open(outFname, fmWrite)
+    cp2.concatChunks(len(chunks), fh)
+    fh.close()
+    doAssert readFile(outFname) == "A\nB\nC\n"
+    removeDir(dir)
+
+  echo "OK: all tests passed"
@@ -0,0 +1,115 @@
+## LoFreq: process-wide htslib thread pool
+##
+## All BAM/CRAM readers (and any BAM/CRAM/VCF writers) attach to one shared
+## htslib thread pool instead of spawning threads per file, which would
+## oversubscribe the machine once compute runs in parallel as well. The pool
+## is created once and lives until the process exits (files might still be
+## closed by the GC after we are done, so it's never destroyed explicitly).
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+# standard
+import cpuinfo
+import logging
+# third party
+import hts
+# project specific
+# /
+
+{.passL: "-lhts".}
+
+
+const
+  AUTO_HTS_THREADS* = -1# size pool automatically
+  MAX_AUTO_HTS_THREADS = 8# decompression rarely scales beyond this
+
+
+# htsThreadPool from hts.h. hts_tpool is opaque
+type htsThreadPool {.bycopy.} = object
+  pool: pointer
+  qsize: cint
+
+
+proc hts_tpool_init(n: cint): pointer {.cdecl, importc: "hts_tpool_init".}
+proc hts_set_thread_pool(fp: pointer, p: ptr htsThreadPool): cint {.cdecl,
+  importc: "hts_set_thread_pool".}
+
+
+var htsPool: htsThreadPool
+var poolSize = 0
+
+var logger = newConsoleLogger(fmtStr = verboseFmtStr, useStderr = true)
+
+
+proc autoHtsThreads*(computeThreads: Natural = 1): int =
+  ## Number of I/O threads to use next to the given number of compute threads
+  result = min(MAX_AUTO_HTS_THREADS, countProcessors() - computeThreads)
+  result = max(1, result)
+
+
+proc initHtsPool*(nThreads: int, computeThreads: Natural = 1) =
+  ## Creates the process-wide pool with nThreads threads. AUTO_HTS_THREADS
+  ## sizes the pool against the number of compute threads. Zero means no
+  ## pool, i.e. single threaded I/O. Only the first call has an effect.
+  if not htsPool.pool.isNil:
+    return
+  let n = if nThreads == AUTO_HTS_THREADS: autoHtsThreads(computeThreads) else: nThreads
+  if n < 0:
+    quit("Invalid number of htslib threads " & $nThreads)
+  if n == 0:
+    return
+  htsPool.pool = hts_tpool_init(cint(n))
+  if htsPool.pool.isNil:
+    quit("Could not create htslib thread pool with " & $n & " threads")
+  poolSize = n
+  logger.log(lvlInfo, "Using htslib thread pool with " & $n & " threads")
+
+
+proc htsPoolSize*(): int =
+  poolSize
+
+
+proc attachHtsFile*(fp: pointer) =
+  ## Attaches an opened htsFile to the pool (no-op if there is no pool)
+  if htsPool.pool.isNil or fp.isNil:
+    return
+  if hts_set_thread_pool(fp, addr htsPool) != 0:
+    logger.log(lvlWarn, "Could not attach file to htslib thread pool")
+
+
+proc attach*(bam: Bam) =
+  attachHtsFile(cast[pointer](bam.hts))
+
+
+proc attach*(v: VCF) =
+  attachHtsFile(cast[pointer](v.hts))
+
+
+proc openBam*(bam: var Bam, fname: string, faFname = "",
+              index = false): bool =
+  ## Opens a BAM/CRAM/SAM file and attaches it to the pool. For CRAM the
+  ## reference (faFname) is used for reference-based decoding.
+  var ok: bool
+  if len(faFname) > 0:
+    ok = open(bam, fname, index=index, fai=faFname)
+  else:
+    ok = open(bam, fname, index=index)
+  if ok:
+    bam.attach()
+  return ok
+
+
+when isMainModule:
+  import utils
+
+  testblock "autoHtsThreads":
+    doAssert autoHtsThreads(high(int) div 2) == 1
+    doAssert autoHtsThreads(0) >= 1
+    doAssert autoHtsThreads(0) <= MAX_AUTO_HTS_THREADS
+
+  testblock "initHtsPool":
+    initHtsPool(2)
+    doAssert htsPoolSize() == 2
+
+  echo "OK: all tests passed"
@@ -0,0 +1,70 @@
+## LoFreq: per-chromosome read counts from the BAM index
+##
+## BAI and CSI indices store the number of mapped and unmapped reads per
+## reference sequence (as reported by samtools idxstats). This allows to skip
+## chromosomes without reads and to stop reading once all mapped reads have
+## been seen, without touching the data. CRAM indices don't keep these
+## counts, in which case nothing is known.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+# standard
+# /
+# third party
+import hts
+# project specific
+# /
+
+{.passL: "-lhts".}
+
+
+proc sam_index_load(fp: pointer, fn: cstring): pointer {.cdecl,
+  importc: "sam_index_load".}
+proc hts_idx_get_stat(idx: pointer, tid: cint, mapped: ptr uint64,
+                      unmapped: ptr uint64): cint {.cdecl,
+  importc: "hts_idx_get_stat".}
+proc hts_idx_destroy(idx: pointer) {.cdecl, importc: "hts_idx_destroy".}
+
+
+proc mappedReadCounts*(bam: Bam, fname: string): seq[int64] =
+  ## Number of mapped reads per target id (in header order), as listed in
+  ## the index of bam. The index is only loaded (from fname) if bam wasn't
+  ## opened with it. Empty if the index is missing or has no counts.
+  var idx = cast[pointer](bam.idx)
+  if idx.isNil:
+    idx = sam_index_load(cast[pointer](bam.hts), fname)
+    if idx.isNil:
+      return
+  defer:
+    if idx != cast[pointer](bam.idx):
+      hts_idx_destroy(idx)
+  let n = len(targets(bam.hdr))
+  result = newSeq[int64](n)
+  for tid in 0..<n:
+    var mapped, unmapped: uint64
+    if hts_idx_get_stat(idx, cint(tid), addr mapped, addr unmapped) < 0:
+      # no counts, e.g. CRAM index. note that hts_idx_get_stat() also fails
+      # for chromosomes without any reads in BAI/CSI, which is what we are
+      # after, but we can't tell the two apart unless at least one works
+      result[tid] = -1
+    else:
+      result[tid] = int64(mapped)
+  var anyKnown = false
+  for c in result:
+    if c >= 0:
+      anyKnown = true
+      break
+  if not anyKnown:
+    return @[]
+  for c in result.mitems:
+    if c < 0:
+      c = 0
+
+
+proc totalMapped*(counts: seq[int64]): int64 =
+  ## Sum of all mapped reads or -1 if unknown
+  if len(counts) == 0:
+    return -1
+  for c in counts:
+    result += c
@@ -13,6 +13,8 @@ import hts
 
 # project specific
 import utils
+import htspool
+import packedref
 
 const DINDELQ = "!MMMLKEC@=<;:988776"# 1-based 18
 # ? const DINDELQ2 = "!CCCBA;963210/----,"#  *10 
@@ -27,29 +29,6 @@ proc skipRead(rec: Record): bool =
   return false
 
 
- # a groupby variant that splits a string into runs of identical
- # characters which is yielded included the length of the run
-iterator groupBy(query: string): (int, char) =
-  doAssert len(query) != 0
-  var runLength = 1 
-  var runChar = query[0]
-  for c in query[1 .. ^1]:
-    if c == runChar:
-      inc runLength
-    else:
-      yield (runLength, runChar)
-      runLength = 1 
-      runChar = c
-  yield (runLength, runChar)
-
-
-proc findHomopolymerRuns(query: string): seq[int] =
-  for (l, c) in groupBy(query):
-    result.add(l)
-    for i in countup(1, l-1):
-      result.add(1)
-      
-
 proc createRec(rec: Record, bi: string, bd: string): string =
     # We can't set BAM values in htsnim (argh), so convert to string / SAM
     # as in https://github.com/brentp/bamject/blob/master/src/bamject.nim
@@ -77,7 +56,7 @@ proc createRec(rec: Record, bi: string, bd: string): string =
     result = recSplit.join("\t")
 
 
-proc getDindelQual(rec: Record, homopolymerRuns: seq[int]): (string, string) = 
+proc getDindelQual(rec: Record, homopolymerRuns: var HomopolymerRuns): (string, string) = 
   var rpos = rec.start;# coordinate on reference x
   let rlen = len(homopolymerRuns)
   var dindelq: string
@@ -125,12 +104,13 @@ proc parseIndelArg(arg: string): (char, char) =
   result = (encodeQual(iq), encodeQual(dq))
 
 
-proc indelqual*(faFname: string, bamInFname: string, uniform: string = "") =
+proc indelqual*(faFname: string, bamInFname: string, uniform: string = "",
+                htsThreads = AUTO_HTS_THREADS) =
 
-  var fai: Fai
-  # keeping all observed reference homopolymers in memory
+  # keeping all observed reference homopolymers in memory (embedded in
+  # packed reference if available, see packedref)
   # this should only be needed if file isn't sorted. FIXME warn?
-  var homopolymersPerChrom = initTable[string, seq[int]]()
+  var homopolymersPerChrom = initTable[string, HomopolymerRuns]()
   var iBam: Bam
   #var oBam: Bam
   var insQual: char
@@ -138,10 +118,11 @@ proc indelqual*(faFname: string, bamInFname: string, uniform: string = "") =
   if len(uniform) > 0:
     (insQual, delQual) = parseIndelArg(uniform)
  
-  if not open(fai, faFname):
-    quit("Could not open reference sequence file: " & faFname)
+  let fa = openReference(faFname)# packed if available
 
-  open(iBam, bamInFname, fai=faFname)
+  initHtsPool(htsThreads)
+  if not openBam(iBam, bamInFname, faFname):
+    quit("Could not open BAM file " & bamInFname)
   
   stdout.write($iBam.hdr)
   #assert outFormat in @["BAM", "SAM", "CRAM"]
@@ -161,8 +142,7 @@ proc indelqual*(faFname: string, bamInFname: string, uniform: string = "") =
     # for dindel: load reference is needed, compute homopolymers and set bi and bd 
     if len(uniform) == 0:
       if not homopolymersPerChrom.hasKey(chrom):
-        let refsq = fai.get(chrom)
-        homopolymersPerChrom[chrom] = findHomopolymerRuns(refsq)
+        homopolymersPerChrom[chrom] = fa.homopolymerRuns(chrom)
       (bi, bd) = getDindelQual(rec, homopolymersPerChrom[chrom])
         
     else:
@@ -0,0 +1,452 @@
+## LoFreq: 2-bit packed, memory-mapped reference
+##
+## 'packref' converts an (indexed) fasta file once into <fasta>.lf2b. Bases
+## are stored with two bits each. Everything that is not A, C, G or T (N,
+## IUPAC codes etc.) is kept as a list of runs of identical characters, and
+## soft-masked (lower case) regions as another run list, so that sequences
+## are reproduced exactly. Optionally, the homopolymer runs used by
+## indelqual are embedded as well. The file is memory-mapped read-only: all
+## processes on a node share one copy through the page cache and opening
+## needs no parsing.
+##
+## 'openReference' uses <fasta>.lf2b automatically if it exists and is not
+## older than the fasta file, and falls back to the fasta index otherwise.
+## Run lookups keep a cursor, so that (mostly) increasing positions, as
+## during a pileup, cost O(1).
+##
+## File layout (native byte order, all blocks 8-byte aligned): magic, number
+## of sequences, one SeqEntry per sequence, followed by the names and the
+## blocks of each sequence that the entries point to.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+# standard
+import logging
+import memfiles
+import os
+import sequtils
+import strutils
+import tables
+import times
+# third party
+import hts
+# project specific
+# /
+
+
+const PACKED_EXT* = ".lf2b"
+const MAGIC = "LF2BIT01"
+const CODE_TO_BASE = "ACGT"
+
+
+type SeqEntry = object
+  nameOff, nameLen: int64
+  length: int64
+  basesOff: int64# 4 bases per byte, base i in bits 2*(i mod 4)
+  excOff, excCount: int64# ExcRun: non-ACGT characters
+  lowerOff, lowerCount: int64# Run: lower case
+  hpOff, hpCount: int64# Run: homopolymers of length >= 2. hpOff=0: none
+
+type Run = object
+  start, len: int64
+
+type ExcRun = object
+  start: int64
+  len: int32
+  base: char# upper case
+  pad: array[3, char]
+
+type PackedRef* = ref object
+  mf: MemFile
+  fname: string
+  entries: ptr UncheckedArray[SeqEntry]
+  index: Table[string, int]
+
+type PackedSeq* = object
+  ## One sequence of a PackedRef. Only valid as long as the PackedRef is
+  ## open. Lookups update the cursors, hence var
+  len*: int
+  bases: ptr UncheckedArray[uint8]
+  exc: ptr UncheckedArray[ExcRun]
+  numExc: int
+  excCursor: int
+  lower: ptr UncheckedArray[Run]
+  numLower: int
+  lowerCursor: int
+  hp: ptr UncheckedArray[Run]
+  numHp: int# -1: no homopolymer table
+  hpCursor: int
+
+type SeqCache* = ref object
+  ## Most recently loaded sequence of an unpacked reference (see enableCache)
+  name*: string
+  sq*: string
+
+type Reference* = object
+  ## A reference, either memory-mapped (packed) or read through the fasta
+  ## index (fai)
+  fai*: Fai
+  packed: PackedRef
+  cache: SeqCache# only for unpacked references, if enabled. shared by copies
+
+type HomopolymerRuns* = object
+  ## Homopolymer run length per position: L at the first base of a run of
+  ## length L, 1 everywhere else
+  runs: seq[int]
+  packed: PackedSeq
+  isPacked: bool
+  n: int
+
+
+var logger = newConsoleLogger(fmtStr = verboseFmtStr, useStderr = true)
+
+
+proc findHomopolymerRuns*(sq: string): seq[int] =
+  ## Homopolymer run length per position (see HomopolymerRuns). Case matters
+  var i = 0
+  while i < len(sq):
+    var l = 1
+    while i + l < len(sq) and sq[i + l] == sq[i]:
+      inc l
+    result.add(l)
+    for j in 1..<l:
+      result.add(1)
+    i += l
+
+
+proc runAt[T](runs: ptr UncheckedArray[T], n: int, pos: int,
+              cursor: var int): int {.inline.} =
+  ## Index of the run containing pos or -1. cursor is the last run starting
+  ## at or before the previous pos (-1: none). It is reused if still valid
+  ## for pos or the next one is, otherwise found by binary search.
+  if n == 0:
+    return -1
+  var c = cursor
+  template valid(c: int): bool =
+    (c == -1 or runs[c].start <= pos) and (c + 1 == n or pos < runs[c + 1].start)
+  if not valid(c):
+    if c + 1 < n and valid(c + 1):
+      inc c
+    else:
+      var lo = 0
+      var hi = n# first run starting after pos
+      while lo < hi:
+        let mid = (lo + hi) div 2
+        if runs[mid].start <= pos:
+          lo = mid + 1
+        else:
+          hi = mid
+      c = lo - 1
+  cursor = c
+  if c >= 0 and pos < runs[c].start + runs[c].len: c else: -1
+
+
+proc baseAt*(s: var PackedSeq, i: int): char {.inline.} =
+  when compileOption("boundChecks"):
+    if i < 0 or i >= s.len:
+      raise newException(IndexDefect, "index " & $i & " not in 0 .. " & $(s.len-1))
+  result = CODE_TO_BASE[int((s.bases[i shr 2] shr ((i and 3) shl 1)) and 3)]
+  if s.numExc > 0:
+    let r = runAt(s.exc, s.numExc, i, s.excCursor)
+    if r >= 0:
+      result = s.exc[r].base
+  if s.numLower > 0 and runAt(s.lower, s.numLower, i, s.lowerCursor) >= 0:
+    result = toLowerAscii(result)
+
+
+proc substring*(s: var PackedSeq, first, last: int): string =
+  ## Bases first to last (inclusive), like sq[first..last]
+  result = newStringOfCap(max(0, last - first + 1))
+  for i in first..last:
+    result.add(s.baseAt(i))
+
+
+proc `$`*(s: PackedSeq): string =
+  ## The whole sequence, e.g. for the C kernels
+  result = newString(s.len)
+  for i in 0..<s.len:
+    result[i] = CODE_TO_BASE[int((s.bases[i shr 2] shr ((i and 3) shl 1)) and 3)]
+  for r in 0..<s.numExc:
+    let start = int(s.exc[r].start)
+    for i in start ..< start + int(s.exc[r].len):
+      result[i] = s.exc[r].base
+  for r in 0..<s.numLower:
+    let start = int(s.lower[r].start)
+    for i in start ..< start + int(s.lower[r].len):
+      result[i] = toLowerAscii(result[i])
+
+
+proc hasHomopolymers*(s: PackedSeq): bool =
+  s.numHp >= 0
+
+
+proc homopolymerRunAt*(s: var PackedSeq, i: int): int {.inline.} =
+  ## Same as findHomopolymerRuns(sq)[i]. Needs the embedded table
+  doAssert s.hasHomopolymers
+  let r = runAt(s.hp, s.numHp, i, s.hpCursor)
+  if r >= 0 and s.hp[r].start == i: int(s.hp[r].len) else: 1
+
+
+proc at[T](p: PackedRef, off: int64): ptr UncheckedArray[T] =
+  cast[ptr UncheckedArray[T]](cast[ByteAddress](p.mf.mem) + ByteAddress(off))
+
+
+proc openPackedRef*(fname: string): PackedRef =
+  result = PackedRef(fname: fname)
+  try:
+    result.mf = memfiles.open(fname, mode = fmRead)
+  except OSError:
+    quit("Could not open packed reference " & fname)
+  var magic = newString(len(MAGIC))
+  if result.mf.size >= 16:
+    copyMem(addr magic[0], result.mf.mem, len(MAGIC))
+  if magic != MAGIC:
+    quit("Not a packed reference: " & fname)
+  let numSeqs = int(result.at[:int64](len(MAGIC))[0])
+  result.entries = result.at[:SeqEntry](16)
+  for i in 0..<numSeqs:
+    let e = result.entries[i]
+    var name = newString(int(e.nameLen))
+    if e.nameLen > 0:
+      copyMem(addr name[0], result.at[:char](e.nameOff), int(e.nameLen))
+    result.index[name] = i
+
+
+proc close*(p: PackedRef) =
+  p.mf.close()
+
+
+proc hasSeq*(p: PackedRef, name: string): bool =
+  p.index.hasKey(name)
+
+
+proc names*(p: PackedRef): seq[string] =
+  ## Sequence names in file order
+  result = newSeq[string](len(p.index))
+  for name, i in p.index:
+    result[i] = name
+
+
+proc getSeq*(p: PackedRef, name: string): PackedSeq =
+  if not p.hasSeq(name):
+    quit("Sequence " & name & " not found in " & p.fname)
+  let e = p.entries[p.index[name]]
+  PackedSeq(len: int(e.length),
+            bases: p.at[:uint8](e.basesOff),
+            exc: p.at[:ExcRun](e.excOff), numExc: int(e.excCount),
+            excCursor: -1,
+            lower: p.at[:Run](e.lowerOff), numLower: int(e.lowerCount),
+            lowerCursor: -1,
+            hp: p.at[:Run](e.hpOff),
+            numHp: if e.hpOff == 0: -1 else: int(e.hpCount),
+            hpCursor: -1)
+
+
+proc align8(fh: File) =
+  while getFilePos(fh) mod 8 != 0:
+    fh.write('\0')
+
+
+proc writeBlock[T](fh: File, data: seq[T]): int64 =
+  ## Writes data (aligned) and returns its offset
+  fh.align8()
+  result = getFilePos(fh)
+  if len(data) > 0:
+    doAssert fh.writeBuffer(unsafeAddr data[0], len(data) * sizeof(T)) == len(data) * sizeof(T)
+
+
+proc writePackedRef*(fname: string, names: seq[string],
+                     load: proc(name: string): string,
+                     homopolymers = false) =
+  ## Writes sequences (loaded one at a time with load) in packed format
+  var fh = open(fname, fmWrite)
+  fh.write(MAGIC)
+  var n = int64(len(names))
+  discard fh.writeBuffer(addr n, sizeof(n))
+  var entries = newSeq[SeqEntry](len(names))
+  discard fh.writeBlock(entries)# placeholder
+  for i, name in names:
+    entries[i].nameOff = fh.writeBlock(toSeq(name))
+    entries[i].nameLen = len(name)
+    let sq = load(name)
+    entries[i].length = len(sq)
+
+    var bases = newSeq[uint8]((len(sq) + 3) div 4)
+    var exc: seq[ExcRun]
+    var lower: seq[Run]
+    for j, c in sq:
+      let u = toUpperAscii(c)
+      let code = find(CODE_TO_BASE, u)
+      if code >= 0:
+        bases[j shr 2] = bases[j shr 2] or uint8(code shl ((j and 3) shl 1))
+      elif len(exc) > 0 and exc[^1].base == u and exc[^1].start + exc[^1].len == j and
+           exc[^1].len < high(int32):
+        inc exc[^1].len
+      else:
+        exc.add(ExcRun(start: j, len: 1, base: u))
+      if isLowerAscii(c):
+        if len(lower) > 0 and lower[^1].start + lower[^1].len == j:
+          inc lower[^1].len
+        else:
+          lower.add(Run(start: j, len: 1))
+    entries[i].basesOff = fh.writeBlock(bases)
+    entries[i].excOff = fh.writeBlock(exc)
+    entries[i].excCount = len(exc)
+    entries[i].lowerOff = fh.writeBlock(lower)
+    entries[i].lowerCount = len(lower)
+    if homopolymers:
+      var hp: seq[Run]
+      for j, l in findHomopolymerRuns(sq):
+        if l > 1:
+          hp.add(Run(start: j, len: l))
+      entries[i].hpOff = fh.writeBlock(hp)# never 0, i.e. after header
+      entries[i].hpCount = len(hp)
+  fh.setFilePos(16)
+  discard fh.writeBlock(entries)
+  fh.close()
+
+
+proc packref*(faFname: string, homopolymers = false, outFname = "") =
+  ## Converts an (indexed) fasta file to the packed format, by default
+  ## <faFname>.lf2b, where the other commands pick it up automatically
+  var fai: Fai
+  if not open(fai, faFname):
+    quit("Could not open reference " & faFname)
+  var names: seq[string]
+  for i in 0..<len(fai):
+    names.add(fai[i])
+  let fname = if len(outFname) > 0: outFname else: faFname & PACKED_EXT
+  writePackedRef(fname, names, proc(name: string): string = fai.get(name),
+                 homopolymers)
+
+
+proc openReference*(faFname: string): Reference =
+  ## Opens faFname, using its packed version if present and up to date
+  if not open(result.fai, faFname):
+    quit("Could not open reference " & faFname)
+  let packedFname = faFname & PACKED_EXT
+  if fileExists(packedFname):
+    if getLastModificationTime(packedFname) < getLastModificationTime(faFname):
+      logger.log(lvlWarn, "Ignoring " & packedFname & ", which is older than " & faFname)
+    else:
+      logger.log(lvlInfo, "Using packed reference " & packedFname)
+      result.packed = openPackedRef(packedFname)
+
+
+proc isNil*(r: Reference): bool =
+  r.fai.isNil and r.packed.isNil
+
+
+proc isPacked*(r: Reference): bool =
+  not r.packed.isNil
+
+
+proc enableCache*(r: var Reference) =
+  ## Keeps the most recently loaded sequence of an unpacked reference in
+  ## memory, for repeated queries on the same chromosome (see api). No-op for
+  ## packed references, which are memory-mapped anyway.
+  if not r.isPacked and r.cache.isNil:
+    r.cache = SeqCache()
+
+
+proc cached*(r: Reference, chrom: string): SeqCache =
+  ## The cache (see enableCache), holding chrom, or nil if not enabled
+  if r.cache.isNil:
+    return nil
+  if r.cache.name != chrom or len(r.cache.sq) == 0:
+    r.cache.sq = r.fai.get(chrom)
+    r.cache.name = chrom
+  r.cache
+
+
+proc close*(r: Reference) =
+  ## Unmaps the packed reference (if any)
+  if r.isPacked:
+    r.packed.close()
+
+
+proc hasSeq*(r: Reference, chrom: string): bool =
+  if r.isPacked:
+    r.packed.hasSeq(chrom)
+  else:
+    try:
+      r.fai.chrom_len(chrom) >= 0
+    except KeyError:# raised by newer hts-nim
+      false
+
+
+proc getPacked*(r: Reference, chrom: string): PackedSeq =
+  r.packed.getSeq(chrom)
+
+
+proc get*(r: Reference, chrom: string): string =
+  ## Whole sequence (like fai.get)
+  if r.isPacked:
+    $r.packed.getSeq(chrom)
+  else:
+    r.fai.get(chrom)
+
+
+proc homopolymerRuns*(r: Reference, chrom: string): HomopolymerRuns =
+  ## Embedded homopolymer runs if available, otherwise computed
+  if r.isPacked:
+    result.packed = r.packed.getSeq(chrom)
+    if result.packed.hasHomopolymers:
+      result.isPacked = true
+      result.n = result.packed.len
+      return
+  result.runs = findHomopolymerRuns(r.get(chrom))
+  result.n = len(result.runs)
+
+
+proc len*(h: HomopolymerRuns): int {.inline.} =
+  h.n
+
+
+proc `[]`*(h: var HomopolymerRuns, i: int): int {.inline.} =
+  if h.isPacked: h.packed.homopolymerRunAt(i) else: h.runs[i]
+
+
+when isMainModule:
+  import utils
+
+  let seqs = {"a": "ACGTNNNNacgtnnRYAAAAcc", "b": "", "c": "T",
+              "d": "GGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGgggg*"}.toTable
+  let fname = getTempDir() / "packedref_test" & PACKED_EXT
+  writePackedRef(fname, @["a", "b", "c", "d"],
+                 proc(name: string): string = seqs[name], homopolymers = true)
+  let p = openPackedRef(fname)
+
+  testblock "names":
+    doAssert p.names == @["a", "b", "c", "d"]
+    doAssert not p.hasSeq("e")
+
+  testblock "whole sequences":
+    for name, sq in seqs:
+      doAssert $p.getSeq(name) == sq, name
+
+  testblock "random access":
+    for name, sq in seqs:
+      var s = p.getSeq(name)
+      doAssert s.len == len(sq)
+      for i in 0..<len(sq):
+        doAssert s.baseAt(i) == sq[i]
+      for i in countdown(len(sq)-1, 0):
+        doAssert s.baseAt(i) == sq[i]
+      for i in countup(0, len(sq)-1, 3):
+        doAssert s.baseAt(i) == sq[i]
+      if len(sq) > 4:
+        doAssert s.substring(2, 4) == sq[2..4]
+
+  testblock "homopolymers":
+    for name, sq in seqs:
+      var s = p.getSeq(name)
+      doAssert s.hasHomopolymers
+      let expected = findHomopolymerRuns(sq)
+      for i in 0..<len(sq):
+        doAssert s.homopolymerRunAt(i) == expected[i], name & " " & $i
+
+  p.close()
+  removeFile(fname)
+  echo "OK: all tests passed"
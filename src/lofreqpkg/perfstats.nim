@@ -0,0 +1,194 @@
+## LoFreq: lightweight counters and timers for the hot paths
+##
+## Counters are plain integer increments on a thread-local object, so they
+## are cheap enough to be left on. Timers are only used around coarse stages
+## (regions, reference loading, calling a position). Optionally, timed stages
+## are also recorded as Chrome trace events (load the file in
+## chrome://tracing or https://ui.perfetto.dev). Compile with
+## `-d:noPerfStats` to remove all instrumentation.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+# standard
+import json
+import monotimes
+# third party
+# /
+# project specific
+# /
+
+
+type Counter* = enum
+  cReadsFetched = "reads_fetched"
+  cReadsFiltered = "reads_filtered"
+  cReadsInvalidCigar = "reads_invalid_cigar"
+  cReadsProcessed = "reads_processed"
+  cReadsCollapsed = "reads_collapsed"# identical reads merged into a weighted one
+  cReadsGenericQuals = "reads_generic_quals"# tag set without specialized processing
+  cPositionsCreated = "positions_created"
+  cPositionsSubmitted = "positions_submitted"
+  cPositionsCovFiltered = "positions_filtered_by_coverage"
+  cPositionsOutsideRegion = "positions_outside_region"
+  cPositionsNotSites = "positions_not_sites"# dropped when restricted to sites
+  cHistEntries = "histogram_entries"
+  cTestsSkipped = "tests_skipped"# minAF not reachable according to aggregates
+  cDpCalls = "dp_calls"
+  cDpEarlyExits = "dp_early_exits"
+  cDpObservations = "dp_observations"# sum of N over all DP calls
+  cDpObservationsUsed = "dp_observations_used"# as above, but only up to (pruned) exit
+  cDpCells = "dp_cells"# sum of N*(K+1), i.e. DP size
+
+
+type Timer* = enum
+  tRegion = "region"
+  tLoadReference = "load_reference"
+  tCallAtPos = "call_at_pos"
+
+
+type PerfStats* = object
+  counters*: array[Counter, int64]
+  timersNs*: array[Timer, int64]
+  peakDeqLen*: int
+
+
+type TraceEvent = object
+  name: string
+  cat: string
+  ts: int64# microseconds since start
+  dur: int64# microseconds
+  tid: int
+
+
+var perfStats* {.threadvar.}: PerfStats
+var traceEvents {.threadvar.}: seq[TraceEvent]
+var traceEnabled* = false
+let startTicks = getMonoTime().ticks
+
+
+proc threadId(): int {.inline.} =
+  when compileOption("threads"):
+    getThreadId()
+  else:
+    0
+
+
+template count*(c: Counter, n: int = 1) =
+  ## Increments counter 'c' by 'n'
+  when not defined(noPerfStats):
+    perfStats.counters[c] += int64(n)
+
+
+template notePeakDeqLen*(l: int) =
+  ## Keeps track of the longest deque seen
+  when not defined(noPerfStats):
+    if l > perfStats.peakDeqLen:
+      perfStats.peakDeqLen = l
+
+
+proc addTraceEvent(name: string, cat: string, startNs: int64, endNs: int64) =
+  traceEvents.add(TraceEvent(name: name, cat: cat,
+    ts: (startNs - startTicks) div 1000, dur: (endNs - startNs) div 1000,
+    tid: threadId()))
+
+
+template timed*(t: Timer, label: string, body: untyped) =
+  ## Runs body and adds the elapsed time to timer 't'. If tracing is enabled,
+  ## the run is also recorded as trace event named 'label'
+  when defined(noPerfStats):
+    body
+  else:
+    let tStart = getMonoTime().ticks
+    body
+    let tEnd = getMonoTime().ticks
+    perfStats.timersNs[t] += tEnd - tStart
+    if traceEnabled:
+      addTraceEvent(label, $t, tStart, tEnd)
+
+
+template timedNoTrace*(t: Timer, body: untyped) =
+  ## Like timed(), but never recorded as trace event. Use for fine grained
+  ## stages, e.g. per position
+  when defined(noPerfStats):
+    body
+  else:
+    let tStart = getMonoTime().ticks
+    body
+    perfStats.timersNs[t] += getMonoTime().ticks - tStart
+
+
+proc merge*(dst: var PerfStats, src: PerfStats) =
+  ## Merges stats, e.g. from different threads
+  for c in Counter:
+    dst.counters[c] += src.counters[c]
+  for t in Timer:
+    dst.timersNs[t] += src.timersNs[t]
+  dst.peakDeqLen = max(dst.peakDeqLen, src.peakDeqLen)
+
+
+proc `%`*(s: PerfStats): JsonNode =
+  var counters = newJObject()
+  for c in Counter:
+    counters[$c] = %s.counters[c]
+  var timers = newJObject()
+  for t in Timer:
+    timers[$t] = %(float(s.timersNs[t]) / 1e6)
+  result = %{"counters": counters, "timers_ms": timers,
+             "peak_deque_len": %s.peakDeqLen}
+  # derived values that are otherwise tedious to compute
+  if s.counters[cDpCalls] > 0:
+    result["dp_early_exit_rate"] = %(float(s.counters[cDpEarlyExits]) /
+                                    float(s.counters[cDpCalls]))
+  if s.counters[cDpObservations] > 0:
+    result["dp_observations_used_frac"] = %(float(s.counters[cDpObservationsUsed]) /
+                                            float(s.counters[cDpObservations]))
+
+
+proc writeStats*(fname: string) =
+  ## Writes this thread's stats as JSON to fname ("-" for stderr)
+  let js = pretty(%perfStats)
+  if fname == "-":
+    stderr.writeLine(js)
+  else:
+    writeFile(fname, js & "\n")
+
+
+proc writeTrace*(fname: string) =
+  ## Writes recorded trace events in Chrome's trace event format
+  var events = newJArray()
+  for ev in traceEvents:
+    events.add(%{"name": %ev.name, "cat": %ev.cat, "ph": %"X",
+                 "ts": %ev.ts, "dur": %ev.dur, "pid": %1, "tid": %ev.tid})
+  writeFile(fname, $(%{"traceEvents": events}) & "\n")
+
+
+when isMainModule:
+  import utils
+
+  testblock "count":
+    count(cDpCalls)
+    count(cDpCalls, 2)
+    doAssert perfStats.counters[cDpCalls] == 3
+
+  testblock "timed":
+    traceEnabled = true
+    timed(tRegion, "test"):
+      discard
+    doAssert len(traceEvents) == 1
+    traceEnabled = false
+
+  testblock "merge":
+    var s: PerfStats
+    s.peakDeqLen = 10
+    s.counters[cDpCalls] = 1
+    var t: PerfStats
+    t.merge(s)
+    t.merge(s)
+    doAssert t.peakDeqLen == 10
+    doAssert t.counters[cDpCalls] == 2
+
+  testblock "json":
+    let js = %perfStats
+    doAssert js["counters"]["dp_calls"].getInt == 3
+
+  echo "OK: all tests passed"
@@ -10,15 +10,21 @@
 # standard
 import os
 import logging
+import heapqueue
+import strformat
 # third party
 import hts
 # project specific
 import ../region
+import ../packedref
 import recordFilter
 import interfaces/iSequence
 import storage/slidingDeque
+import storage/containers/allele
 import processor
-import storage/slidingDeque
+import collapse
+import qualBins
+import ../perfstats
 
 const
   DEFAULT_MIN_COV* = 1
@@ -31,14 +37,22 @@ type PileupParams* = object
   maxCov*: Natural
   minBQ*: Natural
   useMQ*: bool
+  collapseReads*: bool# process identical reads once, with weight (see collapse)
+  qualBins*: QualBins# binning of merged qualities (see qualBins)
   # FIXME add regions to plpParams
 
 
+proc defaultPileupParams*(): PileupParams =
+  PileupParams(minCov: DEFAULT_MIN_COV,
+               maxCov: DEFAULT_MAX_COV,
+               minBQ: DEFAULT_MIN_BQ,
+               useMQ: DEFAULT_USE_MQ,
+               collapseReads: false,
+               qualBins: noQualBins())
+
+
 var plpParams*: PileupParams
-plpParams = PileupParams(minCov: DEFAULT_MIN_COV,
-                         maxCov: DEFAULT_MAX_COV,
-                         minBQ: DEFAULT_MIN_BQ,
-                         useMQ: DEFAULT_USE_MQ)
+plpParams = defaultPileupParams()
 
 var logger = newConsoleLogger(fmtStr = verboseFmtStr, useStderr = true)
 
@@ -110,45 +124,181 @@ proc valid(cigar: Cigar): bool {.inline.} =
         result = false
 
 
-proc pileup*(fai: Fai, records: RecordFilter, region: Region,
-             handler: DataToVoid): void {.inline.} =
-  ## Performs a pileup over all reads provided by records
+proc processRead[TSequence, TProcessor](processor: var TProcessor,
+                 read: Record, cigar: Cigar,
+                 reference: TSequence, weight: Positive = 1): void {.inline.} =
+  ## Processes all events on one (valid) read, which stands for 'weight'
+  ## identical reads
+  var
+    readOffset = 0
+    refOffset = int64(read.start)
+
+  processor.beginRead(read, weight)
+
+  # process all events on the read. unfortunately we need to know
+  # the next event to avoid storing indel quals twice, which makes
+  # this a bit ugly
+  for idx in 0..<len(cigar):
+    let event = cigar[idx]
+    var nextevent: CigarElement
+    # uninitialized nextevent (= last element) translates to 0M
+    if idx+1 < len(cigar):
+      nextevent = cigar[idx+1]
+    (readOffset, refOffset) = processEvent(event, nextevent,
+      processor, read, reference, readOffset, refOffset)
+
+
+proc skipInvalid(read: Record, cigar: Cigar): bool {.inline.} =
+  if cigar.valid:
+    return false
+  # Skipping all invalid reads
+  logger.log(lvlWarn, "Skipping read with invalid CIGAR: " & $read)
+  count(cReadsInvalidCigar)
+  return true
+
+
+proc weightedReads(next: iterator(): Record,
+                   collapseReads: bool): iterator(): WeightedRead =
+  ## Reads with weights, collapsed if requested
+  if collapseReads:
+    collapsing(next)
+  else:
+    weighted(next)
+
+
+proc pileup*(fa: Reference, records: RecordFilter, region: Region,
+             handler: DataToVoid, params = plpParams,
+             sites: seq[int64] = @[]): void {.inline.} =
+  ## Performs a pileup over all reads provided by records. If sites (zero-based
+  ## positions) are given, only these are kept and submitted.
 
   var reference: ISequence# our own type, hence using loadSequence below
   var storage = newSlidingDeque(records.chromosomeName, region, handler,
-    plpParams.mincov, plpParams.maxcov)
-  var processor = newProcessor(storage, plpParams.useMQ, plpParams.minBQ)
-  
-  for read in records:
-      let cigar = read.cigar
-      if not cigar.valid:
-        # Skipping all invalid reads
-        logger.log(lvlWarn, "Skipping read with invalid CIGAR: " & $read)
-        continue
-      
+    params.mincov, params.maxcov)
+  if len(sites) > 0:
+    storage.restrictTo(sites)
+  var processor = newProcessor(storage, params.useMQ, params.minBQ,
+                               params.qualBins)
+
+  template process(read: Record, weight: Positive) =
+    let cigar = read.cigar
+    if not skipInvalid(read, cigar):
       # all records come from the same chromosome as guaranteed by RecordFilter
       # load reference only after we're sure there's data to process
       if reference.len == 0:
-        reference = fai.loadSequence(records.chromosomeName)
-
-      var
-        readOffset = 0
-        refOffset = int64(read.start)
-      
-      processor.beginRead(read)
-
-      # process all events on the read. unfortunately we need to know
-      # the next event to avoid storing indel quals twice, which makes
-      # this a bit ugly
-      for idx in 0..<len(cigar):
-        let event = cigar[idx]
-        var nextevent: CigarElement
-        # uninitialized nextevent (= last element) translates to 0M
-        if idx+1 < len(cigar):
-          nextevent = cigar[idx+1]
-        (readOffset, refOffset) = processEvent(event, nextevent,
-          processor, read, reference, readOffset, refOffset)
+        timed(tLoadReference, "load " & records.chromosomeName):
+          reference = fa.loadSequence(records.chromosomeName)
+
+      processor.processRead(read, cigar, reference, weight)
+
+  if params.collapseReads:
+    let reads = collapsing(records.stream())
+    for (read, weight) in reads():
+      process(read, weight)
+  else:
+    for read in records:
+      process(read, 1)
 
   # inform the processor that the pileup is done
   processor.done()
 
+
+proc pileup*(fa: Reference, records: seq[RecordFilter], region: Region,
+             handlers: seq[DataToVoid], params = plpParams): void =
+  ## Performs a joint pileup over several samples (one RecordFilter and
+  ## handler each) in one pass over the region. Reads are merged by start
+  ## position over all samples, so that the reference is loaded only once and
+  ## all per-sample storages slide in lockstep.
+  doAssert len(records) == len(handlers)
+  if len(records) == 1:
+    pileup(fa, records[0], region, handlers[0], params)
+    return
+
+  var reference: ISequence
+  var processors: seq[Processor[SlidingDeque]]
+  var streams: seq[iterator(): WeightedRead]
+  # k-way merge on (start, sample index). the index breaks ties, so that
+  # results are deterministic
+  var heads = initHeapQueue[(int64, int)]()
+  var current = newSeq[WeightedRead](len(records))
+  let alleles = newAlleleDict()# shared by all samples
+
+  for i, rf in records:
+    let storage = newSlidingDeque(rf.chromosomeName, region, handlers[i],
+      params.mincov, params.maxcov, alleles = alleles)
+    processors.add(newProcessor(storage, params.useMQ, params.minBQ,
+                               params.qualBins))
+    streams.add(weightedReads(rf.stream(), params.collapseReads))
+    current[i] = streams[i]()
+    if not finished(streams[i]):
+      heads.push((int64(current[i].read.start), i))
+
+  while len(heads) > 0:
+    let (_, i) = heads.pop()
+    let (read, weight) = current[i]
+    let cigar = read.cigar
+    if not skipInvalid(read, cigar):
+      if reference.len == 0:
+        timed(tLoadReference, "load " & records[i].chromosomeName):
+          reference = fa.loadSequence(records[i].chromosomeName)
+      processors[i].processRead(read, cigar, reference, weight)
+
+    # only advance this sample's stream once we are done with its read,
+    # because the record object is reused by the stream
+    current[i] = streams[i]()
+    if not finished(streams[i]):
+      heads.push((int64(current[i].read.start), i))
+
+  for processor in processors:
+    processor.done()
+
+
+proc streamingPileup*(fa: Reference, bam: Bam, handler: DataToVoid,
+                      numMapped: int64 = -1, params = plpParams): void =
+  ## Performs a pileup over all reads of a coordinate sorted bam file in file
+  ## order, i.e. without index (e.g. when reading from stdin). Chromosomes are
+  ## visited in header order. Whenever the chromosome changes, the pileup of
+  ## the previous one is finished and a new storage is started, so that
+  ## chromosomes without reads cost nothing and their reference is never
+  ## loaded. Unsorted input is a fatal error. If known (e.g. from the index),
+  ## 'numMapped' is the number of mapped reads in the file, which ends
+  ## reading before the unmapped reads.
+  let targets = targets(bam.hdr)
+  var tid = -1
+  var lastStart = -1'i64
+  var reference: ISequence
+  var processor: Processor[SlidingDeque]
+
+  let reads = weightedReads(passingStream(bam, numMapped), params.collapseReads)
+  for (read, weight) in reads():
+    if read.tid != tid:
+      if read.tid < tid:
+        quit(fmt"Input is not sorted: read {read.qname} on {targets[read.tid].name} " &
+             fmt"after reads on {targets[tid].name} (expecting header order). " &
+             "Please sort by coordinate")
+      if not processor.isNil:
+        processor.done()
+      tid = read.tid
+      lastStart = -1
+      let chrom = targets[tid].name
+      logger.log(lvlInfo, "Starting pileup for " & chrom)
+      let region = Region(sq: chrom, s: 0, e: int(targets[tid].length))
+      let storage = newSlidingDeque(chrom, region, handler,
+        params.mincov, params.maxcov)
+      processor = newProcessor(storage, params.useMQ, params.minBQ,
+                               params.qualBins)
+      # first read of chromosome arrived, i.e. there is data to process
+      timed(tLoadReference, "load " & chrom):
+        reference = fa.loadSequence(chrom)
+    elif read.start < lastStart:
+      quit(fmt"Input is not sorted: read {read.qname} at {targets[tid].name}:{read.start+1} " &
+           fmt"after a read starting at {lastStart+1}. Please sort by coordinate")
+    lastStart = read.start
+
+    let cigar = read.cigar
+    if skipInvalid(read, cigar):
+      continue
+    processor.processRead(read, cigar, reference, weight)
+
+  if not processor.isNil:
+    processor.done()
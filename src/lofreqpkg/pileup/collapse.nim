@@ -0,0 +1,145 @@
+## The module implements collapsing of identical reads. In ultra-deep
+## amplicon data many reads share start, CIGAR, sequence, strand, qualities
+## and mapping quality. Such reads would add exactly the same events to the
+## pileup, so it's sufficient to process one of them with a weight (the
+## number of identical reads). Reads are grouped per start position, since
+## identical reads necessarily start at the same position, and groups are
+## released in order of their first read. Thus histograms are filled in the
+## same order as without collapsing and results are identical.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+
+# standard
+import tables
+# third party
+import hts
+# project specific
+import processor
+import ../perfstats
+
+
+type WeightedRead* = tuple[read: Record, weight: int]
+
+
+proc collapseKey(read: Record, key: var string) {.inline.} =
+  ## Everything the 'Processor' looks at, apart from the start position: mapping
+  ## quality, strand, CIGAR, sequence, base qualities (stored contiguously in
+  ## the record) and qualities from tags
+  let core = read.b.core
+  let n = int(core.n_cigar)*4 + (int(core.l_qseq)+1) div 2 + int(core.l_qseq)
+  key.setLen(2 + n)
+  key[0] = char(read.mapping_quality)
+  key[1] = if read.flag.reverse: 'r' else: 'f'
+  if n > 0:
+    let src = cast[pointer](cast[uint](read.b.data) + uint(core.l_qname))
+    copyMem(addr key[2], src, n)
+  for t in QUALITY_TAGS:
+    key.add('\t')
+    let v = tag[cstring](read, t)
+    if v.isSome:
+      key.add($v.get)
+
+
+proc collapsing*(next: iterator(): Record): iterator(): WeightedRead =
+  ## Returns a closure iterator yielding each distinct read of the
+  ## (coordinate sorted) input once, together with the number of identical
+  ## reads. Yielded reads are copies, i.e. remain valid.
+  result = iterator(): WeightedRead =
+    var groups: seq[WeightedRead]
+    var index = initTable[string, int]()
+    var key = ""
+    var tid = -1
+    var start = -1'i64
+    for read in next():
+      if read.tid != tid or read.start != start:
+        for g in groups:
+          yield g
+        groups.setLen(0)
+        index.clear()
+        tid = read.tid
+        start = read.start
+      collapseKey(read, key)
+      let i = index.getOrDefault(key, -1)
+      if i >= 0:
+        inc groups[i].weight
+        count(cReadsCollapsed)
+      else:
+        index[key] = len(groups)
+        groups.add((read.copy(), 1))
+    for g in groups:
+      yield g
+
+
+proc weighted*(next: iterator(): Record): iterator(): WeightedRead =
+  ## Like 'collapsing', but without collapsing, i.e. all weights are one.
+  ## Yielded reads are only valid until the next call.
+  result = iterator(): WeightedRead =
+    for read in next():
+      yield (read, 1)
+
+
+when isMainModule:
+  import sequtils
+  import strutils
+  import ../utils
+
+  proc samRecords(lines: seq[string]): seq[Record] =
+    var h = Header()
+    h.from_string("@SQ\tSN:chr1\tLN:1000")
+    for line in lines:
+      var r = NewRecord(h)
+      r.from_string(line.replace(' ', '\t'))
+      result.add(r)
+
+  proc collapsed(reads: seq[Record]): seq[WeightedRead] =
+    let next = iterator(): Record =
+      for r in reads:
+        yield r
+    let it = collapsing(next)
+    for wr in it():
+      result.add(wr)
+
+  testblock "identical reads are collapsed per strand":
+    let reads = samRecords(@[
+      "f1 0 chr1 101 60 6M * 0 0 ACGTAC IIIIII",
+      "f2 0 chr1 101 60 6M * 0 0 ACGTAC IIIIII",
+      "r1 16 chr1 101 60 6M * 0 0 ACGTAC IIIIII",
+      "f3 0 chr1 101 60 6M * 0 0 ACGTAC IIIIII",
+      "r2 16 chr1 101 60 6M * 0 0 ACGTAC IIIIII",
+      # differing base quality, mapping quality, quality tag or sequence
+      "q1 0 chr1 101 60 6M * 0 0 ACGTAC IIIII5",
+      "m1 0 chr1 101 30 6M * 0 0 ACGTAC IIIIII",
+      "t1 0 chr1 101 60 6M * 0 0 ACGTAC IIIIII BI:Z:IIIIII",
+      "s1 0 chr1 101 60 6M * 0 0 ACGTAA IIIIII",
+      # identical apart from start
+      "p1 0 chr1 102 60 6M * 0 0 ACGTAC IIIIII"])
+    let groups = collapsed(reads)
+    # in order of first read, each represented by its first read
+    doAssert groups.mapIt(it.read.qname) == @["f1", "r1", "q1", "m1", "t1", "s1", "p1"],
+      $groups.mapIt(it.read.qname)
+    doAssert groups.mapIt(it.weight) == @[3, 2, 1, 1, 1, 1, 1]
+    doAssert groups.mapIt(it.weight).foldl(a + b) == len(reads)
+    doAssert not groups[0].read.flag.reverse and groups[1].read.flag.reverse
+    var quals: seq[uint8]
+    doAssert groups[0].read.base_qualities(quals) == repeat(40'u8, 6)
+    doAssert groups[1].read.base_qualities(quals) == repeat(40'u8, 6)
+    doAssert groups[2].read.base_qualities(quals) == repeat(40'u8, 5) & @[20'u8]
+    doAssert groups[1].read.start == 100 and groups[6].read.start == 101
+
+  testblock "weighted keeps all reads":
+    let reads = samRecords(@[
+      "f1 0 chr1 101 60 6M * 0 0 ACGTAC IIIIII",
+      "f2 0 chr1 101 60 6M * 0 0 ACGTAC IIIIII"])
+    let next = iterator(): Record =
+      for r in reads:
+        yield r
+    let it = weighted(next)
+    var n = 0
+    for wr in it():
+      doAssert wr.weight == 1
+      inc n
+    doAssert n == 2
+
+  echo "OK: all tests passed"
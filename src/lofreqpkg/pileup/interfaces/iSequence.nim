@@ -1,4 +1,5 @@
 import hts
+import ../../packedref
 
 type 
   ISequence* =  tuple[
@@ -23,3 +24,23 @@ proc loadSequence*(fai: Fai, name: string): ISequence =
       substring: proc (first, last: int): string = sequence[first..last],
       len: sequence.len
     )    
+
+
+proc loadSequence*(fa: Reference, name: string): ISequence =
+  ## Like above, but without a copy of the sequence if fa is packed or
+  ## caches sequences (see packedref.enableCache)
+  if not fa.isPacked:
+    let cache = fa.cached(name)
+    if cache.isNil:
+      return loadSequence(fa.fai, name)
+    return (
+      baseAt: proc (index: int): char = cache.sq[index],
+      substring: proc (first, last: int): string = cache.sq[first..last],
+      len: cache.sq.len
+    )
+  var sequence = fa.getPacked(name)# closures share it, including cursors
+  return (
+    baseAt: proc (index: int): char = sequence.baseAt(index),
+    substring: proc (first, last: int): string = sequence.substring(first, last),
+    len: sequence.len
+  )
@@ -9,8 +9,11 @@
 # standard
 import times
 import logging
-#import strutils
+import os
+import strutils
 import sequtils
+import strformat
+import tables
 
 # third party
 import hts
@@ -23,65 +26,248 @@ import postprocessing
 import ../region
 import ../vcf
 import ../call
+import ../perfstats
+import ../htspool
+import ../checkpoint
+import ../plpstore
+import ../idxstats
+import ../shard
+import ../packedref
+import ../sites
+import storage/containers/positionData
+import qualBins
 
 
 var logger = newConsoleLogger(fmtStr = verboseFmtStr, useStderr = true)
 
 
-proc fullPileup*(bamFname: string, faFname = "", regionsStr = "", bedFile = "",
-                  handler: DataToVoid) : void =
-  ## Performs the pileup over all chromosomes listed in the bam file.
-  var bam: Bam
-  var fai: Fai
-  let numHTSReaderThreads = 1# see no improvement with 2 threads. likely all time spend on processing rather than unpacking
-  if not open(bam, bamFname, index=true, threads=numHTSReaderThreads):
-    quit("Could not open BAM file " & bamFname)
+proc openInputs(bamFnames: seq[string], faFname: string,
+                bams: var seq[Bam], fa: var Reference, index = true) =
+  bams = newSeq[Bam](len(bamFnames))
+  for i, bamFname in bamFnames:
+    # decompression threads come from the shared pool (see htspool). passing
+    # the reference enables reference-based CRAM decoding
+    if not openBam(bams[i], bamFname, faFname, index=index):
+      quit("Could not open BAM file " & bamFname)
 
   if len(faFname)!=0:
     logger.log(lvlInfo, "Opening index for " & faFname)
-    if not open(fai, faFname):
-      quit("Could not open reference " & faFname)
+    fa = openReference(faFname)# packed if available
   else:
     logger.log(lvlInfo, "No reference file given")
 
 
-    for i in 0..<len(fai):
-      let n = fai[i]
-      let l = fai.chrom_len(fai[i])
+    for i in 0..<len(fa.fai):
+      let n = fa.fai[i]
+      let l = fa.fai.chrom_len(fa.fai[i])
       echo n & " " & $l
     #quit("FIXME")
 
+
+proc resolveRegions(bam: Bam, regionsStr: string, bedFile: string): seq[Region] =
+  ## Regions from string or bed file or, if neither is given, all of bam
   if len(regionsStr) != 0 and len(bedFile) != 0:
     quit("Can't read regions from bed and string at the same time")   
 
-  var regions: seq[Region]
   if len(regionsStr) != 0:
-    regions = toSeq(parseRegionsStr(regionsStr))
+    result = toSeq(parseRegionsStr(regionsStr))
   elif len(bedFile) != 0:
-    regions = toSeq(getBedRegions(bedFile))
+    result = toSeq(getBedRegions(bedFile))
   else:
-    regions = toSeq(getBamRegions(bam))
+    result = toSeq(getBamRegions(bam))
+
+
+proc skipEmpty(regs: seq[Region], bams: seq[Bam],
+               bamFnames: seq[string]): seq[Region] =
+  ## Removes chromosomes (i.e. regions listed in the header) without mapped
+  ## reads in any of the bam files, according to their index. Keeps all if
+  ## that's unknown for any of them. Chromosomes are matched by name, since
+  ## the headers may list them in different order.
+  var counts: seq[Table[string, int64]]
+  for i, bam in bams:
+    let tidCounts = mappedReadCounts(bam, bamFnames[i])
+    if len(tidCounts) == 0:
+      return regs
+    var byName = initTable[string, int64]()
+    for t in targets(bam.hdr):
+      byName[t.name] = tidCounts[t.tid]
+    counts.add(byName)
+  for reg in regs:
+    for c in counts:
+      if c.getOrDefault(reg.sq) > 0:
+        result.add(reg)
+        break
+  logger.log(lvlInfo, fmt"Skipping {len(regs) - len(result)} of {len(regs)} chromosomes without reads")
+
+
+proc pileupRegion(bams: seq[Bam], fa: Reference, reg: Region,
+                  handlers: seq[DataToVoid]) =
+  logger.log(lvlInfo, "Starting pileup for " & $reg)
+
+  var records: seq[RecordFilter]
+  for bam in bams:
+    records.add(newRecordFilter(bam, reg.sq, reg.s, reg.e))
+
+  let time = cpuTime()
+  timed(tRegion, $reg):
+    algorithm.pileup(fa, records, reg, handlers)
+  logger.log(lvlInfo, "Time taken to pileup reference ",
+    reg.sq, " ", cpuTime() - time)
+
+
+proc fullPileup*(bamFnames: seq[string], faFname = "", regionsStr = "",
+                 bedFile = "", handlers: seq[DataToVoid]) : void =
+  ## Performs the pileup over all chromosomes listed in the first bam file.
+  ## If more than one bam file is given, all are piled up jointly in one pass
+  ## (see algorithm.pileup), calling the handler of the corresponding sample.
+  ## Without regions, a single bam file is traversed in file order (see
+  ## algorithm.streamingPileup), which avoids per chromosome overhead for
+  ## references with very many chromosomes.
+  doAssert len(bamFnames) > 0 and len(bamFnames) == len(handlers)
+  var bams: seq[Bam]
+  var fa: Reference
+  openInputs(bamFnames, faFname, bams, fa)
+
+  let wholeFile = len(regionsStr) == 0 and len(bedFile) == 0
+  if wholeFile and len(bams) == 1:
+    let numMapped = totalMapped(mappedReadCounts(bams[0], bamFnames[0]))
+    logger.log(lvlInfo, "Traversing " & bamFnames[0] & " in file order")
+    timed(tRegion, bamFnames[0]):
+      algorithm.streamingPileup(fa, bams[0], handlers[0], numMapped)
+    return
+
+  var regs = resolveRegions(bams[0], regionsStr, bedFile)
+  if wholeFile:
+    regs = skipEmpty(regs, bams, bamFnames)
+  for reg in regs:
+    pileupRegion(bams, fa, reg, handlers)
+
+
+proc streamedPileup*(bamFname: string, faFname = "", handler: DataToVoid) =
+  ## Performs the pileup over a coordinate sorted bam file without index in
+  ## file order, e.g. reading from stdin ("-"). See algorithm.streamingPileup
+  var bams: seq[Bam]
+  var fa: Reference
+  openInputs(@[bamFname], faFname, bams, fa, index=false)
+  let time = cpuTime()
+  timed(tRegion, bamFname):
+    algorithm.streamingPileup(fa, bams[0], handler)
+  logger.log(lvlInfo, "Time taken to pileup ", bamFname, " ", cpuTime() - time)
+
+
+proc checkpointedPileup*(bamFname: string, faFname: string, regionsStr: string,
+                         bedFile: string, checkpointDir: string,
+                         fingerprint: string, chunkSize: Positive,
+                         handlerFactory: proc(fh: File): DataToVoid,
+                         dst: File, ext: string) =
+  ## Performs the pileup in region chunks, writing each chunk's output to its
+  ## own file in checkpointDir (see checkpoint). Chunks already completed in a
+  ## previous run are skipped. Finally all chunks are concatenated to dst.
+  var bams: seq[Bam]
+  var fa: Reference
+  openInputs(@[bamFname], faFname, bams, fa)
+
+  var regs = resolveRegions(bams[0], regionsStr, bedFile)
+  if len(regionsStr) == 0 and len(bedFile) == 0:
+    regs = skipEmpty(regs, bams, @[bamFname])
+  var chunks: seq[Region]
+  for reg in regs:
+    for chunk in reg.chunks(chunkSize):
+      chunks.add(chunk)
+
+  var cp = openCheckpoint(checkpointDir, fingerprint, chunks, ext)
+  logger.log(lvlInfo, fmt"Resuming with {cp.numDone()} of {len(chunks)} chunks done")
+  for idx, chunk in chunks:
+    if cp.isDone(idx):
+      continue
+    var fh = open(cp.tmpChunkFname(idx), fmWrite)
+    pileupRegion(bams, fa, chunk, @[handlerFactory(fh)])
+    fh.close()
+    cp.markDone(idx, chunk)
 
-  for reg in regions:
-    logger.log(lvlInfo, "Starting pileup for " & $reg)
+  cp.concatChunks(len(chunks), dst)
 
-    var records = newRecordFilter(bam, reg.sq, reg.s, reg.e)
 
-    let time = cpuTime()
-    algorithm.pileup(fai, records, reg, handler)
-    logger.log(lvlInfo, "Time taken to pileup reference ",
-      reg.sq, " ", cpuTime() - time)
+proc fullPileup*(bamFname: string, faFname = "", regionsStr = "", bedFile = "",
+                  handler: DataToVoid) : void =
+  ## Performs the pileup over all chromosomes listed in the bam file.
+  fullPileup(@[bamFname], faFname, regionsStr, bedFile, @[handler])
+
+
+proc sitesPileup*(bamFname: string, faFname: string, sites: seq[Site],
+                  handler: proc(site: Site, plp: PositionData),
+                  maxGap = DEFAULT_SITES_MAX_GAP) =
+  ## Performs the pileup at the given sites only. Nearby sites share a fetch
+  ## window (see sites.windows), i.e. one index query and one pileup, which
+  ## only keeps the site positions. The reference sequence is loaded once per
+  ## chromosome. The handler is called for every site in window order, with
+  ## the pileup at the site or nil if there is none (no coverage). Coverage
+  ## filters aren't applied, so that the handler can report filtered sites
+  ## with their coverage (see coverageFilter).
+  var params = plpParams
+  params.minCov = 0
+  params.maxCov = high(int)
+  var bams: seq[Bam]
+  var fa: Reference
+  openInputs(@[bamFname], faFname, bams, fa)
+  if len(faFname) > 0:
+    fa.enableCache()
+
+  let wins = windows(sites, maxGap)
+  logger.log(lvlInfo, fmt"Fetching {len(sites)} sites in {len(wins)} windows")
+  for win in wins:
+    var plps = initTable[int64, PositionData]()# by 1-based position
+    let records = newRecordFilter(bams[0], win.reg.sq, win.reg.s, win.reg.e)
+    timed(tRegion, $win.reg):
+      algorithm.pileup(fa, records, win.reg,
+        proc(plp: PositionData) = plps[plp.refIndex] = plp,
+        params, win.positions)
+    for site in win.sites:
+      handler(site, plps.getOrDefault(site.pos))
+
+
+proc coverageFilter(plp: PositionData, params = plpParams): string =
+  ## VCF filter for a position failing the coverage filters of params, or
+  ## "." if it passes (or there is no pileup)
+  if plp.isNil:
+    return "."
+  let cov = coverage(plp)
+  if cov < params.minCov:
+    "minCov"
+  elif cov > params.maxCov:
+    "maxCov"
+  else:
+    "."
+
+
+proc sampleNames(bamFnames: seq[string]): seq[string] =
+  ## Derives unique sample names from BAM file names. A name that's already
+  ## taken gets the suffix "-<n>", with n starting at the file's (1-based)
+  ## position and counting up until the name is unused
+  for i, fname in bamFnames:
+    let base = splitFile(fname).name
+    var name = base
+    var n = i+1
+    while name in result:
+      name = base & "-" & $n
+      inc n
+    result.add(name)
 
 
 ## "main" function. actually a pileup function with different postprocessing options
 proc call*(bamFname: string, faFname: string, regions = "", bedFname = "",
            minVarQual: int = DEFAULT_MIN_VAR_QUAL,
            minAF: float = DEFAULT_MIN_AF,
+           sig: float = DEFAULT_SIG, bonf = DEFAULT_BONF,
            minCov: int = DEFAULT_MIN_COV,
            maxCov: int = DEFAULT_MAX_COV,
            minBQ: int = DEFAULT_MIN_BQ,
            noMQ: bool = not DEFAULT_USE_MQ,
-           loglevel = 0, pileup = false, pretty = false) =
+           loglevel = 0, pileup = false, pretty = false,
+           stats = "", trace = "", htsThreads = AUTO_HTS_THREADS,
+           outPrefix = "", checkpointDir = "", chunkSize = 1_000_000,
+           plpStore = "", stream = false, collapseReads = false,
+           shardManifest = "", shardId = -1, qualBins = "", sites = "") =
 
   if logLevel >= 3:
     setLogFilter(lvlDebug)
@@ -94,26 +280,126 @@ proc call*(bamFname: string, faFname: string, regions = "", bedFname = "",
   else:
     quit("Invalid log level")
 
-  var p: DataToVoid
+  # a shard's regions (see shard) are handled like any other regions
+  var regions = regions
+  if len(shardManifest) > 0:
+    if len(regions) > 0 or len(bedFname) > 0:
+      quit("Can't use regions together with a shard")
+    regions = shardRegions(shardManifest, shardId).mapIt($it).join(",")
+
+  # several, comma separated BAM files are piled up jointly, writing one
+  # output file per sample (<outPrefix><sample>.vcf or .json)
+  let bamFnames = bamFname.split(',')
+  var outFhs: seq[File]
+  if len(bamFnames) > 1:
+    if len(outPrefix) == 0:
+      quit("Need an output prefix when calling on more than one BAM file")
+    let ext = if pileup: ".json" else: ".vcf"
+    for sample in sampleNames(bamFnames):
+      outFhs.add(open(outPrefix & sample & ext, fmWrite))
+  else:
+    outFhs.add(stdout)
+
+  var handlers: seq[DataToVoid]
+  var callOutputs: seq[CallOutput]
   if pileup:
     if pretty:
       logger.log(lvlWarn, "Pretty printing is good for debugging,",
                  "but cannot be used for calling")
-      p = toJsonAndPrettyPrint
+      if len(outFhs) > 1:
+        quit("Pretty print only supported for single BAM input")
+      handlers.add(toJsonAndPrettyPrint)
     else:
-      p = toJsonAndPrint
+      for fh in outFhs:
+        handlers.add(toJsonAndWrite(fh))
   else:
     if pretty:
       quit("Pretty print can only be used in conjuction with json")
-    echo vcfHeader()
     callParams.minVarQual = minVarQual
     callParams.minAF  = minAF
-    p = callAndPrint
+    callParams.sig = sig
+    setBonf(bonf)
+    for fh in outFhs:
+      fh.writeLine(vcfHeader())
+      callOutputs.add(newCallOutput(fh))
+      handlers.add(callAndWrite(callOutputs[^1]))
+
+  # keep pileup in an indexed store, so that we can recall later
+  var store: PlpStoreWriter
+  if len(plpStore) > 0:
+    if pileup or len(bamFnames) > 1 or len(checkpointDir) > 0:
+      quit("Pileup store only supported when calling single BAM input without checkpointing")
+    store = openPlpStoreWriter(plpStore)
+    handlers[0] = storeAndCall(store, callOutputs[0])
 
   plpParams.minCov = minCov
   plpParams.maxCov = maxCov
   plpParams.minBQ = minBQ
   plpParams.useMQ = not noMQ
-  fullPileup(bamFname, faFname, regions, bedFname, p)
+  plpParams.collapseReads = collapseReads
+  try:
+    plpParams.qualBins = parseQualBins(qualBins)
+  except ValueError:
+    quit("Invalid quality bins: " & getCurrentExceptionMsg())
+  traceEnabled = len(trace) > 0
+  initHtsPool(htsThreads)
+  if len(sites) > 0:
+    # force-calling known sites only
+    if pileup or len(bamFnames) > 1 or stream or len(checkpointDir) > 0 or
+       len(plpStore) > 0 or len(regions) > 0 or len(bedFname) > 0:
+      quit("Sites can only be used for calling on single BAM input, without regions, streaming or checkpointing")
+    sitesPileup(bamFname, faFname, readSites(sites),
+      proc(site: Site, plp: PositionData) =
+        let filter = coverageFilter(plp)
+        var v = forceCallAtPos(plp, site)
+        v.filter = filter
+        outFhs[0].writeLine($v))
+  elif stream or bamFname == "-":
+    # no index, hence no regions or chunks. reads are processed in file order
+    if len(bamFnames) > 1 or len(checkpointDir) > 0:
+      quit("Streaming input is only supported for single BAM input without checkpointing")
+    if len(regions) > 0 or len(bedFname) > 0:
+      quit("Regions can't be used with streaming input")
+    streamedPileup(bamFname, faFname, handlers[0])
+  elif len(checkpointDir) > 0:
+    if len(bamFnames) > 1 or pretty:
+      quit("Checkpointing is only supported for single BAM input and without pretty printing")
+    if not pileup and defersCalls():
+      # chunks are final once written, but the number of tests isn't
+      quit("Checkpointing can't be used with a dynamic Bonferroni factor (use a fixed --bonf)")
+    # all parameters that change results
+    let fingerprint = [bamFname, faFname, regions, bedFname, $minVarQual,
+      $minAF, $sig, bonf, $minCov, $maxCov, $minBQ, $noMQ, qualBins, $pileup,
+      $chunkSize].join(";")
+    let factory = if pileup: toJsonAndWrite else: callAndWrite
+    let ext = if pileup: ".json" else: ".vcf"
+    checkpointedPileup(bamFname, faFname, regions, bedFname, checkpointDir,
+      fingerprint, chunkSize, factory, stdout, ext)
+  else:
+    fullPileup(bamFnames, faFname, regions, bedFname, handlers)
+
+  for output in callOutputs:
+    output.finish()
+  for fh in outFhs:
+    if fh != stdout:
+      fh.close()
+  if not store.isNil:
+    store.close()
+
+  if len(stats) > 0:
+    writeStats(stats)
+  if len(trace) > 0:
+    writeTrace(trace)
+
+
+when isMainModule:
+  import ../utils
 
+  testblock "sampleNames":
+    doAssert sampleNames(@["x/a.bam", "b.bam"]) == @["a", "b"]
+    doAssert sampleNames(@["a.bam", "y/a.bam"]) == @["a", "a-2"]
+    # generated suffix taken by a real name
+    doAssert sampleNames(@["a.bam", "a-3.bam", "y/a.bam"]) == @["a", "a-3", "a-4"]
+    doAssert sampleNames(@["a.bam", "y/a.bam", "a-2.bam"]) == @["a", "a-2", "a-2-3"]
 
+  echo "OK: all tests passed"
@@ -9,8 +9,40 @@ import json
 # third party
 # project specific
 import storage/containers/positionData
+import storage/slidingDeque
 import ../call
 import ../vcf
+import ../perfstats
+import ../plpstore
+
+
+const JSON_BUF_SIZE = 4096# initial size of JSON output buffers
+
+
+type CallOutput* = ref object
+  ## Output file for variant calls. Calls that can only be filtered once all
+  ## tests are counted (see call.defersCalls) are held back until finish()
+  fh: File
+  deferred: seq[Variant]
+
+
+proc newCallOutput*(fh: File): CallOutput =
+  CallOutput(fh: fh)
+
+
+proc add(self: CallOutput, vars: seq[Variant]) =
+  if defersCalls():
+    self.deferred.add(vars)
+  else:
+    for v in vars:
+      self.fh.writeLine($v)
+
+
+proc finish*(self: CallOutput) =
+  ## Writes the held back calls passing the final multiple testing filter
+  for v in filterSignificant(self.deferred):
+    self.fh.writeLine($v)
+  self.deferred.setLen(0)
 
 proc toJson*(data: PositionData): JsonNode =
   ## Converts the given PositionData object into a JsonNode.
@@ -22,14 +54,55 @@ proc toJsonAndPrettyPrint*(data: PositionData): void =
 
 
 proc toJsonAndPrint*(data: PositionData): void =
-  ## Converts the given PositionData object into a JsonNode.
-  writeLine(stdout, %data)
+  ## Writes the given PositionData object as JSON to stdout
+  var buf = newStringOfCap(JSON_BUF_SIZE)
+  buf.addJson(data)
+  writeLine(stdout, buf)
 
 
 proc doNothing*(data: PositionData): void =
   discard true
 
 
+proc toJsonAndWrite*(fh: File): DataToVoid =
+  ## Returns a handler writing JSON to the given file. The output buffer is
+  ## reused for all positions
+  var buf = newStringOfCap(JSON_BUF_SIZE)
+  result = proc(data: PositionData) =
+    buf.setLen(0)
+    buf.addJson(data)
+    fh.writeLine(buf)
+
+
+proc callAndWrite*(output: CallOutput): DataToVoid =
+  ## Returns a handler writing variant calls to the given output. Call
+  ## finish() on it after the pileup
+  result = proc(plp: PositionData) =
+    var vars: seq[Variant]
+    timedNoTrace(tCallAtPos):
+      vars = callAtPos(plp)
+    output.add(vars)
+
+
+proc callAndWrite*(fh: File): DataToVoid =
+  ## Returns a handler writing variant calls straight to the given file,
+  ## which requires that calls aren't deferred
+  doAssert not defersCalls()
+  callAndWrite(newCallOutput(fh))
+
+
+proc storeAndCall*(store: PlpStoreWriter, output: CallOutput): DataToVoid =
+  ## Returns a handler adding the pileup to the store and writing variant
+  ## calls to the given output
+  let caller = callAndWrite(output)
+  result = proc(plp: PositionData) =
+    store.add(plp)# before calling, which cleans plp
+    caller(plp)
+
+
 proc callAndPrint*(plp: PositionData): void =
-  for v in callAtPos(plp):
+  var vars: seq[Variant]
+  timedNoTrace(tCallAtPos):
+    vars = callAtPos(plp)
+  for v in vars:
     echo $v
\ No newline at end of file
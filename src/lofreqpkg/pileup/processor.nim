@@ -9,18 +9,28 @@
 ## pileup), they can implement a new processor and pass that to the algorithm
 ## instead without any need to change the algorithm itself.
 ##
+## Which optional qualities a read carries (see 'QualTag') is determined once
+## per read. Reads with one of the common tag sets are processed by code
+## specialized at compile time for that set (no availability checks and no
+## merging of unavailable qualities per base), all others by the generic
+## fallback.
+##
 ## - Author: Filip Sodic <filip.sodic@gmail.com>
 ## - License: The MIT License
 
 
 # standard library
-#import strutils
+import macros
+import strutils
 # import logging
 #import math
 # third party
 import hts
 # project specific
 import ../utils
+import ../perfstats
+import storage/containers/allele
+import qualBins
 
 
 #var logger = newConsoleLogger(fmtStr = verboseFmtStr, useStderr = true)
@@ -35,9 +45,34 @@ const BASE_ALN_QUAL_TAG = "BQ"# base alignment quality tag (BAQ)
 const INS_QUAL_TAG = "BI"# ins quality tag
 const DEL_QUAL_TAG = "BD"# del quality tag
 
+## All tags qualities are read from (next to base and mapping qualities)
+const QUALITY_TAGS* = [BASE_ALN_QUAL_TAG, INS_QUAL_TAG, INS_ALN_QUAL_TAG,
+                       DEL_QUAL_TAG, DEL_ALN_QUAL_TAG]
+
+
+type QualTag* = enum
+  ## Qualities next to base qualities, which might be unavailable for a read
+  qtMapQual, qtBaseAln, qtIns, qtInsAln, qtDel, qtDelAln,
+  qtDynamic# not a quality: availability is checked per base (fallback)
+
+type QualTags* = set[QualTag]
+
+const
+  NO_TAGS: QualTags = {}
+  INDEL_TAGS: QualTags = {qtIns, qtDel}# e.g. indelqual
+  INDEL_ALN_TAGS: QualTags = {qtInsAln, qtDelAln}# e.g. alnqual
+  ALL_INDEL_TAGS: QualTags = INDEL_TAGS + INDEL_ALN_TAGS
+  ALL_TAGS: QualTags = ALL_INDEL_TAGS + {qtBaseAln}
+
+const SPECIALIZED_TAGS = [NO_TAGS, INDEL_TAGS, INDEL_ALN_TAGS, ALL_INDEL_TAGS, ALL_TAGS,
+                          NO_TAGS + {qtMapQual}, INDEL_TAGS + {qtMapQual},
+                          INDEL_ALN_TAGS + {qtMapQual}, ALL_INDEL_TAGS + {qtMapQual},
+                          ALL_TAGS + {qtMapQual}]
+
 
 # for optimization purposes to avoid having to parse/decode tags multiple times
 type TReadQualityBuffer* = object
+    tags: QualTags# available qualities
     mapQual: int# int because 255 as per BAM standard means NA. reflected here as high(int)
     # might be of length zero of not present 
     baseQuals: seq[uint8]# base qualities
@@ -47,12 +82,15 @@ type TReadQualityBuffer* = object
     delQuals: seq[uint8]# deletion qualities
     delAlnQuals: seq[uint8]# deletion alignment qualties
 
-type Processor[TStorage] = ref object
+type Processor*[TStorage] = ref object
   ## The 'Processor' type. Its fields are configuration options.
   storage: TStorage
+  alleles: AlleleDict# for interning events; shared with storage
   readQualityBuffer: TReadQualityBuffer# of current read for optimization
   useMQ: bool
   minBQ: int# minimum base quality. everything below will be recorded as -1.
+  weight: Positive# number of identical reads the current read stands for
+  qualBins: QualBins# applied to all merged qualities
 
 
 proc mergeQuals*(q_m: int, q_a: int, q_b: int): int =
@@ -67,6 +105,42 @@ proc mergeQuals*(q_m: int, q_a: int, q_b: int): int =
   prob2qual(p_c)
 
 
+proc mergeKnownQuals(hasM, hasA: static bool, q_m: int, q_a: int,
+                     q_b: int): int {.inline.} =
+  # Like mergeQuals, but with the availability of mapping and alignment
+  # quality known at compile time. Unavailable ones have an error
+  # probability of 0, so leaving their terms out gives identical results.
+  when hasM and hasA:
+    mergeQuals(q_m, q_a, q_b)
+  elif hasM:
+    let p_m = qual2prob(q_m)
+    prob2qual(p_m + (1-p_m)*qual2prob(q_b))
+  elif hasA:
+    let p_a = qual2prob(q_a)
+    prob2qual(p_a + (1-p_a)*qual2prob(q_b))
+  else:
+    prob2qual(qual2prob(q_b))
+
+
+template tagQual(tags: static QualTags, tag: QualTag, quals: seq[uint8],
+                 i: int): int =
+  # quality i of an optional quality buffer or high(int) if unavailable
+  when qtDynamic in tags:
+    (if quals.len > 0: int(quals[i]) else: high(int))
+  elif tag in tags:
+    int(quals[i])
+  else:
+    high(int)
+
+
+template mergeTagQuals(tags: static QualTags, alnTag: QualTag,
+                       q_m, q_a, q_b: int): int =
+  when qtDynamic in tags:
+    mergeQuals(q_m, q_a, q_b)
+  else:
+    mergeKnownQuals(qtMapQual in tags, alnTag in tags, q_m, q_a, q_b)
+
+
 proc getQualities(r: Record, quals: var seq[uint8], bamTag: string): seq[uint8] =
   quals.set_len(0)
   let qualsEnc = tag[cstring](r, bamTag)
@@ -100,87 +174,132 @@ proc getReadQualityBuffer*(r: Record, useMQ: bool): TReadQualityBuffer =
       if mq != 255:# 255 means NA as per BAM standard
         result.mapQual = mq
 
+    result.tags = {}
+    if result.mapQual != high(int): result.tags.incl(qtMapQual)
+    if len(result.baseAlnQuals) > 0: result.tags.incl(qtBaseAln)
+    if len(result.insQuals) > 0: result.tags.incl(qtIns)
+    if len(result.insAlnQuals) > 0: result.tags.incl(qtInsAln)
+    if len(result.delQuals) > 0: result.tags.incl(qtDel)
+    if len(result.delAlnQuals) > 0: result.tags.incl(qtDelAln)
+
 
-proc matchQualityAt(self: Processor, i: int): Natural =
+proc matchQualityAt(self: Processor, i: int,
+                    tags: static QualTags = {qtDynamic}): Natural {.inline.} =
   let q_b = int(self.readQualityBuffer.baseQuals[i])# from htsnim, always present as per BAM standard.
-  var q_a = high(int)
+  let q_a = tagQual(tags, qtBaseAln, self.readQualityBuffer.baseAlnQuals, i)
   let q_m = self.readQualityBuffer.mapQual
-  if self.readQualityBuffer.baseAlnQuals.len > 0:
-    q_a = int(self.readQualityBuffer.baseAlnQuals[i])
-  mergeQuals(q_m, q_a, q_b)
+  self.qualBins.bin(mergeTagQuals(tags, qtBaseAln, q_m, q_a, q_b))
 
 
-proc insertionQualityAt(self: Processor, i: int): Natural =
-  var q_i = high(int)
-  var q_a = high(int)
+proc insertionQualityAt(self: Processor, i: int,
+                        tags: static QualTags = {qtDynamic}): Natural {.inline.} =
+  let q_i = tagQual(tags, qtIns, self.readQualityBuffer.insQuals, i)
+  let q_a = tagQual(tags, qtInsAln, self.readQualityBuffer.insAlnQuals, i)
   let q_m = self.readQualityBuffer.mapQual
-  if self.readQualityBuffer.insQuals.len > 0:
-    q_i = int(self.readQualityBuffer.insQuals[i])
-  if self.readQualityBuffer.insAlnQuals.len > 0:
-    q_a = int(self.readQualityBuffer.insAlnQuals[i])
-  mergeQuals(q_m, q_a, q_i)
+  self.qualBins.bin(mergeTagQuals(tags, qtInsAln, q_m, q_a, q_i))
 
 
-proc deletionQualityAt(self: Processor, i: int): Natural =
-  var q_d = high(int)
-  var q_a = high(int)
+proc deletionQualityAt(self: Processor, i: int,
+                       tags: static QualTags = {qtDynamic}): Natural {.inline.} =
+  let q_d = tagQual(tags, qtDel, self.readQualityBuffer.delQuals, i)
+  let q_a = tagQual(tags, qtDelAln, self.readQualityBuffer.delAlnQuals, i)
   let q_m = self.readQualityBuffer.mapQual
-  if self.readQualityBuffer.delQuals.len > 0:
-    q_d = int(self.readQualityBuffer.delQuals[i])
-  if self.readQualityBuffer.delAlnQuals.len > 0:
-    q_a = int(self.readQualityBuffer.delAlnQuals[i])
-  mergeQuals(q_m, q_a, q_d)
-  
-
-proc newProcessor*[TStorage](storage: TStorage, useMQ: bool, minBQ: int):
+  self.qualBins.bin(mergeTagQuals(tags, qtDelAln, q_m, q_a, q_d))
+
+
+macro withReadTags(self: untyped, call: untyped): untyped =
+  # Expands call with 'tags' bound at compile time to the tag set of the
+  # current read if it's one of SPECIALIZED_TAGS, else to the fallback. One
+  # branch per entry of SPECIALIZED_TAGS, i.e. adding a set there suffices
+  let readTags = genSym(nskLet, "readTags")
+  let tags = ident("tags")
+  let branches = newNimNode(nnkIfStmt)
+  for i in 0..<len(SPECIALIZED_TAGS):
+    let idx = newLit(i)
+    let body = copyNimTree(call)
+    let cond = quote do:
+      `readTags` == SPECIALIZED_TAGS[`idx`]
+    let branch = quote do:
+      const `tags` = SPECIALIZED_TAGS[`idx`]
+      `body`
+    branches.add(newTree(nnkElifBranch, cond, branch))
+  let body = copyNimTree(call)
+  let fallback = quote do:
+    const `tags` = {qtDynamic}
+    `body`
+  branches.add(newTree(nnkElse, fallback))
+  result = quote do:
+    let `readTags` = `self`.readQualityBuffer.tags
+    `branches`
+
+
+proc newProcessor*[TStorage](storage: TStorage, useMQ: bool, minBQ: int,
+                             qualBins = noQualBins()):
   # minBQ = minimum base quality. everything below will be recorded as -1.
   # is later ignored/filtered by call(). 3 is default,
   # so that Illumina's Read Segment Quality Control Indicator" (#) gets ignored
+  # qualBins = binning of merged qualities (see qualBins). none by default
   Processor[TStorage] {.inline.} =
     Processor[TStorage](storage: storage,
+                      alleles: storage.alleles,
                       minBQ: minBQ,
-                      useMQ: useMQ)
+                      useMQ: useMQ,
+                      weight: 1,
+                      qualBins: qualBins)
                       # readQualityBuffer unset for now and updated per read
 
 
-proc processMatches*[TSequence](self: Processor,
+proc processMatchesImpl[TSequence](self: Processor, tags: static QualTags,
                    readStart: int, refStart: int64, length: int,
                    read: Record, reference: TSequence,
                    nextevent: CigarElement) : void {.inline.} =
-  ## Processes a matching substring between the read and the reference. All
-  ## necessary information is available through the arguments. A matching
-  ## substring consists of multiple contiguous matching bases.
+  let reverse = read.flag.reverse
   for offset in countUp(0, length - 1):
     let refOff = int(refStart + offset)# FIXME stupid
     let readOff = readStart + offset
     let bq = int(self.readQualityBuffer.baseQuals[readOff])
+    let base = self.alleles.baseAllele(read.baseAt(readOff))
     if bq >= self.minBQ:
-      self.storage.recordMatch(refOff, $read.baseAt(readOff),
-                                self.matchQualityAt(readOff),
-                                read.flag.reverse,
-                                reference.baseAt(refOff))
+      self.storage.recordMatch(refOff, base,
+                                self.matchQualityAt(readOff, tags),
+                                reverse,
+                                reference.baseAt(refOff),
+                                self.weight)
     else:
-      self.storage.recordMatch(refOff, $read.baseAt(readOff),
+      self.storage.recordMatch(refOff, base,
                                 -1,# flag for later filtering
-                                read.flag.reverse,
-                                reference.baseAt(refOff))
+                                reverse,
+                                reference.baseAt(refOff),
+                                self.weight)
     # Here we also need to record the indel qualities emitted from matches.
     # Just be careful to not count twice (hence check next op if at the end)
     if offset < length-1:
-        self.storage.recordInsertion(refOff, $refSymbolAtIndel(read.flag.reverse),
-          self.insertionQualityAt(readOff),
-          read.flag.reverse)
-        self.storage.recordDeletion(refOff, $refSymbolAtIndel(read.flag.reverse),
-          self.deletionQualityAt(readOff),
-          read.flag.reverse)
+        self.storage.recordInsertion(refOff, INDEL_REF_ALLELE,
+          self.insertionQualityAt(readOff, tags),
+          reverse, self.weight)
+        self.storage.recordDeletion(refOff, INDEL_REF_ALLELE,
+          self.deletionQualityAt(readOff, tags),
+          reverse, self.weight)
     elif nextevent.op == CigarOp.insert:
-      self.storage.recordDeletion(refOff, $refSymbolAtIndel(read.flag.reverse),
-        self.deletionQualityAt(readOff),
-        read.flag.reverse)
+      self.storage.recordDeletion(refOff, INDEL_REF_ALLELE,
+        self.deletionQualityAt(readOff, tags),
+        reverse, self.weight)
     elif nextevent.op == CigarOp.deletion:
-      self.storage.recordInsertion(refOff, $refSymbolAtIndel(read.flag.reverse),
-        self.insertionQualityAt(readOff),
-        read.flag.reverse)
+      self.storage.recordInsertion(refOff, INDEL_REF_ALLELE,
+        self.insertionQualityAt(readOff, tags),
+        reverse, self.weight)
+
+
+proc processMatches*[TSequence](self: Processor,
+                   readStart: int, refStart: int64, length: int,
+                   read: Record, reference: TSequence,
+                   nextevent: CigarElement) : void {.inline.} =
+  ## Processes a matching substring between the read and the reference. All
+  ## necessary information is available through the arguments. A matching
+  ## substring consists of multiple contiguous matching bases.
+  self.withReadTags:
+    self.processMatchesImpl(tags, readStart, refStart, length,
+                            read, reference, nextevent)
 
 
 proc processInsertion*[TSequence](self: Processor,
@@ -189,14 +308,14 @@ proc processInsertion*[TSequence](self: Processor,
   ## Processes an insertion on the read (wrt. the reference). All necessary
   ## information is available through the arguments. An insertion consists of
   ## one or more bases found on the read, but not on the reference.
-  var value = ""
+  var value = newStringOfCap(length)
   for offset in countUp(readStart, readStart + length - 1):
-    value &= read.baseAt(offset)
+    value.add(read.baseAt(offset))
 
   # insertion is reported on the base that preceeds it
-  self.storage.recordInsertion(refIndex - 1, value,
+  self.storage.recordInsertion(refIndex - 1, self.alleles.intern(value),
                                self.insertionQualityAt(readStart),
-                               read.flag.reverse)
+                               read.flag.reverse, self.weight)
 
 
 proc processDeletion*[TSequence](self: Processor,
@@ -205,27 +324,72 @@ proc processDeletion*[TSequence](self: Processor,
   ## Processes an deletion on the read (wrt. the reference). All necessary
   ## information is available through the arguments. A deletion consists of one
   ## or more bases found on the read, but not on the reference.
-  var value = ""
+  var value = newStringOfCap(length)
   for offset in countUp(refStart, refStart + length - 1):
-    value &= reference.baseAt(int(offset))# stupid conversion
-    self.storage.recordMatch(offset, $DEFAULT_BLANK_SYMBOL,
+    value.add(reference.baseAt(int(offset)).toUpperAscii)# stupid conversion
+    self.storage.recordMatch(offset, BLANK_ALLELE,
                              DEFAULT_BLANK_QUALITY,
                              read.flag.reverse,
-                             reference.baseAt(int(offset)))# FIXME stupid int conversion
+                             reference.baseAt(int(offset)),# FIXME stupid int conversion
+                             self.weight)
 
   # deletion is reported on the base that preceeds it
-  self.storage.recordDeletion(refStart - 1, value,
+  self.storage.recordDeletion(refStart - 1, self.alleles.intern(value),
                               self.deletionQualityAt(readIndex),
-                              read.flag.reverse)
+                              read.flag.reverse, self.weight)
 
 
-proc beginRead*(self: Processor, read: Record): void {.inline.} =
-  ## flush the storage up to the starting position.
+proc beginRead*(self: Processor, read: Record,
+                weight: Positive = 1): void {.inline.} =
+  ## flush the storage up to the starting position. 'weight' is the number of
+  ## identical reads this read stands for (see module 'collapse').
   discard self.storage.flushUpTo(read.start)
+  count(cReadsProcessed)
+  self.weight = weight
   # buffer all read qualities for optimization (only parse qualities once)
   self.readQualityBuffer = read.getReadQualityBuffer(self.useMQ)
+  if self.readQualityBuffer.tags notin SPECIALIZED_TAGS:
+    count(cReadsGenericQuals)
      
 
 proc done*(self: Processor): void {.inline.} =
   ## Finishes the processing, flushes the entire storage.
   discard self.storage.flushAll()
+
+
+when isMainModule:
+  testblock "specialized merging is identical":
+    const NA = high(int)
+    for q_b in [0, 2, 20, 37, 60, NA]:
+      for q_a in [0, 10, 30, 93]:
+        for q_m in [0, 20, 60, 254]:
+          doAssert mergeKnownQuals(true, true, q_m, q_a, q_b) == mergeQuals(q_m, q_a, q_b)
+          doAssert mergeKnownQuals(true, false, q_m, q_a, q_b) == mergeQuals(q_m, NA, q_b)
+          doAssert mergeKnownQuals(false, true, q_m, q_a, q_b) == mergeQuals(NA, q_a, q_b)
+          doAssert mergeKnownQuals(false, false, q_m, q_a, q_b) == mergeQuals(NA, NA, q_b)
+
+  testblock "withReadTags":
+    type Reader = object
+      readQualityBuffer: TReadQualityBuffer
+    var r: Reader
+    for t in SPECIALIZED_TAGS:
+      r.readQualityBuffer.tags = t
+      var bound: QualTags
+      r.withReadTags:
+        bound = tags
+      doAssert bound == t
+    r.readQualityBuffer.tags = {qtBaseAln}# not specialized
+    var bound: QualTags
+    r.withReadTags:
+      bound = tags
+    doAssert bound == {qtDynamic}
+
+  testblock "tagQual":
+    let quals = @[10'u8, 20'u8]
+    let none: seq[uint8] = @[]
+    doAssert tagQual({qtDynamic}, qtIns, quals, 1) == 20
+    doAssert tagQual({qtDynamic}, qtIns, none, 1) == high(int)
+    doAssert tagQual({qtIns}, qtIns, quals, 0) == 10
+    doAssert tagQual({qtDel}, qtIns, quals, 0) == high(int)
+
+  echo "OK: all tests passed"
@@ -0,0 +1,112 @@
+## The module implements binning of (merged) qualities, applied by the
+## 'Processor' before events are recorded. Every quality is replaced with the
+## representative quality of its bin, which reduces the number of distinct
+## qualities per allele, i.e. the size of the quality histograms and the
+## JSON pileup. Calling isn't faster, since it uses one error probability per
+## base, and loses some sensitivity (see README).
+## Supported are Illumina's 8-level binning scheme ("illumina8") and custom
+## maps of the form "lo-hi:q,lo-hi:q,...", where the last range may be open
+## ("lo-:q"). Qualities not covered by a custom map are kept as they are.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+
+# standard
+import strutils
+# project specific
+import ../utils
+
+
+const MAX_BINNED_QUAL = 100# everything above is binned like this value
+
+const ILLUMINA8_BINS* = "2-9:6,10-19:15,20-24:22,25-29:27,30-34:33,35-39:37,40-:40"
+  ## Illumina's 8-level scheme. Qualities 0 and 1 (no call) aren't covered,
+  ## i.e. kept as they are
+
+
+type QualBins* = object
+  ## Lookup table from quality to binned quality. Empty means no binning.
+  table: seq[int]
+
+
+proc noQualBins*(): QualBins =
+  QualBins(table: @[])
+
+
+proc enabled*(self: QualBins): bool {.inline.} =
+  len(self.table) > 0
+
+
+proc parseQualBins*(spec: string): QualBins =
+  ## Parses a binning spec: "" or "none" (no binning), "illumina8" or a
+  ## custom map (see module doc)
+  if len(spec) == 0 or spec == "none":
+    return noQualBins()
+  let map = if spec == "illumina8": ILLUMINA8_BINS else: spec
+  result.table = newSeq[int](MAX_BINNED_QUAL+1)
+  for q in 0..MAX_BINNED_QUAL:
+    result.table[q] = q
+  for entry in map.split(','):
+    let parts = entry.strip().split(':')
+    if len(parts) != 2:
+      raise newException(ValueError, "Invalid quality bin " & entry)
+    let bounds = parts[0].split('-')
+    if len(bounds) != 2:
+      raise newException(ValueError, "Invalid quality range in bin " & entry)
+    let lo = parseInt(bounds[0])
+    let hi = if len(bounds[1]) == 0: MAX_BINNED_QUAL else: min(parseInt(bounds[1]), MAX_BINNED_QUAL)
+    let binQual = parseInt(parts[1])
+    if lo < 0 or lo > hi or binQual < 0:
+      raise newException(ValueError, "Invalid quality bin " & entry)
+    for q in lo..hi:
+      result.table[q] = binQual
+
+
+proc bin*(self: QualBins, q: int): int {.inline.} =
+  ## Binned quality. Negative values (flags) are returned unchanged.
+  if q < 0 or not self.enabled:
+    q
+  else:
+    self.table[min(q, MAX_BINNED_QUAL)]
+
+
+when isMainModule:
+  testblock "no binning":
+    let b = parseQualBins("")
+    doAssert not b.enabled
+    doAssert b.bin(23) == 23
+    doAssert b.bin(-1) == -1
+
+  testblock "illumina8":
+    let b = parseQualBins("illumina8")
+    doAssert b.bin(0) == 0
+    doAssert b.bin(1) == 1
+    doAssert b.bin(2) == 6
+    doAssert b.bin(5) == 6
+    doAssert b.bin(19) == 15
+    doAssert b.bin(20) == 22
+    doAssert b.bin(37) == 37
+    doAssert b.bin(41) == 40
+    doAssert b.bin(high(int)) == 40
+    doAssert b.bin(-1) == -1
+
+  testblock "custom":
+    let b = parseQualBins("0-19:10,20-:30")
+    doAssert b.bin(3) == 10
+    doAssert b.bin(20) == 30
+    doAssert b.bin(99) == 30
+    let partial = parseQualBins("10-19:15")
+    doAssert partial.bin(5) == 5
+    doAssert partial.bin(12) == 15
+
+  testblock "invalid":
+    for spec in ["10:15", "a-b:3", "20-10:3"]:
+      var failed = false
+      try:
+        discard parseQualBins(spec)
+      except ValueError:
+        failed = true
+      doAssert failed, spec
+
+  echo "OK: all tests passed"
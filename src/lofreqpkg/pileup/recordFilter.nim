@@ -8,6 +8,7 @@
 
 
 import hts
+import ../perfstats
 
 
 ## All the possible flags for the records. Use this instead of raw numbers
@@ -70,5 +71,44 @@ iterator items*(self: RecordFilter) : Record =
   ## Enables transparent iteration in for..in loops. Makes any 'RecordFilter'
   ## object an iterable. This method should in most cases be called implicitly.
   for read in self.bam.query(self.chromosomeName, int(self.startIdx), int(self.endIdx)):
+    count(cReadsFetched)
     if (read.flag and self.ignoreFlag) == 0:
       yield read
+    else:
+      count(cReadsFiltered)
+
+
+proc stream*(self: RecordFilter): iterator(): Record =
+  ## Returns a closure iterator over the filtered records, for pulling records
+  ## from several filters in turn (e.g. when merging samples). Note that the
+  ## yielded record is reused by htslib, i.e. only valid until the next call.
+  result = iterator(): Record =
+    for read in self:
+      yield read
+
+
+iterator passing*(bam: Bam, ignoreFlag: uint16 = DEFAULT_IGNORE_FLAGS,
+                  numMapped: int64 = -1): Record =
+  ## Iterates over all records of the bam file in file order (no index needed,
+  ## e.g. when reading from stdin), letting through records which are marked
+  ## with none of the flags in 'ignoreFlag'. If the number of mapped reads
+  ## in the file is known (numMapped >= 0), iteration stops after the last
+  ## one, i.e. the unmapped reads at the end of the file are never read.
+  var mappedLeft = numMapped
+  for read in bam:
+    if mappedLeft == 0:
+      break
+    count(cReadsFetched)
+    if (read.flag and READ_UNMAPPED) == 0 and mappedLeft > 0:
+      dec mappedLeft
+    if (read.flag and ignoreFlag) == 0:
+      yield read
+    else:
+      count(cReadsFiltered)
+
+
+proc passingStream*(bam: Bam, numMapped: int64 = -1): iterator(): Record =
+  ## Closure iterator version of 'passing' (with default flags)
+  result = iterator(): Record =
+    for read in passing(bam, numMapped=numMapped):
+      yield read
@@ -0,0 +1,173 @@
+## The module implements interned allele codes. Instead of allocating a
+## string for every event, alleles are represented by small integers: fixed
+## codes for single bases (A, C, G, T, N), the blank symbol for deleted bases
+## ('*') and the reference placeholder at indel positions ('-'), and codes
+## from a per-chromosome dictionary ('AlleleDict') for everything else, i.e.
+## inserted and deleted sequences. The strand is kept in the lowest bit.
+## Alleles are only converted back to strings for output, where, as before,
+## the reverse strand is indicated by lower case ('_' for the reference
+## placeholder). The blank symbol carries no strand.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+# standard
+import hashes
+import tables
+import strutils
+# project specific
+import ../../../utils
+
+
+type Allele* = distinct int32
+  ## (id shl 1) or reverse-strand bit
+
+
+type AlleleDict* = ref object
+  ## Per-chromosome dictionary of allele sequences not covered by fixed codes
+  seqs: seq[string]
+  ids: Table[string, int32]
+
+
+const
+  FIXED_ALLELES = "ACGTN*" & REF_SYMBOL_AT_INDEL_FW
+  N_ID = 4'i32
+  BLANK_ID = 5'i32
+  INDEL_REF_ID = 6'i32
+  FIRST_DICT_ID = 7'i32
+
+
+const BASE_IDS = block:
+  # single base to fixed id (or -1)
+  var t: array[char, int8]
+  for c in low(char)..high(char):
+    t[c] = -1
+  for i, c in "ACGTN*":
+    t[c] = int8(i)
+    t[c.toLowerAscii] = int8(i)
+  t
+
+
+proc `==`*(a, b: Allele): bool {.borrow.}
+
+
+proc hash*(a: Allele): Hash {.inline.} =
+  hash(int32(a))
+
+
+proc id(a: Allele): int32 {.inline.} =
+  int32(a) shr 1
+
+
+proc isReverse*(a: Allele): bool {.inline.} =
+  (int32(a) and 1'i32) == 1'i32
+
+
+proc forward*(a: Allele): Allele {.inline.} =
+  ## Allele without strand information
+  Allele(int32(a) and not 1'i32)
+
+
+proc withStrand*(a: Allele, reverse: bool): Allele {.inline.} =
+  if reverse and a.id != BLANK_ID:
+    Allele(int32(a) or 1'i32)
+  else:
+    a
+
+
+proc fixedAllele(id: int32): Allele {.inline.} =
+  Allele(id shl 1)
+
+
+const
+  BLANK_ALLELE* = fixedAllele(BLANK_ID)# deleted base
+  INDEL_REF_ALLELE* = fixedAllele(INDEL_REF_ID)# reference at indel positions
+  N_ALLELE* = fixedAllele(N_ID)
+
+
+proc isFixed*(a: Allele): bool {.inline.} =
+  ## True for single bases and placeholders, false for dictionary alleles
+  a.id < FIRST_DICT_ID
+
+
+proc newAlleleDict*(): AlleleDict =
+  AlleleDict(seqs: @[], ids: initTable[string, int32]())
+
+
+proc intern*(self: AlleleDict, bases: string): Allele =
+  ## Returns the (forward) allele for the given upper case sequence
+  if len(bases) == 1 and BASE_IDS[bases[0]] >= 0:
+    return fixedAllele(int32(BASE_IDS[bases[0]]))
+  var id = self.ids.getOrDefault(bases, -1)
+  if id < 0:
+    id = FIRST_DICT_ID + int32(len(self.seqs))
+    self.seqs.add(bases)
+    self.ids[bases] = id
+  fixedAllele(id)
+
+
+proc baseAllele*(self: AlleleDict, base: char): Allele {.inline.} =
+  ## Returns the (forward) allele for a single base without allocation for
+  ## anything but rare IUPAC codes
+  let id = BASE_IDS[base]
+  if id >= 0:
+    fixedAllele(int32(id))
+  else:
+    self.intern($base.toUpperAscii)
+
+
+proc toString*(self: AlleleDict, a: Allele): string =
+  ## Converts allele to its string representation, where reverse strand is
+  ## indicated by lower case
+  let id = a.id
+  if id == INDEL_REF_ID:
+    return $refSymbolAtIndel(a.isReverse)
+  elif id < FIRST_DICT_ID:
+    result = $FIXED_ALLELES[id]
+  else:
+    result = self.seqs[id - FIRST_DICT_ID]
+  if a.isReverse:
+    result = result.toLowerAscii
+
+
+proc parse*(self: AlleleDict, s: string): Allele =
+  ## Parses the string representation created by toString
+  if s == $REF_SYMBOL_AT_INDEL_FW:
+    return INDEL_REF_ALLELE
+  elif s == $REF_SYMBOL_AT_INDEL_RV:
+    return INDEL_REF_ALLELE.withStrand(true)
+  let reverse = s[0].isLowerAscii
+  self.intern(s.toUpperAscii).withStrand(reverse)
+
+
+when isMainModule:
+  testblock "fixed alleles":
+    let d = newAlleleDict()
+    doAssert d.baseAllele('A') == d.intern("A")
+    doAssert d.baseAllele('a') == d.baseAllele('A')
+    doAssert d.baseAllele('*') == BLANK_ALLELE
+    doAssert d.baseAllele('N') == N_ALLELE
+    doAssert isFixed(d.baseAllele('T'))
+
+  testblock "strand":
+    let d = newAlleleDict()
+    let a = d.baseAllele('C')
+    doAssert not a.isReverse
+    doAssert a.withStrand(true).isReverse
+    doAssert a.withStrand(true).forward == a
+    doAssert BLANK_ALLELE.withStrand(true) == BLANK_ALLELE
+
+  testblock "dictionary":
+    let d = newAlleleDict()
+    let a = d.intern("ACG")
+    doAssert not a.isFixed
+    doAssert d.intern("ACG") == a
+    doAssert d.intern("AC") != a
+    doAssert d.baseAllele('R') == d.intern("R")
+
+  testblock "to and from string":
+    let d = newAlleleDict()
+    for s in ["A", "c", "N", "n", "*", "-", "_", "ACG", "acg", "R"]:
+      doAssert d.toString(d.parse(s)) == s, s
+
+  echo "OK: all tests passed"
@@ -1,10 +1,14 @@
 ## The module implements a data structure used to store all information
 ## relevant to a particular kind of an alignment operation. Traditionally, the
 ## possible operations are matches, insertions and deletions. 'OperationData'
-## is a paremeterized type because different kinds of operations are defined in
-## terms of different types (e.g. single 'char' for matches, 'string' for
-## insertions and deletions). The module also provides a '%' (toJson) procedure
-## which converts an 'OperationData' object into a JsonNode.
+## is a paremeterized type because different kinds of operations could be
+## defined in terms of different types. In the pileup, all operations are
+## stored as interned 'Allele' codes (see module 'allele'). The module also
+## provides a 'toJson' procedure which converts an 'OperationData' object into
+## a JsonNode. Next to the histogram, running aggregates (coverage with and
+## without filtered events and counts per allele and strand) are updated with
+## every event, so that they can be queried without a walk over the
+## histogram.
 ##
 ## - Author: Filip Sodić <filip.sodic@gmail.com>
 ## - License: The MIT License
@@ -12,56 +16,97 @@
 import json
 import qualityHistogram
 import tables
-import strutils
+import allele
 
 
 type OperationData*[T] = object
   ## The 'OperationData' type. It makes and provides a histogram on operation
   ## values and their qualities
   histogram*: QualityHistogram[T]
+  numEvents: int# all events, including filtered ones
+  numFiltered: int# filtered events, i.e. those with q<0
+  counts: CountTable[T]# unfiltered events per value (incl. strand)
 
 
-proc coverage*(self: OperationData): Natural =
-  coverage(self.histogram)
+proc coverage*(self: OperationData): Natural {.inline.} =
+  ## Number of events, including filtered ones
+  self.numEvents
+
+
+proc callableCoverage*(self: OperationData): Natural {.inline.} =
+  ## Number of events that are not filtered, i.e. the coverage seen by the
+  ## caller after 'clean'
+  self.numEvents - self.numFiltered
 
 
 proc initOperationData*[T](): OperationData[T] {.inline.} =
   ## Creates a new 'OperationData' object. All that it needs is the type for
   ## the operation values.
-  OperationData[T](histogram: initQualityHistogram[T]())
+  OperationData[T](histogram: initQualityHistogram[T](),
+                   counts: initCountTable[T]())
+
+
+iterator callableCounts*[T](self: OperationData[T]): (T, int) =
+  ## Yields each value (incl. strand) with its number of unfiltered events
+  for value, count in self.counts:
+    if count > 0:
+      yield (value, count)
+
+
+proc alleleCount*(self: OperationData[Allele], allele: Allele): int {.inline.} =
+  ## Number of unfiltered events of the given allele on both strands
+  let fw = allele.forward
+  let rv = fw.withStrand(true)
+  result = self.counts.getOrDefault(fw)
+  if rv != fw:
+    result += self.counts.getOrDefault(rv)
+
+
+proc account[T](self: var OperationData, value: T, quality: int,
+                count: int) {.inline.} =
+  # Updates the aggregates with count (possibly negative) events
+  self.numEvents += count
+  if quality < 0:
+    self.numFiltered += count
+  else:
+    self.counts.inc(value, count)
 
 
 proc clean*[T](self: var OperationData[T]): void =
   ## removes filtered entries, i.e those with q<0 that are kept
   ## for debugging in pileup but need to be removed before calling
   self.histogram.clean()
-
+  self.numEvents -= self.numFiltered
+  self.numFiltered = 0
 
 
 proc set*[T](self: var OperationData, bases: T, quality: int,
   count: int): void {.inline.} =
+  var previous = 0
+  if self.histogram.hasKey(bases):
+    previous = self.histogram[bases].getOrDefault(quality)
   self.histogram.set(bases, quality, count)
+  self.account(bases, quality, count - previous)
 
 
 proc add*[T](self: var OperationData, bases: T, quality: int,
-             reverse: bool): void {.inline.} =
+             reverse: bool, weight: Positive = 1): void {.inline.} =
   ## Accounts for one specific operation. Distinct oprations of the same kind
   ## are determined by their value, their quality and their strand. The
   ## histogram, however, does not take the strand into the account. In this
   ## case, distinct operations are determined only by their base and their
-  ## quality. The strand information is counted separately.
-
-  if reverse:
-    self.histogram.add(bases.toLowerAscii(), quality)
-  else:
-    self.histogram.add(bases, quality)
+  ## quality. The strand information is encoded in the allele. 'weight' is
+  ## the number of identical operations to account for.
+  let value = bases.withStrand(reverse)
+  self.histogram.add(value, quality, weight)
+  self.account(value, quality, weight)
 
 
-# If I just make one generic method, it doesn't work so I had to 'pattern
-# match'.
-proc `%`*(self: var OperationData[char]): JsonNode {.inline.} =
-  %self.histogram
+proc toJson*(self: var OperationData[Allele],
+             alleles: AlleleDict): JsonNode {.inline.} =
+  toJson(self.histogram, alleles)
 
 
-proc `%`*(self: var OperationData[string]): JsonNode {.inline.} =
-  %self.histogram
+proc addJson*(buf: var string, self: OperationData[Allele],
+              alleles: AlleleDict) {.inline.} =
+  addJson(buf, self.histogram, alleles)
@@ -17,6 +17,8 @@ import json
 # /
 # project specific
 import operationData
+import qualityHistogram
+import allele
 
 
 type PositionData* = ref object
@@ -25,9 +27,10 @@ type PositionData* = ref object
     refIndex*: int64
     refBase*: char
     chromosome*: string
-    matches*: OperationData[string]# char would do, but string to make it consistent
-    deletions*: OperationData[string]
-    insertions*: OperationData[string]
+    matches*: OperationData[Allele]
+    deletions*: OperationData[Allele]
+    insertions*: OperationData[Allele]
+    alleles*: AlleleDict# shared by all positions of a chromosome
 
 
 proc coverage*(pd: PositionData): Natural =
@@ -35,7 +38,8 @@ proc coverage*(pd: PositionData): Natural =
 
 
 proc newPositionData*(refIndex: int64, refBase: char,
-                      chromosome: string) : PositionData {.inline.} =
+                      chromosome: string,
+                      alleles: AlleleDict) : PositionData {.inline.} =
   ## Constructs a new PositionData object keeping the data for
   ## the given position on the reference.
   ## The position (wrt. the reference) is provided by the first argument.
@@ -43,32 +47,34 @@ proc newPositionData*(refIndex: int64, refBase: char,
   ## position.
   ## The third argument must specify the name of the chromosome the
   ## reference sequence belongs to.
+  ## The fourth argument is the allele dictionary of that chromosome.
   PositionData(
     refIndex: refIndex,
     refBase: refBase,
     chromosome: chromosome,
-    matches: initOperationData[string](),
-    insertions: initOperationData[string](),
-    deletions: initOperationData[string]()
+    matches: initOperationData[Allele](),
+    insertions: initOperationData[Allele](),
+    deletions: initOperationData[Allele](),
+    alleles: alleles
   )
 
 # FIXME there surely must be a Nimsy way of templating the following
 # three function
-proc setMatch*(self: var PositionData, base: string, quality: int,
+proc setMatch*(self: var PositionData, base: Allele, quality: int,
                count: int) {.inline.} =
   self.matches.set(base, quality, count)
 
-proc setInsertion*(self: var PositionData, base: string, quality: int,
+proc setInsertion*(self: var PositionData, base: Allele, quality: int,
                count: int) {.inline.} =
   self.insertions.set(base, quality, count)
 
-proc setDeletion*(self: var PositionData, base: string, quality: int,
+proc setDeletion*(self: var PositionData, base: Allele, quality: int,
                count: int) {.inline.} =
   self.deletions.set(base, quality, count)
 
 
-proc addMatch*(self: var PositionData, base: string, quality: int,
-               reverse: bool) {.inline.} =
+proc addMatch*(self: var PositionData, base: Allele, quality: int,
+               reverse: bool, weight: Positive = 1) {.inline.} =
   ## Accounts for a match on the position represented by this object.  In the
   ## most common basic biological use case, a match should either be a true
   ## match (same base as the reference) or a mismatch (base different from the
@@ -77,28 +83,28 @@ proc addMatch*(self: var PositionData, base: string, quality: int,
   ## deletion) can also be saved as matches marked with a special character.
   ## This is something decided outside of this module. The procedure only
   ## ensures the value is accounted for and does not check the data's
-  ## validity.
-  self.matches.add(base, quality, reverse)
+  ## validity. 'weight' is the number of identical matches to account for.
+  self.matches.add(base, quality, reverse, weight)
 
 
-proc addInsertion*(self: var PositionData, bases: string, quality: int,
-                   reverse: bool) {.inline.} =
+proc addInsertion*(self: var PositionData, bases: Allele, quality: int,
+                   reverse: bool, weight: Positive = 1) {.inline.} =
   ## Accounts for an insertion on the position represented by this object.
   ## In the most common biological use case, an insertion consists of one or
   ## more bases not present on the reference. It is defined by its value (one
   ## or more bases), its quality and its strand. The procedure only ensures the
   ## value is accounted for and does not check the data's validity.
-  self.insertions.add(bases, quality, reverse)
+  self.insertions.add(bases, quality, reverse, weight)
 
 
-proc addDeletion*(self: var PositionData, bases: string, quality: int,
-                  reverse: bool) {.inline.} =
+proc addDeletion*(self: var PositionData, bases: Allele, quality: int,
+                  reverse: bool, weight: Positive = 1) {.inline.} =
   ## Accounts for a deletion the position represented by this object.  In the
   ## most common biological use case, a deletion  consists of one or more
   ## missing bases (wrt. the reference). It is defined by its value (one or
   ## more bases), its quality and its strand. The procedure only ensures the
   ## value is accounted for and does not check the data's validity.
-  self.deletions.add(bases, quality, reverse)
+  self.deletions.add(bases, quality, reverse, weight)
 
 
 proc `%`*(self: PositionData): JsonNode {.inline.} =
@@ -106,7 +112,79 @@ proc `%`*(self: PositionData): JsonNode {.inline.} =
     "CHROM": %self.chromosome,
     "POS": %self.refIndex,
     "REF": %($self.refBase),
-    "M": %self.matches,
-    "I": %self.insertions,
-    "D": %self.deletions
+    "M": toJson(self.matches, self.alleles),
+    "I": toJson(self.insertions, self.alleles),
+    "D": toJson(self.deletions, self.alleles)
   }
+
+
+proc addJson*(buf: var string, self: PositionData) =
+  ## Appends the compact JSON of `%` to buf in one pass, i.e. byte for byte
+  ## what `$(%self)` produces, without building a JsonNode
+  buf.add("{\"CHROM\":")
+  escapeJson(self.chromosome, buf)
+  buf.add(",\"POS\":")
+  buf.addNumber(int(self.refIndex))
+  buf.add(",\"REF\":")
+  escapeJson($self.refBase, buf)
+  buf.add(",\"M\":")
+  buf.addJson(self.matches, self.alleles)
+  buf.add(",\"I\":")
+  buf.addJson(self.insertions, self.alleles)
+  buf.add(",\"D\":")
+  buf.addJson(self.deletions, self.alleles)
+  buf.add('}')
+
+
+when isMainModule:
+  import ../../../utils
+
+  testblock "addJson matches %":
+    let alleles = newAlleleDict()
+    var pd = newPositionData(3, 'G', "gi|1|\"x\"", alleles)
+    # equal counts for several qualities test the tie order
+    for q in [75, 43, 44, 43, 12, 90]:
+      pd.addMatch(alleles.baseAllele('G'), q, false)
+    pd.addMatch(alleles.baseAllele('C'), 76, true, 3)
+    pd.addMatch(BLANK_ALLELE, -1, false)
+    pd.addDeletion(alleles.intern("AG"), 41, false, 2)
+    pd.addInsertion(alleles.parse("-"), 39, true)
+    var buf = ""
+    buf.addJson(pd)
+    doAssert buf == $(%pd), buf & " vs. " & $(%pd)
+    # appends
+    buf.addJson(pd)
+    doAssert buf == $(%pd) & $(%pd)
+
+  testblock "empty position":
+    let pd = newPositionData(1, 'A', "ref", newAlleleDict())
+    var buf = ""
+    buf.addJson(pd)
+    doAssert buf == """{"CHROM":"ref","POS":1,"REF":"A","M":{},"I":{},"D":{}}"""
+
+  testblock "aggregates match histogram":
+    let alleles = newAlleleDict()
+    var pd = newPositionData(1, 'A', "ref", alleles)
+    let a = alleles.baseAllele('A')
+    let c = alleles.baseAllele('C')
+    pd.addMatch(a, 30, false, 4)
+    pd.addMatch(a, 20, true)
+    pd.addMatch(c, 30, true, 2)
+    pd.addMatch(c, -1, false)
+    pd.addMatch(BLANK_ALLELE, -1, false, 3)
+    pd.setDeletion(alleles.intern("AG"), 41, 2)
+    pd.setDeletion(alleles.intern("AG"), 41, 5)# overwrites
+    doAssert pd.matches.coverage == coverage(pd.matches.histogram)
+    doAssert pd.matches.coverage == 11
+    doAssert pd.matches.callableCoverage == 7
+    doAssert pd.matches.alleleCount(a) == 5
+    doAssert pd.matches.alleleCount(c) == 2
+    doAssert pd.matches.alleleCount(c.withStrand(true)) == 2
+    doAssert pd.matches.alleleCount(BLANK_ALLELE) == 0
+    doAssert pd.deletions.callableCoverage == 5
+    doAssert coverage(pd) == 16
+    pd.matches.clean()
+    doAssert pd.matches.coverage == coverage(pd.matches.histogram)
+    doAssert pd.matches.callableCoverage == 7
+
+  echo "OK: all tests passed"
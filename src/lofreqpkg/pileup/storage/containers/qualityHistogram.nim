@@ -13,12 +13,18 @@
 import tables
 import json
 import sequtils
+import algorithm
+import ../../../perfstats
+import allele
 
 ## Defines a 'QualityHistogram' type with a type parameter specifying the type
 ## of the event value.
 type QualityHistogram*[T] = Table[T, CountTable[int]]
 
 
+var countsBuffer {.threadvar.}: seq[(int, int)]# reused by addJson
+
+
 func initQualityHistogram*[T](): QualityHistogram[T] {.inline.} =
   ## Constructs a new QualityHistogram object. The type parameter T sets the
   ## type of event values.
@@ -64,10 +70,12 @@ proc set*[T](self: var QualityHistogram[T], value: T,
 
 
 proc add*[T](self: var QualityHistogram[T], value: T,
-             quality: int): void {.inline.} =
-  ## Accounts for a event with the given value and the given quality.
-  discard self.hasKeyOrPut(value, initCountTable[int]())
-  self[value].inc(quality)
+             quality: int, weight: Positive = 1): void {.inline.} =
+  ## Accounts for a event with the given value and the given quality
+  ## ('weight' times, e.g. for collapsed identical reads).
+  if not self.hasKeyOrPut(value, initCountTable[int]()):
+    count(cHistEntries)
+  self[value].inc(quality, weight)
 
 
 proc `%`*[T](table: var QualityHistogram[T]): JsonNode {.inline.} =
@@ -80,6 +88,17 @@ proc `%`*[T](table: var QualityHistogram[T]): JsonNode {.inline.} =
   result.fields = buff
 
 
+proc toJson*(table: var QualityHistogram[Allele],
+             alleles: AlleleDict): JsonNode {.inline.} =
+  ## Like `%`, but converting allele codes to strings first
+  result = newJObject()
+
+  var buff = initOrderedTable[string, JsonNode]()
+  for pair in table.pairs:
+    buff[alleles.toString(pair[0])] = %pair[1]
+  result.fields = buff
+
+
 proc `%`*(table: CountTable[int]): JsonNode {.inline.} =
   result = newJObject()
 
@@ -92,3 +111,58 @@ proc `%`*(table: CountTable[int]): JsonNode {.inline.} =
     buff[$pair[0]] = %pair[1]
   result.fields = buff
 
+
+proc addNumber*(buf: var string, x: int) =
+  ## Appends the decimal representation of x without a temporary string
+  var digits: array[20, char]
+  var n = abs(x)
+  var i = 0
+  while true:
+    digits[i] = char(ord('0') + n mod 10)
+    inc i
+    n = n div 10
+    if n == 0:
+      break
+  if x < 0:
+    buf.add('-')
+  while i > 0:
+    dec i
+    buf.add(digits[i])
+
+
+proc cmpCountDesc(a, b: (int, int)): int =
+  cmp(b[1], a[1])
+
+
+proc addJson*(buf: var string, table: CountTable[int]) =
+  ## Appends the JSON object of `%` to buf, without building a JsonNode or
+  ## copying the table. Entries are in the same order as with `%`: by
+  ## count, descending, and in table order for equal counts (sort is stable)
+  countsBuffer.setLen(0)
+  for quality, count in table.pairs:
+    countsBuffer.add((quality, count))
+  countsBuffer.sort(cmpCountDesc)
+  buf.add('{')
+  for i, entry in countsBuffer:
+    if i > 0:
+      buf.add(',')
+    buf.add('"')
+    buf.addNumber(entry[0])# quality
+    buf.add("\":")
+    buf.addNumber(entry[1])# count
+  buf.add('}')
+
+
+proc addJson*(buf: var string, table: QualityHistogram[Allele],
+              alleles: AlleleDict) =
+  ## Appends the JSON object of `toJson` to buf
+  buf.add('{')
+  var first = true
+  for event, counts in table.pairs:
+    if not first:
+      buf.add(',')
+    first = false
+    escapeJson(alleles.toString(event), buf)
+    buf.add(':')
+    buf.addJson(counts)
+  buf.add('}')
@@ -12,12 +12,15 @@
 # standard library
 import math
 import strutils
+import intsets
 #import strformat
 # project specific
 import deques
 import containers/positionData
+import containers/allele
 #import ../pipetools
 import ../../region
+import ../../perfstats
 
 
 ## Defines a type of the expected submit procedure. It should consume a
@@ -39,24 +42,29 @@ type SlidingDeque* = ref object
   initialSize: int # estimated maximum size of the double ended queue
   beginning: int64
   chromosome: string
+  alleles: AlleleDict# allele dictionary for chromosome
   # Having the chromosome as a a field on the storage object is certainly less
   # than ideal. I will probably change this to be injected later.
   region: Region# FIXME this is a stupid hack to avoid submission of positions outside of region
   mincov: Natural# FIXME feels wrong here
   maxcov: Natural# FIXME feels wrong here
+  onlySites: bool# only keep positions in sites (see restrictTo)
+  sites: IntSet
 
 const DEFAULT_INITIAL_SIZE = 200# FIXME autoset from readlength?
 
 
 proc posWithinRegion(pos: PositionData, reg: Region): bool =
-  if pos.refIndex < reg.s or pos.refIndex > reg.e:
+  # refIndex is 1-based, region zero-based half-open
+  if pos.refIndex <= reg.s or pos.refIndex > reg.e:
     return false
   else:
     return true
 
 
 proc newSlidingDeque*(chromosome: string, region: Region, submit: DataToVoid,
-  mincov: Natural = 0, maxcov: Natural = high(int), initialSize: int = DEFAULT_INITIAL_SIZE): SlidingDeque {.inline.} =
+  mincov: Natural = 0, maxcov: Natural = high(int), initialSize: int = DEFAULT_INITIAL_SIZE,
+  alleles: AlleleDict = newAlleleDict()): SlidingDeque {.inline.} =
   ## Constructs a new 'SlidingDeque' object.
   ## The paramater 'submit' is a procedure expected to perform all furhter
   ## processing. This procedure must be a consumer (not returning anything) of
@@ -64,7 +72,8 @@ proc newSlidingDeque*(chromosome: string, region: Region, submit: DataToVoid,
   ## 'DataToType', it matches against the second constructor which performs the
   ## required wrapping.
   ## There is an optional initial size argument for the queue for optimization
-  ## purposes.
+  ## purposes. Alleles of all positions are interned in 'alleles', which can
+  ## be shared with other storages of the same chromosome.
   assert mincov <= maxcov
   let adjustedSize = nextPowerOfTwo(initialSize)
   SlidingDeque(
@@ -73,6 +82,7 @@ proc newSlidingDeque*(chromosome: string, region: Region, submit: DataToVoid,
     initialSize: adjustedSize,
     beginning: 0,
     chromosome: chromosome,
+    alleles: alleles,
     region: region,
     mincov: mincov,
     maxcov: maxcov
@@ -91,14 +101,37 @@ proc newSlidingDeque*(chromosome: string, region: Region, submit: DataToVoid,
 #   newSlidingDeque(initialSize, chromosome, submit.done())
 
 
+proc restrictTo*(self: SlidingDeque, positions: openArray[int64]) =
+  ## Only keeps data for the given (zero-based) positions, e.g. known sites.
+  ## Events at all other positions are dropped without creating a
+  ## 'PositionData' for them (the deque holds nil there).
+  self.onlySites = true
+  self.sites = initIntSet()
+  for pos in positions:
+    self.sites.incl(int(pos))
+
+
+proc submitIfPassing(self: SlidingDeque, pd: PositionData): void {.inline.} =
+  # Submits pd if it's within region and passes coverage filters
+  if pd.isNil:# not a site
+    return
+  if not posWithinRegion(pd, self.region):
+    count(cPositionsOutsideRegion)
+    return
+  let cov = coverage(pd)
+  if cov >= self.mincov and cov <= self.maxcov:
+    count(cPositionsSubmitted)
+    self.submit(pd)
+  else:
+    count(cPositionsCovFiltered)
+
+
 proc submitDeq(self: SlidingDeque,
                deq: var Deque[PositionData]): void {.inline.} =
   # FIXME: implement asyncronous procedure (probably outside of this module)
   # Submits the current deque for further processing
   for pd in deq:
-    let cov = coverage(pd)
-    if posWithinRegion(pd, self.region) and cov >= self.mincov and cov <= self.maxcov:# see also below
-      self.submit(pd)
+    self.submitIfPassing(pd)
 
 
 proc resetDeq(self: SlidingDeque, beginning: int64): void {.inline.} =
@@ -141,34 +174,54 @@ proc ensureStorage(self: SlidingDeque, position: int64,
   sanityCheck(self.beginning, length, position)
 
   if position == (self.beginning + length):
+    if self.onlySites and not self.sites.contains(int(position)):
+      self.deq.addLast(nil)
+      count(cPositionsNotSites)
+      return
     self.deq.addLast(newPositionData(position+1, 
                      refBase.toUpperAscii(),# FIXME support for masking lowercase pos?
-                     self.chromosome))
+                     self.chromosome, self.alleles))
+    count(cPositionsCreated)
+    notePeakDeqLen(self.deq.len)
 
 
 proc recordMatch*(self: SlidingDeque, position: int64,
-                  base: string, quality: int, reversed: bool,
-                  refBase: char): void {.inline.} =
-  ## Records match event information on for a given position.
+                  base: Allele, quality: int, reversed: bool,
+                  refBase: char, weight: Positive = 1): void {.inline.} =
+  ## Records match event information on for a given position. 'weight' is the
+  ## number of identical events (e.g. from collapsed reads).
   self.ensureStorage(position, refBase)
-  self.deq[position - self.beginning].addMatch(base, quality, reversed)
+  if self.deq[position - self.beginning].isNil:
+    return
+  self.deq[position - self.beginning].addMatch(base, quality, reversed, weight)
 
 
-proc recordDeletion*(self: SlidingDeque, position: int64, bases: string,
-                     quality: int, reversed: bool): void {.inline.} =
+proc recordDeletion*(self: SlidingDeque, position: int64, bases: Allele,
+                     quality: int, reversed: bool,
+                     weight: Positive = 1): void {.inline.} =
   ## Records deletion event information for a given position. If using this
   ## storage, all deletions should be reported on the base to their left. Thus,
   ## this procedure does not allow the deque to be extended and assumes the
   ## needed slot is already available.
   sanityCheckNoExtend(self.beginning, self.deq.len, position)
-  self.deq[position - self.beginning].addDeletion(bases, quality, reversed)
+  if self.deq[position - self.beginning].isNil:
+    return
+  self.deq[position - self.beginning].addDeletion(bases, quality, reversed, weight)
 
 
-proc recordInsertion*(self: SlidingDeque, position: int64, bases: string,
-                      quality: int, reversed: bool): void {.inline.} =
+proc recordInsertion*(self: SlidingDeque, position: int64, bases: Allele,
+                      quality: int, reversed: bool,
+                      weight: Positive = 1): void {.inline.} =
   ## Records insertion event infromation for a given position.
   sanityCheckNoExtend(self.beginning, self.deq.len, position)
-  self.deq[position - self.beginning].addInsertion(bases, quality, reversed)
+  if self.deq[position - self.beginning].isNil:
+    return
+  self.deq[position - self.beginning].addInsertion(bases, quality, reversed, weight)
+
+
+proc alleles*(self: SlidingDeque): AlleleDict {.inline.} =
+  ## The allele dictionary used for interning events of this storage
+  self.alleles
 
 
 proc flushAll*(self: SlidingDeque): int {.inline.} =
@@ -198,9 +251,7 @@ proc flushUpTo*(self: SlidingDeque, position: int64): int {.inline.} =
 
   while self.beginning < position:
     let pd = self.deq.popFirst()
-    let cov = coverage(pd)
-    if posWithinRegion(pd, self.region) and cov >= self.mincov and cov <= self.maxcov:# see also above
-      self.submit(pd)
+    self.submitIfPassing(pd)
     self.beginning.inc
     result.inc
 
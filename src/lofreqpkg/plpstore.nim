@@ -0,0 +1,80 @@
+## LoFreq: indexed on-disk pileup store
+##
+## The store keeps one pileup position per line (chromosome, position and the
+## position's JSON pileup) in a BGZF compressed file with a CSI coordinate
+## index. It's written during 'call' and allows 'recall' to re-run the
+## variant calling on any region, reading only the needed blocks, instead of
+## redoing the pileup from the BAM file. The chromosomes seen are listed in a
+## small sidecar file, so that the full store can be recalled without regions.
+##
+## Positions have to be written sorted by chromosome and position.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+# standard
+import json
+import strutils
+# third party
+import hts
+# project specific
+import region
+import pileup/storage/containers/positionData
+
+
+const CHROMS_EXT = ".chroms"
+
+
+type PlpStoreWriter* = ref object
+  bgzi: BGZI
+  path: string
+  chroms: seq[(string, int64)]# name and last position seen
+
+
+proc openPlpStoreWriter*(path: string): PlpStoreWriter =
+  ## Creates a new store. Sequence name in column 1, (one-based) position in
+  ## column 2
+  result = PlpStoreWriter(path: path)
+  result.bgzi = wopen_bgzi(path, seq_col=1, start_col=2, end_col=2,
+                           zero_based=false)
+
+
+proc add*(self: PlpStoreWriter, plp: PositionData) =
+  ## Adds one position. Must be called before calling, which removes filtered
+  ## qualities from plp
+  var line = plp.chromosome & "\t" & $plp.refIndex & "\t"
+  line.addJson(plp)
+  if len(self.chroms) == 0 or self.chroms[^1][0] != plp.chromosome:
+    self.chroms.add((plp.chromosome, plp.refIndex))
+  else:
+    self.chroms[^1][1] = plp.refIndex
+  if self.bgzi.write_interval(line, plp.chromosome, int(plp.refIndex-1),
+                              int(plp.refIndex)) < 0:
+    raise newException(IOError, "Could not write to pileup store " & self.path)
+
+
+proc close*(self: PlpStoreWriter) =
+  ## Closes the store and writes the index and the chromosome list
+  if self.bgzi.close() != 0:
+    raise newException(IOError, "Could not close pileup store " & self.path)
+  var fh = open(self.path & CHROMS_EXT, fmWrite)
+  for (chrom, lastPos) in self.chroms:
+    fh.writeLine(chrom & "\t" & $lastPos)
+  fh.close()
+
+
+iterator storedRegions*(path: string): Region =
+  ## All chromosomes in the store as regions (up to the last stored position)
+  for line in lines(path & CHROMS_EXT):
+    let fields = line.split('\t')
+    yield Region(sq: fields[0], s: 0, e: parseInt(fields[1]))
+
+
+iterator queryPlpStore*(path: string, reg: Region): string =
+  ## Yields the JSON pileup strings of all positions in region
+  let bgzi = ropen_bgzi(path)
+  for line in bgzi.query(reg.sq, reg.s, reg.e):
+    # only the third column, i.e. the json
+    let jsonStart = line.find('\t', line.find('\t') + 1) + 1
+    yield line[jsonStart..^1]
+  discard bgzi.close()
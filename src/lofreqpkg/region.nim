@@ -78,5 +78,14 @@ iterator getBamRegions*(bam: Bam): Region =
     yield reg
 
 
+iterator chunks*(reg: Region, chunkSize: Positive): Region =
+  ## Splits region into consecutive chunks of (at most) chunkSize
+  var chunk = reg
+  while chunk.s < reg.e:
+    chunk.e = min(chunk.s + chunkSize, reg.e)
+    yield chunk
+    chunk.s = chunk.e
+
+
 proc `$`*(r: Region): string =
   fmt"{r.sq}:{r.s+1}-{r.e}"
@@ -0,0 +1,328 @@
+## LoFreq: server mode for many queries on small regions. Listens on a local
+## Unix socket and keeps BAM files (with index) and the reference open
+## between requests (see api), so that a query only costs the actual pileup
+## and calling.
+##
+## The protocol is line based. A request is one line of space separated
+## key=value pairs, e.g.
+##
+##   bam=sample.bam region=chr1:1000-1100,chr2:50-60 format=vcf minAF=0.01
+##
+## - bam: one of the BAM files the server was started with (optional if
+##   there's only one)
+## - region: regions in the form of sq:s-e, separated by comma
+## - format: "vcf" (records without header; default) or "json" (pileup)
+## - minVarQual, minAF, sig, bonf, minCov, maxCov, minBQ, noMQ: as for call.
+##   Parameters not given are the defaults, i.e. nothing carries over from
+##   previous requests.
+##
+## The result lines are followed by a line "#OK <number of lines>" or, if the
+## request failed, "#ERROR <message>". A connection can send any number of
+## requests.
+##
+## Connections are served by a fixed pool of 'workers' processes, i.e. at
+## most that many requests are computed concurrently. Each worker opens its
+## own handles after the fork (handles aren't thread-safe and the htslib
+## thread pool doesn't survive a fork) and serves one connection at a time.
+## Up to maxPending further connections wait in the queue, others are
+## refused. A connection idle for more than readTimeout seconds, or not
+## taking results for that long, is closed, so that clients can't block a
+## worker. Workers that die are restarted. On SIGINT or SIGTERM the workers
+## are stopped and the socket is removed.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+
+# standard
+import net
+import os
+import posix
+import strutils
+import tables
+import times
+import logging
+# project specific
+import api
+import packedref
+import htspool
+import pileup/qualBins
+import pileup/storage/containers/positionData
+
+
+const
+  SEND_BUF_SIZE = 65536# results are sent in chunks of (about) this size
+  DEFAULT_WORKERS* = 4
+  DEFAULT_READ_TIMEOUT* = 60# seconds
+
+var logger = newConsoleLogger(fmtStr = verboseFmtStr, useStderr = true)
+
+var socketPath = ""# removed on exit (by the parent only)
+var workerPids: seq[Pid]
+
+
+type Request = object
+  bam: string
+  regions: string
+  json: bool
+  plpParams: PileupParams
+  callParams: CallParams
+
+
+proc parseNatural(value: string): Natural =
+  let i = parseInt(value)
+  if i < 0:
+    raise newException(ValueError, "Expected non-negative number, got " & value)
+  Natural(i)
+
+
+proc parseRequest(line: string, bams: Table[string, LoFreq]): Request =
+  ## Raises ValueError for invalid requests
+  result.plpParams = defaultPileupParams()
+  result.callParams = defaultCallParams()
+  if len(bams) == 1:
+    for bam in bams.keys:
+      result.bam = bam
+  for field in line.splitWhitespace():
+    let kv = field.split('=', 1)
+    if len(kv) != 2:
+      raise newException(ValueError, "Expected key=value, got " & field)
+    let (key, value) = (kv[0], kv[1])
+    case key
+    of "bam": result.bam = value
+    of "region": result.regions = value
+    of "format":
+      if value notin ["vcf", "json"]:
+        raise newException(ValueError, "Unknown format " & value)
+      result.json = value == "json"
+    of "minVarQual": result.callParams.minVarQual = parseNatural(value)
+    of "minAF": result.callParams.minAF = parseFloat(value)
+    of "sig": result.callParams.sig = parseFloat(value)
+    of "bonf": result.callParams.setBonf(value)
+    of "minCov": result.plpParams.minCov = parseNatural(value)
+    of "maxCov": result.plpParams.maxCov = parseNatural(value)
+    of "minBQ": result.plpParams.minBQ = parseNatural(value)
+    of "noMQ": result.plpParams.useMQ = not parseBool(value)
+    of "qualBins": result.plpParams.qualBins = parseQualBins(value)
+    else:
+      raise newException(ValueError, "Unknown key " & key)
+  if not bams.hasKey(result.bam):
+    raise newException(ValueError, "Unknown BAM file " & result.bam)
+  if len(result.regions) == 0:
+    raise newException(ValueError, "No region given")
+
+
+proc parseRegions(regionsStr: string): seq[Region] =
+  ## Like region.parseRegionsStr, but raising ValueError instead of failing
+  for regStr in regionsStr.split(','):
+    let colon = regStr.rfind(':')
+    let dash = regStr.rfind('-')
+    if colon < 1 or dash < colon:
+      raise newException(ValueError, "Invalid region " & regStr)
+    let s = parseInt(regStr[colon+1..<dash])
+    let e = parseInt(regStr[dash+1..^1])
+    if s < 1 or e < s:
+      raise newException(ValueError, "Invalid region " & regStr)
+    result.add(Region(sq: regStr[0..<colon], s: s-1, e: e))
+
+
+proc flush(client: Socket, buf: var string) =
+  client.send(buf)
+  buf.setLen(0)
+
+
+proc handleRequest(client: Socket, line: string, bams: Table[string, LoFreq],
+                   buf: var string) =
+  let time = epochTime()
+  var n = 0
+  try:
+    let req = parseRequest(line, bams)
+    let regions = parseRegions(req.regions)
+    let lf = bams[req.bam]
+    for reg in regions:
+      if not lf.hasChrom(reg.sq):
+        raise newException(ValueError, "Unknown chromosome " & reg.sq)
+    lf.plpParams = req.plpParams
+    lf.callParams = req.callParams
+    if req.json:
+      for reg in regions:
+        for pd in lf.positions(reg):
+          buf.addJson(pd)
+          buf.add('\n')
+          inc n
+          if len(buf) >= SEND_BUF_SIZE:
+            client.flush(buf)
+    else:
+      # all regions at once, so that a dynamic Bonferroni factor covers them
+      for v in lf.variants(regions):
+        buf.add($v)
+        buf.add('\n')
+        inc n
+        if len(buf) >= SEND_BUF_SIZE:
+          client.flush(buf)
+    buf.add("#OK " & $n & "\n")
+  except OSError:
+    raise# connection lost, see worker
+  except CatchableError:
+    buf.add("#ERROR " & getCurrentExceptionMsg().replace('\n', ' ') & "\n")
+  client.flush(buf)
+  logger.log(lvlInfo, "Served '" & line & "' (" & $n & " lines) in " &
+             formatFloat(epochTime() - time, ffDecimal, 3) & "s")
+
+
+proc stopServer() {.noconv.} =
+  ## Stops and reaps the workers and removes the socket (in the parent)
+  for pid in workerPids:
+    discard kill(pid, SIGTERM)
+  for pid in workerPids:
+    var status: cint
+    discard waitpid(pid, status, 0)
+  if len(socketPath) > 0:
+    removeFile(socketPath)
+  quit(0)
+
+
+proc onSigTerm(sig: cint) {.noconv.} =
+  stopServer()
+
+
+proc openHandles(faFname: string, bamFnames: string): Table[string, LoFreq] =
+  ## Quits if any file can't be opened
+  result = initTable[string, LoFreq]()
+  try:
+    let fa = openSharedReference(faFname)
+    for bamFname in bamFnames.split(','):
+      result[bamFname] = openLoFreq(bamFname, fa, faFname)
+  except IOError:
+    quit(getCurrentExceptionMsg())
+
+
+proc setSendTimeout(client: Socket, seconds: int) =
+  var tv = Timeval(tv_sec: posix.Time(seconds), tv_usec: 0)
+  if setsockopt(client.getFd(), SOL_SOCKET, SO_SNDTIMEO, addr tv,
+                SockLen(sizeof(tv))) != 0:
+    logger.log(lvlWarn, "Could not set send timeout")
+
+
+proc worker(id: int, server: Socket, faFname: string, bamFnames: string,
+            readTimeout: int, htsThreads: int) =
+  ## Serves connections until killed
+  initHtsPool(htsThreads)
+  let bams = openHandles(faFname, bamFnames)
+  var buf = newStringOfCap(SEND_BUF_SIZE)
+  while true:
+    var client: Socket
+    server.accept(client)
+    client.setSendTimeout(readTimeout)
+    try:
+      while true:
+        var line: string
+        client.readLine(line, timeout = readTimeout * 1000)
+        if len(line) == 0:# closed by client
+          break
+        client.handleRequest(line, bams, buf)
+    except TimeoutError:
+      logger.log(lvlInfo, "Worker " & $id & ": closing idle connection")
+    except OSError:
+      logger.log(lvlWarn, "Worker " & $id & ": connection error: " &
+                 getCurrentExceptionMsg())
+    buf.setLen(0)
+    client.close()
+
+
+proc spawnWorker(id: int, server: Socket, faFname: string, bamFnames: string,
+                 readTimeout: int, htsThreads: int): Pid =
+  result = fork()
+  if result < 0:
+    quit("Could not start worker: " & $strerror(errno))
+  if result == 0:
+    socketPath = ""# the parent cleans up
+    workerPids.setLen(0)
+    discard signal(SIGTERM, SIG_DFL)
+    worker(id, server, faFname, bamFnames, readTimeout, htsThreads)
+    quit(0)
+
+
+proc serve*(faFname: string, bamFnames: string, socket: string,
+            workers = DEFAULT_WORKERS, maxPending = 16,
+            readTimeout = DEFAULT_READ_TIMEOUT,
+            htsThreads = AUTO_HTS_THREADS, logLevel = 1) =
+  ## Serves calls and pileups for the given (comma separated, indexed) BAM
+  ## files on a Unix socket (see module doc for the protocol)
+  if logLevel >= 2:
+    setLogFilter(lvlInfo)
+  else:
+    setLogFilter(lvlNotice)
+  if workers < 1 or readTimeout < 1:
+    quit("Need at least one worker and a read timeout of at least one second")
+
+  # fail early, i.e. not in every worker
+  for lf in openHandles(faFname, bamFnames).values:
+    lf.close()
+
+  if fileExists(socket):
+    removeFile(socket)# stale socket of a previous run
+  let server = newSocket(AF_UNIX, SOCK_STREAM, IPPROTO_IP)
+  server.bindUnix(socket)
+  server.listen(Natural(maxPending))
+  socketPath = socket
+  setControlCHook(stopServer)
+  discard signal(SIGTERM, onSigTerm)
+
+  for id in 0..<workers:
+    workerPids.add(spawnWorker(id, server, faFname, bamFnames, readTimeout,
+                               htsThreads))
+  logger.log(lvlNotice, "Listening on " & socket & " with " & $workers & " workers")
+
+  while true:
+    var status: cint
+    let pid = waitpid(-1, status, 0)
+    if pid < 0:
+      if errno == EINTR:
+        continue
+      quit("Waiting for workers failed: " & $strerror(errno))
+    let id = workerPids.find(pid)
+    if id < 0:
+      continue
+    logger.log(lvlWarn, "Worker " & $id & " exited (status " & $status & "), restarting")
+    os.sleep(1000)# don't spin if workers die right away
+    workerPids[id] = spawnWorker(id, server, faFname, bamFnames, readTimeout,
+                                 htsThreads)
+
+
+when isMainModule:
+  import utils
+
+  testblock "parseRegions":
+    let regs = parseRegions("chr1:1-10,chr:2:5-6")
+    doAssert regs[0] == Region(sq: "chr1", s: 0, e: 10)
+    doAssert regs[1] == Region(sq: "chr:2", s: 4, e: 6)
+    for invalid in ["chr1", "chr1:10-5", "chr1:0-5", "chr1:a-5"]:
+      var failed = false
+      try:
+        discard parseRegions(invalid)
+      except ValueError:
+        failed = true
+      doAssert failed, invalid
+
+  testblock "parseRequest":
+    var bams = initTable[string, LoFreq]()
+    bams["a.bam"] = nil
+    let req = parseRequest("region=chr1:1-10 format=json minAF=0.1 noMQ=true bonf=5", bams)
+    doAssert req.bam == "a.bam" and req.json
+    doAssert req.callParams.minAF == 0.1 and req.callParams.bonf == 5.0
+    doAssert not req.plpParams.useMQ
+    doAssert req.callParams.minVarQual == defaultCallParams().minVarQual
+    bams["b.bam"] = nil
+    for invalid in ["region=chr1:1-10", "bam=c.bam region=chr1:1-10",
+                    "bam=a.bam", "bam=a.bam region=chr1:1-10 foo=1",
+                    "bam=a.bam region=chr1:1-10 minAF=x", "bam=a.bam region",
+                    "bam=a.bam region=chr1:1-10 minCov=-1"]:
+      var failed = false
+      try:
+        discard parseRequest(invalid, bams)
+      except ValueError:
+        failed = true
+      doAssert failed, invalid
+
+  echo "OK: all tests passed"
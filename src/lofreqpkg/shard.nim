@@ -0,0 +1,250 @@
+## LoFreq: splitting work into shards for several processes or nodes
+##
+## 'shard' splits the reference (or given regions) into N work units of
+## roughly equal numbers of reads, according to the mapped read counts in the
+## BAM index (reads are assumed to be spread uniformly within a chromosome).
+## Shards are consecutive in coordinate order and never overlap. They are
+## written to a manifest, which 'call --shardManifest --shardId' reads.
+## 'merge' concatenates the per-shard outputs (VCF or pileup JSON) again in
+## coordinate order, keeping only the first VCF header. Since shards don't
+## overlap, neither do their outputs; merge checks that as a sanity check
+## (e.g. against outputs of a different manifest) instead of deduplicating.
+##
+## Manifest format (tab separated): a first line with magic string, number
+## of shards and BAM file, followed by one line per region: shard id,
+## chromosome, start and end (zero-based, half-open as in BED).
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+# standard
+import algorithm
+import json
+import logging
+import math
+import sequtils
+import strutils
+import tables
+# third party
+import hts
+# project specific
+import region
+import idxstats
+import htspool
+
+
+const MANIFEST_MAGIC = "#lofreq-shards"
+
+
+type ShardRegion* = object
+  shard*: int
+  reg*: Region
+
+
+var logger = newConsoleLogger(fmtStr = verboseFmtStr, useStderr = true)
+
+
+proc makeShards*(regs: seq[Region], weights: seq[float],
+                 numShards: Positive): seq[ShardRegion] =
+  ## Assigns regions to numShards shards of about equal total weight, keeping
+  ## coordinate order and splitting regions where needed. Weight is assumed to
+  ## be spread uniformly within each region. Regions without weight are
+  ## dropped.
+  doAssert len(regs) == len(weights)
+  let total = sum(weights)
+  if total <= 0.0:
+    return
+  let target = total / float(numShards)
+  var shard = 0
+  var filled = 0.0# weight in current shard
+  for i, reg in regs:
+    if weights[i] <= 0.0:
+      continue
+    let density = weights[i] / float(reg.e - reg.s)
+    var s = reg.s
+    while s < reg.e:
+      var e = reg.e
+      let need = target - filled
+      if shard < numShards-1 and float(reg.e - s) * density > need:
+        # split: end where the shard is full (at least one base though)
+        e = min(reg.e, max(s + 1, s + int(need / density + 0.5)))
+      result.add(ShardRegion(shard: shard, reg: Region(sq: reg.sq, s: s, e: e)))
+      filled += float(e - s) * density
+      if shard < numShards-1 and filled >= target * (1.0 - 1e-9):
+        inc shard
+        filled = 0.0
+      s = e
+
+
+proc writeManifest*(fh: File, bamFname: string, numShards: int,
+                    shards: seq[ShardRegion]) =
+  fh.writeLine([MANIFEST_MAGIC, $numShards, bamFname].join("\t"))
+  for sr in shards:
+    fh.writeLine([$sr.shard, sr.reg.sq, $sr.reg.s, $sr.reg.e].join("\t"))
+
+
+proc readManifest*(fname: string): seq[ShardRegion] =
+  var first = true
+  for line in lines(fname):
+    let fields = line.split('\t')
+    if first:
+      if fields[0] != MANIFEST_MAGIC:
+        quit("Not a shard manifest: " & fname)
+      first = false
+      continue
+    if len(fields) != 4:
+      quit("Invalid line in shard manifest " & fname & ": " & line)
+    result.add(ShardRegion(shard: parseInt(fields[0]),
+      reg: Region(sq: fields[1], s: parseInt(fields[2]), e: parseInt(fields[3]))))
+
+
+proc shardRegions*(manifest: string, shardId: int): seq[Region] =
+  ## Regions of one shard, in coordinate order
+  for sr in readManifest(manifest):
+    if sr.shard == shardId:
+      result.add(sr.reg)
+  if len(result) == 0:
+    quit("No regions for shard " & $shardId & " in " & manifest)
+
+
+proc shard*(bamFname: string, numShards: int, regions = "", bedFname = "",
+            manifest = "-") =
+  ## Splits the reference (or regions) into shards of about equal numbers of
+  ## reads and writes them to a manifest for use with call
+  if numShards < 1:
+    quit("Need at least one shard")
+  if len(regions) != 0 and len(bedFname) != 0:
+    quit("Can't read regions from bed and string at the same time")
+  var bam: Bam
+  if not openBam(bam, bamFname, index=true):
+    quit("Could not open BAM file " & bamFname)
+
+  var regs: seq[Region]
+  if len(regions) != 0:
+    regs = toSeq(parseRegionsStr(regions))
+  elif len(bedFname) != 0:
+    regs = toSeq(getBedRegions(bedFname))
+  else:
+    regs = toSeq(getBamRegions(bam))
+
+  # reads per region, estimated from reads per chromosome. without counts
+  # (e.g. CRAM), the region length is used
+  let counts = mappedReadCounts(bam, bamFname)
+  var chromLen = initTable[string, int]()
+  var chromReads = initTable[string, float]()
+  for t in targets(bam.hdr):
+    chromLen[t.name] = int(t.length)
+    if len(counts) > 0:
+      chromReads[t.name] = float(counts[t.tid])
+  var weights: seq[float]
+  for reg in regs:
+    if not chromLen.hasKey(reg.sq):
+      quit("Unknown chromosome " & reg.sq)
+    if len(counts) > 0:
+      weights.add(chromReads[reg.sq] * float(reg.e - reg.s) / float(chromLen[reg.sq]))
+    else:
+      weights.add(float(reg.e - reg.s))
+
+  let shards = makeShards(regs, weights, numShards)
+  let used = if len(shards) > 0: shards[^1].shard + 1 else: 0
+  if used < numShards:
+    logger.log(lvlWarn, "Only " & $used & " of " & $numShards & " shards have reads")
+  var fh = if manifest == "-": stdout else: open(manifest, fmWrite)
+  writeManifest(fh, bamFname, numShards, shards)
+  if fh != stdout:
+    fh.close()
+
+
+proc recordPos(line: string): (string, int) =
+  ## Chromosome and position of a VCF record or pileup JSON line
+  if line.startsWith("{"):
+    let node = parseJson(line)
+    return (node["CHROM"].getStr, node["POS"].getInt)
+  let fields = line.split('\t', 2)
+  return (fields[0], parseInt(fields[1]))
+
+
+proc merge*(manifest: string, fnames: seq[string]) =
+  ## Merges the outputs of all shards of manifest (VCF or pileup JSON, given in
+  ## any order) to stdout in coordinate order
+  if len(fnames) == 0:
+    quit("No files to merge")
+  # chromosome order as in manifest
+  var chromRank = initTable[string, int]()
+  for sr in readManifest(manifest):
+    discard chromRank.hasKeyOrPut(sr.reg.sq, len(chromRank))
+
+  proc rank(pos: (string, int)): (int, int) =
+    if not chromRank.hasKey(pos[0]):
+      quit("Chromosome " & pos[0] & " not in manifest " & manifest)
+    (chromRank[pos[0]], pos[1])
+
+  # order files by their first record. files without records (shards
+  # without variants) only contribute their header if they are first
+  var order: seq[((int, int), string)]
+  var empty: seq[string]
+  for fname in fnames:
+    var found = false
+    for line in lines(fname):
+      if len(line) == 0 or line.startsWith("#"):
+        continue
+      order.add((rank(recordPos(line)), fname))
+      found = true
+      break
+    if not found:
+      empty.add(fname)
+  order.sort()
+  let sortedFnames = order.mapIt(it[1]) & empty
+
+  var last = (-1, -1)# position of last record written
+  for i, fname in sortedFnames:
+    var first = i > 0# first record after previous shard
+    var lastLine = ""
+    for line in lines(fname):
+      if len(line) == 0:
+        continue
+      if line.startsWith("#"):
+        if i == 0:
+          stdout.writeLine(line)
+        continue
+      if first:
+        # invariant: shards don't overlap, so neither do their records
+        if rank(recordPos(line)) <= last:
+          quit("Outputs overlap at " & $recordPos(line) & " in " & fname &
+               ". Were they all created with manifest " & manifest & "?")
+        first = false
+      stdout.writeLine(line)
+      lastLine = line
+    if len(lastLine) > 0:
+      last = rank(recordPos(lastLine))
+
+
+when isMainModule:
+  import utils
+
+  testblock "balanced shards":
+    let regs = @[Region(sq: "a", s: 0, e: 100), Region(sq: "b", s: 0, e: 100),
+                 Region(sq: "c", s: 0, e: 50)]
+    let shards = makeShards(regs, @[100.0, 0.0, 100.0], 4)
+    # b has no reads and is dropped
+    doAssert shards.allIt(it.reg.sq != "b")
+    var perShard = newSeq[int](4)
+    for sr in shards:
+      perShard[sr.shard] += sr.reg.e - sr.reg.s
+    doAssert perShard == @[50, 50, 25, 25], $perShard
+    # consecutive and non-overlapping
+    for i in 1..<len(shards):
+      if shards[i].reg.sq == shards[i-1].reg.sq:
+        doAssert shards[i].reg.s == shards[i-1].reg.e
+      doAssert shards[i].shard >= shards[i-1].shard
+
+  testblock "single shard":
+    let regs = @[Region(sq: "a", s: 0, e: 100)]
+    let shards = makeShards(regs, @[1.0], 1)
+    doAssert len(shards) == 1 and shards[0].reg.e == 100
+
+  testblock "record position":
+    doAssert recordPos("chr1\t10\t.\tA\tC") == ("chr1", 10)
+    doAssert recordPos("""{"CHROM":"chr2","POS":5,"REF":"A"}""") == ("chr2", 5)
+
+  echo "OK: all tests passed"
@@ -0,0 +1,163 @@
+## LoFreq: known sites for force-calling (see 'call --sites')
+##
+## Sites are read from a VCF file (plain or bgzip compressed) and split into
+## one entry per alternate allele. Only SNVs and simple, anchored indels
+## (first base of REF and ALT shared, as written by LoFreq) are supported;
+## other records are skipped with a warning. Sites are grouped per
+## chromosome into fetch windows: sites at most maxGap apart share one
+## window, i.e. one index query and one pileup, and only the site positions
+## themselves are kept in storage.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+# standard
+import algorithm
+import logging
+import strutils
+import tables
+# third party
+import hts
+# project specific
+import region
+
+
+const DEFAULT_SITES_MAX_GAP* = 1000# max. distance of sites sharing a fetch window
+
+
+type SiteKind* = enum skSnp, skIns, skDel
+
+type Site* = object
+  chrom*: string
+  pos*: int64# 1-based, as in VCF
+  id*: string
+  refBase*: string
+  alt*: string
+  kind*: SiteKind
+  allele*: string# as in pileup: alt base, inserted or deleted bases
+
+type SiteWindow* = object
+  reg*: Region
+  sites*: seq[Site]# sorted by position
+
+
+var logger = newConsoleLogger(fmtStr = verboseFmtStr, useStderr = true)
+
+
+proc classify*(refBase, alt: string, kind: var SiteKind,
+               allele: var string): bool =
+  ## Determines kind and pileup allele of a VCF allele. Returns false if
+  ## it's neither a SNV nor a simple anchored indel
+  let r = refBase.toUpperAscii
+  let a = alt.toUpperAscii
+  for s in [r, a]:
+    for c in s:
+      if c notin "ACGTN":
+        return false
+  if len(r) == 1 and len(a) == 1:
+    if r == a:
+      return false
+    kind = skSnp
+    allele = a
+  elif len(r) == 1 and len(a) > 1 and a[0] == r[0]:
+    kind = skIns
+    allele = a[1..^1]
+  elif len(a) == 1 and len(r) > 1 and r[0] == a[0]:
+    kind = skDel
+    allele = r[1..^1]
+  else:
+    return false
+  true
+
+
+proc readSites*(fname: string): seq[Site] =
+  ## Reads all supported sites from a VCF file. Quits if it can't be opened
+  var v: VCF
+  if not open(v, fname):
+    quit("Could not open sites file " & fname)
+  var numSkipped = 0
+  for rec in v:
+    for alt in rec.ALT:
+      var site = Site(chrom: $rec.CHROM, pos: rec.POS, id: $rec.ID,
+                      refBase: rec.REF, alt: alt)
+      if not classify(site.refBase, site.alt, site.kind, site.allele):
+        logger.log(lvlWarn, "Skipping unsupported site " & site.chrom & ":" &
+                   $site.pos & " " & site.refBase & ">" & site.alt)
+        inc numSkipped
+        continue
+      result.add(site)
+  v.close()
+  logger.log(lvlInfo, "Read " & $len(result) & " sites from " & fname &
+             " (skipped " & $numSkipped & ")")
+
+
+proc windows*(sites: seq[Site], maxGap = DEFAULT_SITES_MAX_GAP): seq[SiteWindow] =
+  ## Groups sites into fetch windows, per chromosome (in order of first
+  ## appearance) and sorted by position. Sites at the same position keep
+  ## their input order.
+  var byChrom = initOrderedTable[string, seq[Site]]()
+  for site in sites:
+    byChrom.mgetOrPut(site.chrom, @[]).add(site)
+  for chrom, chromSites in byChrom.mpairs:
+    chromSites.sort(proc(a, b: Site): int = cmp(a.pos, b.pos))# stable
+    var win: SiteWindow
+    for site in chromSites:
+      if len(win.sites) > 0 and site.pos - int64(win.reg.e) > maxGap:
+        result.add(win)
+        win = SiteWindow()
+      if len(win.sites) == 0:
+        win.reg = Region(sq: chrom, s: Natural(site.pos-1), e: Natural(site.pos))# zero-based, half-open
+      win.reg.e = Natural(site.pos)
+      win.sites.add(site)
+    result.add(win)
+
+
+proc positions*(win: SiteWindow): seq[int64] =
+  ## Zero-based positions of all sites in the window
+  for site in win.sites:
+    if len(result) == 0 or result[^1] != site.pos-1:
+      result.add(site.pos-1)
+
+
+when isMainModule:
+  import os
+  import utils
+
+  testblock "classify":
+    var kind: SiteKind
+    var allele: string
+    doAssert classify("C", "t", kind, allele) and kind == skSnp and allele == "T"
+    doAssert classify("A", "ACG", kind, allele) and kind == skIns and allele == "CG"
+    doAssert classify("ACG", "A", kind, allele) and kind == skDel and allele == "CG"
+    for (r, a) in [("A", "A"), ("AC", "GT"), ("AC", "G"), ("A", "<DEL>"), ("A", "*")]:
+      doAssert not classify(r, a, kind, allele), r & ">" & a
+
+  testblock "windows":
+    var sites: seq[Site]
+    for (chrom, pos) in [("chr2", 5'i64), ("chr1", 3000'i64), ("chr1", 10'i64),
+                         ("chr1", 10'i64), ("chr1", 900'i64), ("chr2", 1'i64)]:
+      sites.add(Site(chrom: chrom, pos: pos, alt: $len(sites)))
+    let wins = windows(sites, maxGap = 1000)
+    doAssert len(wins) == 3
+    doAssert wins[0].reg == Region(sq: "chr2", s: 0, e: 5)
+    doAssert wins[0].positions == @[0'i64, 4]
+    doAssert wins[1].reg == Region(sq: "chr1", s: 9, e: 900)
+    doAssert wins[1].positions == @[9'i64, 899]
+    doAssert wins[1].sites[0].alt == "2" and wins[1].sites[1].alt == "3"
+    doAssert wins[2].reg == Region(sq: "chr1", s: 2999, e: 3000)
+
+  testblock "readSites":
+    let fname = getTempDir() / "lofreq-sites-test.vcf"
+    writeFile(fname, "##fileformat=VCFv4.2\n" &
+      "##contig=<ID=chr1,length=1000>\n" &
+      "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n" &
+      "chr1\t10\tmut1\tA\tC,T\t.\t.\t.\n" &
+      "chr1\t20\t.\tAC\tGT\t.\t.\t.\n" &
+      "chr1\t30\tmut2\tG\tGA\t.\t.\t.\n")
+    let sites = readSites(fname)
+    removeFile(fname)
+    doAssert len(sites) == 3
+    doAssert sites[0].id == "mut1" and sites[0].pos == 10 and sites[1].alt == "T"
+    doAssert sites[2].kind == skIns and sites[2].allele == "A"
+
+  echo "OK: all tests passed"
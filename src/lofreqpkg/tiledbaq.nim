@@ -0,0 +1,383 @@
+## LoFreq: alignment qualities (BAQ and indel alignment qualities, see
+## alnqual) for long reads in tiles
+##
+## The HMM in kprobaln_ext.c allocates forward, backward and posterior
+## matrices for the whole read times the band, and the band grows with the
+## net indel length of the read. For long reads (ONT, PacBio) that's
+## hundreds of MB per read. Instead, the alignment is cut at positions well
+## inside match blocks into segments of about 'margin' bases, and processed
+## in overlapping tiles of about 'tileLen' bases (i.e. several segments),
+## each a valid alignment of its own. Values are only taken from a tile's
+## core, which excludes its first and last segment (unless at the read
+## ends), so that they are at least one segment away from a tile edge,
+## where the glocal alignment would be less certain. The band of a tile
+## covers the largest drift of its alignment from the diagonal (whereas the
+## whole-read band only follows the net indel length, which long reads
+## exceed in between), up to MAX_TILE_BAND. Memory is then bounded by the
+## tile length times that band. Only reads of at most 'tileLen' bases are
+## processed as a whole, exactly as without tiling. Reads that can't be cut
+## into tiles of at most MAX_TILE_FACTOR times 'tileLen' bases (too few
+## anchors, e.g. in long stretches of errors) are refused, leaving it to the
+## caller to process them as a whole (unbounded) or not at all.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+
+# project specific
+import bam_md_ext
+
+
+const
+  DEFAULT_TILE_LEN* = 2000
+  DEFAULT_TILE_MARGIN* = 250# segment length, i.e. min. distance of used values from a tile edge
+  ANCHOR_FLANK = 8# matches kept on either side of a cut
+  MAX_TILE_BAND = 250
+  MAX_TILE_FACTOR = 2# max. tile length as multiple of tileLen
+
+const
+  BAQ_FLAG = 1
+  BAQ_EXTENDED = 1
+  IDAQ_FLAG = 1
+
+const# as in bam_md_ext.c
+  BAM_CMATCH = 0'u32
+  BAM_CINS = 1'u32
+  BAM_CDEL = 2'u32
+  BAM_CREF_SKIP = 3'u32
+  BAM_CSOFT_CLIP = 4'u32
+  BAM_CEQUAL = 7'u32
+  BAM_CDIFF = 8'u32
+
+
+type Tile = object
+  qs, qe: int# query range of the tile
+  cs, ce: int# query range of the values taken from it (core)
+
+
+proc isMatch(op: uint32): bool {.inline.} =
+  op == BAM_CMATCH or op == BAM_CEQUAL or op == BAM_CDIFF
+
+
+proc trimUnset(s: var string) {.inline.} =
+  # the C code leaves strings it didn't fill empty (NUL at 0)
+  if len(s) == 0 or s[0] == '\0':
+    s.setLen(0)
+
+
+proc alnQuals*(blf: var bam_lf_t, refSeq: string, aqs: var aln_qual_strgs,
+               minBw = 0) =
+  ## Computes alignment qualities for the whole read, with a band of at
+  ## least minBw. Strings of tags that don't apply (e.g. no insertions) are
+  ## left empty
+  let n = int(blf.l_qseq)
+  aqs.ai_str = newString(n)
+  aqs.ad_str = newString(n)
+  aqs.baq_str = newString(n)
+  let rc = bam_prob_realn_core_ext(addr blf, refSeq, BAQ_FLAG, BAQ_EXTENDED,
+                                   IDAQ_FLAG, aqs, cint(minBw))
+  doAssert rc == 0
+  aqs.ai_str.trimUnset()
+  aqs.ad_str.trimUnset()
+  aqs.baq_str.trimUnset()
+
+
+proc driftBand(cigar: openArray[uint32]): int =
+  ## Band width covering the largest drift of the alignment from the diagonal.
+  ## The band is centered with an offset depending on the net indel length
+  ## (see bam_prob_realn_core_ext), hence the generous factor
+  var drift = 0
+  var maxDrift = 0
+  for c in cigar:
+    let op = c and 0xf
+    let l = int(c shr 4)
+    if op == BAM_CINS:
+      drift -= l
+    elif op == BAM_CDEL or op == BAM_CREF_SKIP:
+      drift += l
+    maxDrift = max(maxDrift, abs(drift))
+  min(3 * maxDrift + 3, MAX_TILE_BAND)
+
+
+proc cutPoints(cigar: openArray[uint32], lQseq: int, margin: int): seq[int] =
+  ## Query positions at which the alignment can be cut, about margin apart
+  ## and with at least ANCHOR_FLANK matches of the same block on either
+  ## side. Starts and ends with the read ends.
+  result = @[0]
+  var y = 0
+  for c in cigar:
+    let op = c and 0xf
+    let l = int(c shr 4)
+    if op.isMatch:
+      var cut = max(y + ANCHOR_FLANK, result[^1] + margin)
+      while cut <= y + l - ANCHOR_FLANK:
+        result.add(cut)
+        cut += margin
+    if op.isMatch or op == BAM_CINS or op == BAM_CSOFT_CLIP:
+      y += l
+  if len(result) > 1 and lQseq - result[^1] < margin div 2:
+    result.setLen(len(result)-1)# don't leave a tiny last segment
+  result.add(lQseq)
+
+
+proc tiles(cuts: seq[int], tileLen: int): seq[Tile] =
+  ## Tiles of at least three segments and otherwise as many as fit into
+  ## tileLen bases, overlapping by two segments, so that cores partition the
+  ## read
+  let nSeg = len(cuts) - 1
+  assert nSeg >= 3
+  var a = 0
+  while true:
+    var b = min(a + 3, nSeg)
+    while b < nSeg and cuts[b+1] - cuts[a] <= tileLen:
+      inc b
+    result.add(Tile(qs: cuts[a], qe: cuts[b],
+                    cs: if a == 0: cuts[0] else: cuts[a+1],
+                    ce: if b == nSeg: cuts[nSeg] else: cuts[b-1]))
+    if b == nSeg:
+      break
+    a = b - 2
+
+
+proc clipCigar(cigar: openArray[uint32], pos: int32, qs, qe: int,
+               subPos: var int32): seq[uint32] =
+  ## Part of the alignment for query range qs..<qe, whose ends lie in match
+  ## blocks (see cutPoints). subPos is set to its start on the reference
+  var x = int(pos)
+  var y = 0
+  subPos = -1
+  for c in cigar:
+    let op = c and 0xf
+    let l = int(c shr 4)
+    if op.isMatch or op == BAM_CINS or op == BAM_CSOFT_CLIP:
+      let s = max(y, qs)
+      let e = min(y + l, qe)
+      if e > s:
+        if op.isMatch and subPos < 0:
+          subPos = int32(x + s - y)
+        result.add(uint32(e - s) shl 4 or op)
+      if op.isMatch:
+        x += l
+      y += l
+    elif op == BAM_CDEL or op == BAM_CREF_SKIP:
+      if y > qs and y < qe:
+        result.add(c)
+      x += l
+    # hard clips and padding don't consume anything
+  assert subPos >= 0
+
+
+proc packSeq(packed: ptr uint8, qs, qe: int): seq[uint8] =
+  ## 4-bit encoded sequence of query range qs..<qe
+  let src = cast[ptr UncheckedArray[uint8]](packed)
+  result = newSeq[uint8]((qe - qs + 1) div 2)
+  for i in qs..<qe:
+    let nt = (src[i shr 1] shr (((not i) and 1) shl 2)) and 0xf
+    let j = i - qs
+    result[j shr 1] = result[j shr 1] or (nt shl (((not j) and 1) shl 2))
+
+
+proc tiledAlnQuals*(blf: bam_lf_t, refSeq: string, aqs: var aln_qual_strgs,
+                    tileLen = DEFAULT_TILE_LEN,
+                    margin = DEFAULT_TILE_MARGIN): int =
+  ## Computes alignment qualities as alnQuals, but in tiles of about tileLen
+  ## bases (see module doc). Returns the number of tiles used, or 0 if the
+  ## read was refused (aqs are then left empty).
+  let n = int(blf.l_qseq)
+  let cigarArr = cast[ptr UncheckedArray[uint32]](blf.cigar)
+  var cigar = newSeq[uint32](int(blf.n_cigar))
+  for i in 0..<len(cigar):
+    cigar[i] = cigarArr[i]
+
+  if n <= tileLen:
+    var whole = blf
+    alnQuals(whole, refSeq, aqs)
+    return 1
+
+  let cuts = cutPoints(cigar, n, margin)
+  if len(cuts) - 1 < 3:
+    return 0
+  let ts = tiles(cuts, tileLen)
+  for t in ts:
+    if t.qe - t.qs > MAX_TILE_FACTOR * tileLen:
+      return 0
+
+  aqs.baq_str = newString(n)
+  aqs.ai_str = newString(n)
+  aqs.ad_str = newString(n)
+  var hasBaq, hasIns, hasDel: bool
+  for t in ts:
+    var subPos: int32
+    var subCigar = clipCigar(cigar, blf.pos, t.qs, t.qe, subPos)
+    var subSeq = packSeq(blf.seq, t.qs, t.qe)
+    var sub: bam_lf_t
+    sub.pos = subPos
+    sub.l_qseq = int32(t.qe - t.qs)
+    sub.n_cigar = uint32(len(subCigar))
+    sub.cigar = addr subCigar[0]
+    sub.seq = addr subSeq[0]
+    sub.qual = cast[ptr uint8](cast[uint](blf.qual) + uint(t.qs))
+    var tileAqs: aln_qual_strgs
+    alnQuals(sub, refSeq, tileAqs, driftBand(subCigar))
+    inc result
+
+    # an indel tag is set for the whole read if any tile has it, and then
+    # filled with the highest value where there is no indel (as in idaq)
+    hasBaq = hasBaq or len(tileAqs.baq_str) > 0
+    hasIns = hasIns or len(tileAqs.ai_str) > 0
+    hasDel = hasDel or len(tileAqs.ad_str) > 0
+    for i in t.cs..<t.ce:
+      let j = i - t.qs
+      if len(tileAqs.baq_str) > 0:
+        aqs.baq_str[i] = tileAqs.baq_str[j]
+      aqs.ai_str[i] = if len(tileAqs.ai_str) > 0: tileAqs.ai_str[j] else: '~'
+      aqs.ad_str[i] = if len(tileAqs.ad_str) > 0: tileAqs.ad_str[j] else: '~'
+
+  if not hasBaq:
+    aqs.baq_str.setLen(0)
+  if not hasIns:
+    aqs.ai_str.setLen(0)
+  if not hasDel:
+    aqs.ad_str.setLen(0)
+
+
+when isMainModule:
+  import random
+  import utils
+
+  type SimRead = object
+    cigar: seq[uint32]
+    packed: seq[uint8]
+    qual: seq[uint8]
+    pos: int32
+
+  proc toBamLf(r: var SimRead): bam_lf_t =
+    result.pos = r.pos
+    result.l_qseq = int32(len(r.qual))
+    result.n_cigar = uint32(len(r.cigar))
+    result.cigar = addr r.cigar[0]
+    result.seq = addr r.packed[0]
+    result.qual = addr r.qual[0]
+
+  proc simulate(rng: var Rand, refSeq: string, pos, readLen: int,
+                errRate, indelRate: float): SimRead =
+    # read from refSeq[pos..] with substitutions and 1-3bp indels
+    const nt16 = [1'u8, 2, 4, 8]# A, C, G, T
+    var bases: seq[uint8]
+    var x = pos
+    var lastOp = BAM_CSOFT_CLIP
+    proc addOp(cigar: var seq[uint32], op: uint32, lastOp: var uint32) =
+      if op == lastOp:
+        cigar[^1] += 1'u32 shl 4
+      else:
+        cigar.add(1'u32 shl 4 or op)
+      lastOp = op
+    while len(bases) < readLen:
+      let r = rng.rand(1.0)
+      if r < indelRate / 2 and lastOp == BAM_CMATCH:
+        for i in 0..rng.rand(2):
+          bases.add(nt16[rng.rand(3)])
+          result.cigar.addOp(BAM_CINS, lastOp)
+        continue
+      elif r < indelRate and lastOp == BAM_CMATCH:
+        for i in 0..rng.rand(2):
+          result.cigar.addOp(BAM_CDEL, lastOp)
+          inc x
+        continue
+      var b = "ACGT".find(refSeq[x])
+      if rng.rand(1.0) < errRate:
+        b = (b + 1 + rng.rand(2)) mod 4
+      bases.add(nt16[b])
+      result.cigar.addOp(BAM_CMATCH, lastOp)
+      inc x
+    result.pos = int32(pos)
+    result.qual = newSeq[uint8](len(bases))
+    for i in 0..<len(bases):
+      result.qual[i] = uint8(20 + rng.rand(20))
+    result.packed = newSeq[uint8]((len(bases) + 1) div 2)
+    for i, b in bases:
+      result.packed[i shr 1] = result.packed[i shr 1] or (b shl (((not i) and 1) shl 2))
+
+  proc randomSeq(rng: var Rand, n: int): string =
+    for i in 0..<n:
+      result.add("ACGT"[rng.rand(3)])
+
+  testblock "cutPoints and tiles":
+    # 10S 500M 2I 600M 3D 300M
+    let cigar = @[10'u32 shl 4 or BAM_CSOFT_CLIP, 500'u32 shl 4 or BAM_CMATCH,
+                  2'u32 shl 4 or BAM_CINS, 600'u32 shl 4 or BAM_CMATCH,
+                  3'u32 shl 4 or BAM_CDEL, 300'u32 shl 4 or BAM_CMATCH]
+    let cuts = cutPoints(cigar, 1412, 250)
+    doAssert cuts == @[0, 250, 500, 750, 1000, 1250, 1412], $cuts
+    let ts = tiles(cuts, 750)
+    doAssert ts[0] == Tile(qs: 0, qe: 750, cs: 0, ce: 500)
+    doAssert ts[^1].qe == 1412 and ts[^1].ce == 1412
+    for i in 1..<len(ts):
+      doAssert ts[i].cs == ts[i-1].ce
+      doAssert ts[i].qs < ts[i-1].ce and ts[i].cs > ts[i].qs
+    var subPos: int32
+    doAssert clipCigar(cigar, 100, 250, 1000, subPos) ==
+      @[260'u32 shl 4 or BAM_CMATCH, 2'u32 shl 4 or BAM_CINS, 488'u32 shl 4 or BAM_CMATCH]
+    doAssert subPos == 100 + 240
+    doAssert clipCigar(cigar, 100, 1000, 1412, subPos) ==
+      @[112'u32 shl 4 or BAM_CMATCH, 3'u32 shl 4 or BAM_CDEL, 300'u32 shl 4 or BAM_CMATCH]
+    doAssert subPos == 100 + 500 + 488
+
+  testblock "packSeq":
+    let packed = @[0x12'u8, 0x48, 0x10]# ACGTA
+    doAssert packSeq(unsafeAddr packed[0], 1, 5) == @[0x24'u8, 0x81]
+    doAssert packSeq(unsafeAddr packed[0], 2, 5) == @[0x48'u8, 0x10]
+
+  testblock "short reads aren't tiled":
+    var rng = initRand(7)
+    let refSeq = randomSeq(rng, 2000)
+    var read = simulate(rng, refSeq, 100, 1000, 0.02, 0.01)
+    var blf = read.toBamLf()
+    var whole, tiled: aln_qual_strgs
+    alnQuals(blf, refSeq, whole)
+    doAssert tiledAlnQuals(blf, refSeq, tiled) == 1
+    doAssert whole == tiled
+
+  testblock "reads without anchors are refused":
+    # 300 x (10M 1I): no match block long enough to cut in
+    var read = SimRead(pos: 0)
+    for i in 0..<300:
+      read.cigar.add(10'u32 shl 4 or BAM_CMATCH)
+      read.cigar.add(1'u32 shl 4 or BAM_CINS)
+    read.qual = newSeq[uint8](3300)
+    read.packed = newSeq[uint8](1650)
+    var blf = read.toBamLf()
+    var aqs: aln_qual_strgs
+    doAssert tiledAlnQuals(blf, "", aqs) == 0
+    doAssert len(aqs.baq_str) == 0 and len(aqs.ai_str) == 0 and len(aqs.ad_str) == 0
+
+  testblock "tiled vs whole-read agreement on simulated long reads":
+    # the whole-read reference uses the same (drift) band, which is what
+    # tiling saves memory on. the default band of untiled processing can't
+    # follow the drift of long reads and differs more (as does the whole
+    # read with drift band), see experiments/2026-10-19-tiled-baq.md
+    var rng = initRand(42)
+    let refSeq = randomSeq(rng, 16000)
+    var total, sameBaq, sameAi, sameAd, numTiles: int
+    for k in 0..<4:
+      var read = simulate(rng, refSeq, 1000 + k*1000, 8000, 0.05, 0.004)
+      var blf = read.toBamLf()
+      var whole, tiled: aln_qual_strgs
+      alnQuals(blf, refSeq, whole, driftBand(read.cigar))
+      numTiles += tiledAlnQuals(blf, refSeq, tiled)
+      doAssert len(tiled.baq_str) == len(whole.baq_str)
+      doAssert len(tiled.ai_str) == len(whole.ai_str)
+      doAssert len(tiled.ad_str) == len(whole.ad_str)
+      for i in 0..<len(whole.baq_str):
+        inc total
+        if tiled.baq_str[i] == whole.baq_str[i]: inc sameBaq
+        if tiled.ai_str[i] == whole.ai_str[i]: inc sameAi
+        if tiled.ad_str[i] == whole.ad_str[i]: inc sameAd
+    echo "Tiles: ", numTiles, ", identical BAQ/AI/AD: ", sameBaq/total, " ",
+      sameAi/total, " ", sameAd/total
+    doAssert numTiles >= 4 * 4
+    doAssert sameBaq/total > 0.99
+    doAssert sameAi/total > 0.99
+    doAssert sameAd/total > 0.99
+
+  echo "OK: all tests passed"
@@ -28,6 +28,7 @@ type Variant* = ref object
   qual*: int
   filter*: string
   info*: InfoField
+  pvalue*: float# not written. needed for the final Bonferroni filter (see call)
 
 proc `$`*(v: Variant): string =
   let dp4 = fmt"{v.info.dp4.refForward},{v.info.dp4.refReverse},{v.info.dp4.altForward},{v.info.dp4.altReverse}"
@@ -51,6 +52,8 @@ proc vcfHeader*(src: string = "", refFa: string = ""): string =
 ##INFO=<ID=DP,Number=1,Type=Integer,Description="Physical coverage">
 ##INFO=<ID=DP4,Number=4,Type=Integer,Description="Counts for ref-forward bases, ref-reverse, alt-forward and alt-reverse bases">
 ##INFO=<ID=TYPE,Number=1,Type=String,Description="Variant type">
+##FILTER=<ID=minCov,Description="Coverage below minCov (known sites only)">
+##FILTER=<ID=maxCov,Description="Coverage above maxCov (known sites only)">
 #CHROM	POS	ID	REF	ALT	QUAL	FILTER	INFO"""
 
 # FIXME add TPE as INFO field
@@ -0,0 +1,315 @@
+## LoFreq: streaming comparison of a test VCF against a truth VCF
+##
+## Both files are read once. Records are split into biallelic alleles,
+## normalized (trimmed and, with a reference, left-aligned) and matched by
+## position and alleles with a sorted merge-join per chromosome. Chromosome
+## blocks that appear in different order in the two files are kept until
+## their counterpart arrives (or the end), so only the chromosome order
+## needs to agree for constant memory. Each chromosome has to be one
+## contiguous block in both files (as in sorted files), otherwise the
+## comparison fails. Counts (TP, FP, FN) are kept per
+## variant type and, optionally, for several score (QUAL or AF) thresholds
+## of the test calls.
+##
+## - Author: Andreas Wilm <andreas.wilm@gmail.com>
+## - License: The MIT License
+
+# standard
+import algorithm
+import sets
+import strutils
+import tables
+# third party
+import hts
+# project specific
+import packedref
+
+
+type VarKind* = enum vkSnp = "snp", vkIndel = "indel", vkOther = "other"
+
+type Allele = object
+  pos: int# 1-based
+  refA: string
+  alt: string
+  score: float# QUAL or AF, only used for test
+
+type ScoreField* = enum sfQual = "QUAL", sfAF = "AF"
+
+type Classes* = object
+  tp*: int
+  fp*: int
+  fn*: int
+
+type EvalResult* = object
+  ## Counts per variant type, overall and per threshold (test score >= t)
+  thresholds*: seq[float]
+  counts*: array[VarKind, Classes]
+  atThreshold*: array[VarKind, seq[Classes]]
+
+
+proc kind(a: Allele): VarKind =
+  if len(a.refA) == 1 and len(a.alt) == 1:
+    vkSnp
+  elif len(a.refA) != len(a.alt):
+    vkIndel
+  else:
+    vkOther
+
+
+proc normalize*(pos: var int, refA, alt: var string, refSeq = "") =
+  ## Normalizes a biallelic variant (pos is 1-based): trims common trailing
+  ## bases and, if the chromosome sequence refSeq is given, left-aligns
+  ## indels, then trims common leading bases (keeping at least one base).
+  ## Non-variants (REF equal to ALT) are left as they are.
+  refA = refA.toUpperAscii
+  alt = alt.toUpperAscii
+  if refA == alt:
+    return
+  while len(refA) > 0 and len(alt) > 0 and refA[^1] == alt[^1]:
+    if len(refA) == 1 or len(alt) == 1:
+      # would leave an empty allele. only possible with a base to the left
+      if len(refSeq) == 0 or pos <= 1:
+        break
+      let b = refSeq[pos-2].toUpperAscii
+      refA = b & refA[0..^2]
+      alt = b & alt[0..^2]
+      dec pos
+    else:
+      refA.setLen(len(refA)-1)
+      alt.setLen(len(alt)-1)
+  while len(refA) > 1 and len(alt) > 1 and refA[0] == alt[0]:
+    refA = refA[1..^1]
+    alt = alt[1..^1]
+    inc pos
+
+
+type BlockReader = object
+  ## Reads a VCF one chromosome block at a time
+  vcf: VCF
+  fname: string
+  seen: HashSet[string]# chromosomes of previous blocks
+  next: iterator(): (string, Allele)
+  head: (string, Allele)
+  done: bool
+  scoreField: ScoreField
+
+
+proc records(v: VCF, scoreField: ScoreField): iterator(): (string, Allele) =
+  result = iterator(): (string, Allele) =
+    var afs = newSeq[float32](1)
+    for rec in v:
+      let chrom = $rec.CHROM
+      var hasAF = false
+      if scoreField == sfAF:
+        hasAF = rec.info.get("AF", afs) == Status.OK
+      for i, alt in rec.ALT:
+        var score = rec.QUAL
+        if scoreField == sfAF:
+          # AF is per allele (Number=A)
+          score = if hasAF and i < len(afs): float(afs[i]) else: 0.0
+        yield (chrom, Allele(pos: int(rec.POS), refA: rec.REF, alt: alt, score: score))
+
+
+proc openBlockReader(fname: string, scoreField: ScoreField): BlockReader =
+  if not open(result.vcf, fname):
+    quit("Could not open " & fname)
+  result.fname = fname
+  result.seen = initHashSet[string]()
+  result.scoreField = scoreField
+  result.next = records(result.vcf, scoreField)
+  result.head = result.next()
+  result.done = finished(result.next)
+
+
+proc nextBlock(r: var BlockReader, chrom: var string): seq[Allele] =
+  ## All alleles of the next chromosome block. Quits if the chromosome had
+  ## a block before, i.e. the file isn't sorted
+  chrom = r.head[0]
+  if chrom in r.seen:
+    quit("Records of chromosome " & chrom & " are not contiguous in " &
+         r.fname & ". Please sort it first (e.g. with bcftools sort)")
+  r.seen.incl(chrom)
+  while not r.done and r.head[0] == chrom:
+    result.add(r.head[1])
+    r.head = r.next()
+    r.done = finished(r.next)
+
+
+proc cmpAllele(a, b: Allele): int =
+  result = cmp(a.pos, b.pos)
+  if result == 0:
+    result = cmp(a.refA, b.refA)
+  if result == 0:
+    result = cmp(a.alt, b.alt)
+
+
+proc prepare(alleles: var seq[Allele], refSeq: string) =
+  for a in alleles.mitems:
+    normalize(a.pos, a.refA, a.alt, refSeq)
+  alleles.sort(cmpAllele)# normalization can change order
+
+
+proc tally(res: var EvalResult, truth, test: seq[Allele]) =
+  ## Merge-join of two sorted blocks of the same chromosome
+  var i = 0
+  var j = 0
+  while i < len(truth) or j < len(test):
+    let c = if i >= len(truth): 1 elif j >= len(test): -1 else: cmpAllele(truth[i], test[j])
+    if c == 0:
+      let k = test[j].kind
+      inc res.counts[k].tp
+      for ti, t in res.thresholds:
+        if test[j].score >= t:
+          inc res.atThreshold[k][ti].tp
+        else:
+          inc res.atThreshold[k][ti].fn
+      inc i
+      inc j
+    elif c < 0:
+      let k = truth[i].kind
+      inc res.counts[k].fn
+      for ti in 0..<len(res.thresholds):
+        inc res.atThreshold[k][ti].fn
+      inc i
+    else:
+      let k = test[j].kind
+      inc res.counts[k].fp
+      for ti, t in res.thresholds:
+        if test[j].score >= t:
+          inc res.atThreshold[k][ti].fp
+      inc j
+
+
+proc compareVcfs*(truthFname, testFname: string, faFname = "",
+                  thresholds: seq[float] = @[],
+                  scoreField = sfQual): EvalResult =
+  ## Compares test against truth in one pass over each file
+  result.thresholds = thresholds
+  for k in VarKind:
+    result.atThreshold[k] = newSeq[Classes](len(thresholds))
+  var fa: Reference
+  if len(faFname) > 0:
+    fa = openReference(faFname)# packed if available
+  proc refSeq(chrom: string): string =
+    if fa.isNil: "" else: fa.get(chrom)
+
+  var truthReader = openBlockReader(truthFname, scoreField)
+  var testReader = openBlockReader(testFname, scoreField)
+  # blocks whose counterpart hasn't been seen yet (chromosome order differs
+  # or chromosome missing in other file)
+  var pendingTruth = initTable[string, seq[Allele]]()
+  var pendingTest = initTable[string, seq[Allele]]()
+  let empty: seq[Allele] = @[]
+
+  while not truthReader.done or not testReader.done:
+    var truthChrom, testChrom: string
+    var truthBlock, testBlock: seq[Allele]
+    if not truthReader.done:
+      truthBlock = truthReader.nextBlock(truthChrom)
+      truthBlock.prepare(refSeq(truthChrom))
+    if not testReader.done:
+      testBlock = testReader.nextBlock(testChrom)
+      testBlock.prepare(refSeq(testChrom))
+
+    if len(truthChrom) > 0 and truthChrom == testChrom:
+      result.tally(truthBlock, testBlock)
+      continue
+    if len(truthChrom) > 0:
+      if pendingTest.hasKey(truthChrom):
+        result.tally(truthBlock, pendingTest[truthChrom])
+        pendingTest.del(truthChrom)
+      else:
+        pendingTruth[truthChrom] = truthBlock
+    if len(testChrom) > 0:
+      if pendingTruth.hasKey(testChrom):
+        result.tally(pendingTruth[testChrom], testBlock)
+        pendingTruth.del(testChrom)
+      else:
+        pendingTest[testChrom] = testBlock
+
+  for chrom, truthBlock in pendingTruth:
+    result.tally(truthBlock, empty)
+  for chrom, testBlock in pendingTest:
+    result.tally(empty, testBlock)
+
+
+proc recall*(c: Classes): float =
+  c.tp / (c.tp + c.fn)
+
+
+proc precision*(c: Classes): float =
+  c.tp / (c.tp + c.fp)
+
+
+when isMainModule:
+  import os
+  import sequtils
+  import utils
+
+  testblock "normalize without reference":
+    var pos = 10
+    var refA = "ACGT"
+    var alt = "AGT"
+    normalize(pos, refA, alt)
+    doAssert pos == 10 and refA == "AC" and alt == "A", $(pos, refA, alt)
+
+    pos = 5
+    refA = "cA"
+    alt = "tA"
+    normalize(pos, refA, alt)
+    doAssert pos == 5 and refA == "C" and alt == "T"
+
+  testblock "non-variant isn't shifted":
+    var pos = 4
+    var refA = "a"
+    var alt = "A"
+    normalize(pos, refA, alt, "CAAAG")
+    doAssert pos == 4 and refA == "A" and alt == "A", $(pos, refA, alt)
+
+  testblock "left-align with reference":
+    # deletion of one A in a run of As. 1-based: C=1, A=2..4, G=5
+    let refSeq = "CAAAG"
+    var pos = 3
+    var refA = "AA"
+    var alt = "A"
+    normalize(pos, refA, alt, refSeq)
+    doAssert pos == 1 and refA == "CA" and alt == "C", $(pos, refA, alt)
+
+  testblock "merge-join":
+    var res: EvalResult
+    res.thresholds = @[20.0]
+    for k in VarKind:
+      res.atThreshold[k] = newSeq[Classes](1)
+    let truth = @[Allele(pos: 1, refA: "A", alt: "C"),
+                  Allele(pos: 5, refA: "AC", alt: "A")]
+    let test = @[Allele(pos: 1, refA: "A", alt: "C", score: 10.0),
+                 Allele(pos: 3, refA: "G", alt: "T", score: 30.0),
+                 Allele(pos: 5, refA: "AC", alt: "A", score: 50.0)]
+    res.tally(truth, test)
+    doAssert res.counts[vkSnp] == Classes(tp: 1, fp: 1, fn: 0)
+    doAssert res.counts[vkIndel] == Classes(tp: 1, fp: 0, fn: 0)
+    # snp at pos 1 is below threshold and hence missed there
+    doAssert res.atThreshold[vkSnp][0] == Classes(tp: 0, fp: 1, fn: 1)
+    doAssert res.atThreshold[vkIndel][0] == Classes(tp: 1, fp: 0, fn: 0)
+
+  testblock "AF of multiallelic records":
+    let fname = getTempDir() / "lofreq-vcfcompare-test.vcf"
+    writeFile(fname, "##fileformat=VCFv4.2\n" &
+      "##contig=<ID=chr1,length=1000>\n" &
+      "##INFO=<ID=AF,Number=A,Type=Float,Description=\"Allele frequency\">\n" &
+      "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n" &
+      "chr1\t10\t.\tA\tC,T\t50\t.\tAF=0.1,0.3\n" &
+      "chr1\t20\t.\tG\tA\t60\t.\t.\n")
+    var r = openBlockReader(fname, sfAF)
+    var chrom: string
+    let alleles = r.nextBlock(chrom)
+    doAssert chrom == "chr1" and r.done
+    doAssert len(alleles) == 3
+    doAssert abs(alleles[0].score - 0.1) < 1e-6 and alleles[0].alt == "C"
+    doAssert abs(alleles[1].score - 0.3) < 1e-6 and alleles[1].alt == "T"
+    doAssert alleles[2].score == 0.0
+    r = openBlockReader(fname, sfQual)
+    doAssert r.nextBlock(chrom).mapIt(it.score) == @[50.0, 50.0, 60.0]
+    removeFile(fname)
+
+  echo "OK: all tests passed"
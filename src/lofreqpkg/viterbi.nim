@@ -13,12 +13,15 @@ import strutils
 import tables
 import sequtils
 import algorithm
+import math
 
 # third party
 import hts
 
 # project specific
 import utils
+import htspool
+import packedref
 
 
 # returns shift
@@ -159,6 +162,157 @@ proc findSkipOps(rec: Record): (seq[CigarElement], int, seq[CigarElement], int)
       trailingSkipOps, trailingSoftClipLen)
 
 
+const alnOps = {CigarOp.match, CigarOp.equal, CigarOp.diff}
+
+
+proc leftShiftExtent(refSq, query: string, op: CigarOp, r, q, L: int): int =
+  # number of positions the indel (ref pos r, query pos q, length L) can be
+  # shifted to the left without changing the aligned sequences, i.e. its
+  # repeat context. for deletions the deleted bases are refSq[r..<r+L], for
+  # insertions the inserted ones are query[q..<q+L] (placed before refSq[r])
+  while r-1-result >= 0:
+    let refBase = toUpperAscii(refSq[r-1-result])
+    let indelBase = if op == CigarOp.deletion:
+                      toUpperAscii(refSq[r+L-1-result])
+                    else:
+                      query[q + floorMod(L-1-result, L)]
+    if refBase != indelBase:
+      break
+    inc result
+
+
+proc isAmbiguousIndel(cigar: Cigar, i: int, refSq, query: string, r, q: int): bool =
+  # true if the indel at cigar index i (starting at ref pos r and query pos
+  # q) is not anchored by aligned bases, is not left-aligned or is next to a
+  # mismatch (typical for a misplaced indel). allocation free.
+  let L = cigar[i].len
+  if i == 0 or i == len(cigar)-1 or
+     cigar[i-1].op notin alnOps or cigar[i+1].op notin alnOps:
+    return true
+  if leftShiftExtent(refSq, query, cigar[i].op, r, q, L) > 0:
+    return true
+  let rAfter = if cigar[i].op == CigarOp.deletion: r+L else: r
+  let qAfter = if cigar[i].op == CigarOp.insert: q+L else: q
+  if rAfter >= len(refSq) or qAfter >= len(query):
+    return true
+  toUpperAscii(refSq[r-1]) != query[q-1] or toUpperAscii(refSq[rAfter]) != query[qAfter]
+
+
+proc needsRealn(cigar: Cigar, start: int, refSq, query: string): bool =
+  # cheap precheck for localized mode: does any indel of the alignment
+  # starting at start need realignment?
+  var r = start
+  var q = 0
+  for i in 0..<len(cigar):
+    let c = cigar[i]
+    if c.op in {CigarOp.insert, CigarOp.deletion}:
+      if isAmbiguousIndel(cigar, i, refSq, query, r, q):
+        return true
+    let cons = consumes(c)
+    if cons.reference: inc(r, c.len)
+    if cons.query: inc(q, c.len)
+
+
+proc realnRaw(refSeg, querySeg: string, quals: var seq[uint8], q2def: cint,
+              shift: var int): string =
+  # runs the viterbi and returns its unfolded cigar, e.g. MMMDDMM
+  let rawOveralloc = newString(2*(len(refSeg) + len(querySeg)))# see viterbi()
+  shift = viterbi_c(refSeg, querySeg, cast[ptr uint8](addr(quals[0])),
+                    rawOveralloc, q2def)
+  var endIdx = len(rawOveralloc)-1
+  for i, opChar in rawOveralloc.pairs:
+    if not opChar.isUpperAscii:
+      endIdx = i-1
+      break
+  result = rawOveralloc[0..endIdx]
+
+
+proc mergeWindows(windows: seq[(int, int)], cols: string,
+                  merged: var seq[(int, int)]): bool =
+  # moves window boundaries (first and last column) onto aligned columns
+  # and merges overlapping windows. windows start in any order, since their
+  # extent depends on each indel's repeat context. returns false if a
+  # window reaches the end of the alignment
+  var adjusted: seq[(int, int)]
+  for w in windows:
+    var a = w[0]
+    var b = w[1]
+    while a > 0 and cols[a] != 'M': dec a
+    while b < len(cols)-1 and cols[b] != 'M': inc b
+    if a <= 0 or b >= len(cols)-1:
+      return false
+    adjusted.add((a, b))
+  adjusted.sort()
+  merged.setLen(0)
+  for (a, b) in adjusted:
+    if len(merged) > 0 and a <= merged[^1][1] + 1:
+      merged[^1][1] = max(merged[^1][1], b)
+    else:
+      merged.add((a, b))
+  true
+
+
+proc realnLocal(cigar: Cigar, start: int, refSq, query: string, bqual: seq[uint8],
+                leadingSoftClipLen: int, q2def: cint, refPadding: int,
+                cols: var string, changed: var bool): bool =
+  # Localized realignment: only windows around ambiguous indels, bounded by
+  # aligned bases, are realigned and spliced back into the unfolded cigar
+  # cols (without skip ops). changed is set if that modified cols. Returns
+  # false if that's not possible (windows
+  # reaching the end of the alignment or unsupported ops), in which case the
+  # whole read has to be realigned.
+  cols = ""
+  changed = false
+  var rOff, qOff: seq[int]# per column ref and query offset
+  var windows: seq[(int, int)]# first and last column, inclusive
+  var r = start
+  var q = leadingSoftClipLen
+  for i in 0..<len(cigar):
+    let c = cigar[i]
+    if c.op in {CigarOp.soft_clip, CigarOp.hard_clip, CigarOp.pad}:
+      continue
+    var opChar: char
+    if c.op in alnOps: opChar = 'M'
+    elif c.op == CigarOp.insert: opChar = 'I'
+    elif c.op == CigarOp.deletion: opChar = 'D'
+    else: return false
+    if opChar != 'M' and isAmbiguousIndel(cigar, i, refSq, query, r, q):
+      let ext = refPadding + c.len +
+                leftShiftExtent(refSq, query, c.op, r, q, c.len)
+      windows.add((len(cols) - ext, len(cols) + c.len - 1 + ext))
+    for j in 0..<c.len:
+      cols.add(opChar)
+      rOff.add(r - start)
+      qOff.add(q - leadingSoftClipLen)
+      if opChar != 'I': inc r
+      if opChar != 'D': inc q
+
+  var merged: seq[(int, int)]
+  if not mergeWindows(windows, cols, merged):
+    return false
+
+  # realign back to front, so that splicing leaves earlier columns untouched
+  for k in countdown(len(merged)-1, 0):
+    let (a, b) = merged[k]
+    let rs = start + rOff[a]
+    let re = start + rOff[b]
+    let qs = leadingSoftClipLen + qOff[a]
+    let qe = leadingSoftClipLen + qOff[b]
+    let refSeg = toUpperAscii(refSq[rs..re])
+    let querySeg = query[qs..qe]
+    var quals = bqual[qs..qe]
+    var shift: int
+    let raw = realnRaw(refSeg, querySeg, quals, q2def, shift)
+    # only splice if the window is aligned end to end
+    if shift != 0 or raw.count({'M', 'D'}) != len(refSeg) or
+       raw.count({'M', 'I'}) != len(querySeg):
+      continue
+    if raw != cols[a..b]:
+      cols = cols[0..<a] & raw & cols[b+1..^1]
+      changed = true
+  return true
+
+
 proc median(xs: seq[uint8]): uint8 =
   if len(xs) == 1: return xs[0]
   var ys = xs
@@ -182,17 +336,23 @@ proc medianQual(quals: seq[uint8]): uint8 =
     return median(nonQ2quals)
 
 
-proc viterbi*(faFname: string, bamInFname: string, skipSecondary = true, refPadding = 10) =
-  var fai: Fai
+proc viterbi*(faFname: string, bamInFname: string, skipSecondary = true, refPadding = 10,
+              localized = false, htsThreads = AUTO_HTS_THREADS) =
+  ## Realigns reads with indels. By default the whole read span plus padding
+  ## is realigned. If localized, reads whose indels are all left-aligned and
+  ## anchored by matching bases are left untouched and otherwise only windows
+  ## around the ambiguous indels are realigned.
   # keeping all observed reference sequences in memory for speedup
   var refs = initTable[string, string]()
+  var nUntouched, nLocal, nWhole = 0
   var iBam: Bam
   #var oBam: Bam
 
-  if not open(fai, faFname):
-    quit("Could not open reference sequence file: " & faFname)
+  let fa = openReference(faFname)# packed if available
 
-  open(iBam, bamInFname, fai=faFname)
+  initHtsPool(htsThreads)
+  if not openBam(iBam, bamInFname, faFname):
+    quit("Could not open BAM file " & bamInFname)
   
   stdout.write($iBam.hdr)
   #assert outFormat in @["BAM", "SAM", "CRAM"]
@@ -210,17 +370,23 @@ proc viterbi*(faFname: string, bamInFname: string, skipSecondary = true, refPadd
     # load reference if not cached
     if not refs.hasKey(chrom):
       #stderr.writeLine("DEBUG Loading " & chrom)
-      refs[chrom] = fai.get(chrom)
+      refs[chrom] = fa.get(chrom)
 
     #stderr.writeLine("DEBUG incoming read = " & $rec.tostring())
 
+    var query: string
+    discard rec.sequence(query)
+
+    if localized and not needsRealn(rec.cigar, int(rec.start), refs[chrom], query):
+      inc nUntouched
+      echo $rec.tostring()
+      continue
+
     let refContext = getRefContext(rec, refs[chrom], refPadding, countIndels(rec.cigar))
 
     let (leadingSkipOps, leadingSoftClipLen, 
       trailingSkipOps, trailingSoftClipLen) = findSkipOps(rec)
 
-    var query: string
-    discard rec.sequence(query)
     let queryWOSoftClip = query[leadingSoftClipLen .. len(query)-1-trailingSoftClipLen]
 
     var bqual: seq[uint8]
@@ -236,6 +402,22 @@ proc viterbi*(faFname: string, bamInFname: string, skipSecondary = true, refPadd
       echo $rec.tostring()
       continue
 
+    if localized:
+      var cols: string
+      var changed: bool
+      if realnLocal(rec.cigar, int(rec.start), refs[chrom], query, bqual,
+                    leadingSoftClipLen, q2def, refPadding, cols, changed):
+        inc nLocal
+        if not changed:
+          echo $rec.tostring()
+          continue
+        var localCigarSeq = concat(leadingSkipOps, toCigar(foldCigar(cols)), trailingSkipOps)
+        GC_ref(localCigarSeq)
+        echo createRealnRec(rec, rec.start, newCigar(localCigarSeq))
+        GC_unref(localCigarSeq)
+        continue
+    inc nWhole
+
     # let realnCigarRawOveralloc = newString(max(len(queryWOSoftClip), len(refContext)))
     # the above is not enough. there pathological cases (like EAS20_8_6_75_302_4 in Ecoli spike-in.waq.bam)
     # where this leads to weirdly clipped viterbi results
@@ -302,6 +484,9 @@ proc viterbi*(faFname: string, bamInFname: string, skipSecondary = true, refPadd
 
     GC_unref(fullRealnCigarSeq)
 
+  if localized:
+    stderr.writeLine("INFO: " & $nUntouched & " reads passed the left-alignment precheck, " &
+      $nLocal & " were realigned locally and " & $nWhole & " as a whole")
   stderr.writeLine("WARNING: MC tag in realigned mates will be invalid")
 
 
@@ -320,6 +505,71 @@ when isMainModule:
     doAssert foldcigar("MMMMIDMMMM") == "4M1I1D4M"
 
 
+  testblock "leftShiftExtent":
+    # deletion of the last A in a run of As
+    doAssert leftShiftExtent("CAAAG", "", CigarOp.deletion, 3, 0, 1) == 2
+    # left-aligned deletion
+    doAssert leftShiftExtent("CAAAG", "", CigarOp.deletion, 1, 0, 3) == 0
+    # dinucleotide repeat
+    doAssert leftShiftExtent("GCACACT", "", CigarOp.deletion, 4, 0, 2) == 3
+    # insertion of an A before the G (query CAAAAG)
+    doAssert leftShiftExtent("CAAAG", "CAAAAG", CigarOp.insert, 4, 4, 1) == 3
+    # insertion of a T can't be shifted
+    doAssert leftShiftExtent("CAAAG", "CAAATG", CigarOp.insert, 4, 4, 1) == 0
+    # lowercase reference
+    doAssert leftShiftExtent("caaag", "", CigarOp.deletion, 3, 0, 1) == 2
+
+  testblock "mergeWindows":
+    let cols = repeat('M', 20)
+    var merged: seq[(int, int)]
+    doAssert mergeWindows(@[(5, 8), (2, 10)], cols, merged)
+    doAssert merged == @[(2, 10)]
+    # a later window starting before an earlier one keeps its left part
+    doAssert mergeWindows(@[(5, 8), (12, 15), (1, 6)], cols, merged)
+    doAssert merged == @[(1, 8), (12, 15)]
+    # boundaries move onto aligned columns
+    doAssert mergeWindows(@[(3, 6)], "MMMDDMIIMMM", merged)
+    doAssert merged == @[(2, 8)]
+    doAssert not mergeWindows(@[(0, 5)], cols, merged)
+    doAssert not mergeWindows(@[(5, 19)], cols, merged)
+
+  # deletion of one A of AAA, once left-aligned and once not
+  let refSq = "GTCGCAAAGTCAGT"
+  let query = "GTCGCAAGTCAGT"
+  var leftEls = tocigar("5M1D8M")
+  let leftCigar = newCigar(leftEls)
+  var rightEls = tocigar("7M1D6M")
+  let rightCigar = newCigar(rightEls)
+
+  testblock "needsRealn":
+    doAssert not needsRealn(leftCigar, 0, refSq, query)
+    doAssert needsRealn(rightCigar, 0, refSq, query)
+    # not anchored by aligned bases
+    var els = tocigar("1D13M")
+    doAssert needsRealn(newCigar(els), 0, refSq, query)
+
+  testblock "realnLocal":
+    var quals = newSeq[uint8](len(query))
+    for q in quals.mitems: q = 30
+    var cols: string
+    var changed: bool
+    # realigned window is spliced back: deletion moved to the left
+    doAssert realnLocal(rightCigar, 0, refSq, query, quals, 0, 30, 2, cols, changed)
+    doAssert changed
+    doAssert foldCigar(cols) == "5M1D8M"
+    # nothing to do
+    doAssert realnLocal(leftCigar, 0, refSq, query, quals, 0, 30, 2, cols, changed)
+    doAssert not changed and foldCigar(cols) == "5M1D8M"
+    # window reaching the end of the alignment: whole read instead
+    doAssert not realnLocal(rightCigar, 0, refSq, query, quals, 0, 30, 10, cols, changed)
+
+  testblock "realnRaw":
+    var quals = newSeq[uint8](6)
+    for q in quals.mitems: q = 30
+    var shift: int
+    doAssert realnRaw("CCATATGG", "CCATGG", quals, 20, shift) == "MMDDMMMM"
+    doAssert shift == 0
+
   testblock "viterbi_c":
     # htsnim quals are offset already and seq[uint8].
     # the original viterbi expects char*.
@@ -1,52 +1,22 @@
-## Simple bcftools isec based vcf evaluator
+## Simple VCF evaluator: compares a test VCF against a truth VCF (see
+## lofreqpkg/vcfcompare)
 ##
 # standard
 import cligen
-import os
-#import math
-import osproc
+import strutils
 import strformat
 # project specific
-# #/
+import lofreqpkg/vcfcompare
 # third party
-import tempfile
-import hts
+# /
 
 
 const allowedVarTypes = @["snp", "indel"]
-# FIXME probably a good idea to normalize first
-
-
-type classes = object
-  tp: int
-  fp: int
-  fn: int
-
-
-proc vcfNumVars(vcfFile: string): int =
-  var vcfFH: VCF
-  doAssert open(vcfFH, vcfFile)
-  for variant in vcfFH:
-    inc result
-
-
-proc vcfEval(vcfTruth, vcfTest, varType: string): classes =
-  doAssert varType in allowedVarTypes
-  var odir = mkdtemp()
-  let cmd = fmt"bcftools isec -p {odir} --include ""TYPE='{vartype}'"" {vcftruth} {vcftest}"
-  let (output, errCode) = execCmdEx(cmd)
-  if errCode != 0:
-    quit(fmt"Command '{cmd}' failed with exit code {errCode} and following error message: {output}")
-
-  result.tp = vcfNumVars(joinPath(odir, "0002.vcf"))
-  result.fp = vcfNumVars(joinPath(odir, "0001.vcf"))
-  result.fn = vcfNumVars(joinPath(odir, "0000.vcf"))
-
-  echo fmt"{vartype}: Keeping bcftools isec tmpdir {odir}"
 
 
 proc vcfEvalMain(vcfTruth, vcfTest: string, varType = "",
-  minRecall = 0.0, minPrecision = 0.0, minTP = 0, maxFP = -1, maxFN = -1) =
+  minRecall = 0.0, minPrecision = 0.0, minTP = 0, maxFP = -1, maxFN = -1,
+  faFname = "", thresholds = "", thresholdField = "QUAL") =
   var varTypes: seq[string]
 
   if len(varType) > 0:
@@ -58,8 +28,24 @@ proc vcfEvalMain(vcfTruth, vcfTest: string, varType = "",
   else:
     varTypes = allowedVarTypes
 
+  var ts: seq[float]
+  if len(thresholds) > 0:
+    for t in thresholds.split(','):
+      ts.add(parseFloat(t))
+  var scoreField: ScoreField
+  try:
+    scoreField = parseEnum[ScoreField](thresholdField)
+  except ValueError:
+    var valid: seq[string]
+    for f in ScoreField:
+      valid.add($f)
+    let validStr = valid.join(" ")
+    quit(fmt"Invalid threshold field {thresholdField}. Must be one of {validStr}")
+  let res = compareVcfs(vcfTruth, vcfTest, faFname, ts, scoreField)
+
   for v in varTypes:
-    let classes = vcfEval(vcfTruth, vcfTest, v)
+    let kind = parseEnum[VarKind](v)
+    let classes = res.counts[kind]
     var recall = classes.tp / (classes.tp + classes.fn)
     #if recall.classify == fcNaN:
     #  recall = -1.0
@@ -85,6 +71,9 @@ proc vcfEvalMain(vcfTruth, vcfTest: string, varType = "",
     echo fmt"{v}: FN={classes.fn}"
     echo fmt"{v}: recall={recall:.2f}"
     echo fmt"{v}: precision={precision:.2f}"
+    for i, t in ts:
+      let c = res.atThreshold[kind][i]
+      echo fmt"{v}: {thresholdField}>={t}: TP={c.tp} FP={c.fp} FN={c.fn} recall={c.recall:.2f} precision={c.precision:.2f}"
 
 
 when isMainModule:
@@ -96,5 +85,8 @@ when isMainModule:
     "minPrecision": "Fail is precision is below this vaule",
     "minTP": "Fail is TP is below this value",
     "maxFP": "Fail if FP is higher than this value (neg. value == ignored)",
-    "maxFN": "Fail is FN is higher than this value (neg. value == ignored)"})
+    "maxFN": "Fail is FN is higher than this value (neg. value == ignored)",
+    "faFname": "Reference (indexed). If given, indels are left-aligned before comparison",
+    "thresholds": "Also report precision and recall for test calls with thresholdField at or above these values (comma separated)",
+    "thresholdField": "QUAL or AF"})
 
@@ -2,4 +2,4 @@ import moduletest
 import calltest
 import pileuptest
 import bugs
-
+import kernels
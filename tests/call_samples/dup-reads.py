@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+"""Writes dup-reads.bam and dup-reads.bam.bai (see dup-reads.README).
+
+Plain Python (no samtools/pysam needed): the BAM is one BGZF block for the
+header, one for all reads and the EOF block; the index has a single bin
+plus the pseudo-bin with mapped/unmapped counts, like a samtools index of a
+file this small.
+"""
+
+import struct
+import zlib
+
+REF_FA = "NC_000913.n200.fa"
+REF_NAME = "NC_000913"
+REF_LEN = 200
+BAM = "dup-reads.bam"
+BGZF_EOF = bytes.fromhex("1f8b08040000000000ff0600424302001b0003000000000000000000")
+CIGAR_OPS = "MIDNSHP=X"
+NT16 = "=ACMGRSVTWYHKDBN"
+
+
+def reg2bin(beg, end):
+    end -= 1
+    for shift, offset in ((14, 4681), (17, 585), (20, 73), (23, 9), (26, 1)):
+        if beg >> shift == end >> shift:
+            return offset + (beg >> shift)
+    return 0
+
+
+def bgzf_block(data):
+    c = zlib.compressobj(9, zlib.DEFLATED, -15)
+    cdata = c.compress(data) + c.flush()
+    header = struct.pack("<BBBBIBBHBBHH", 0x1f, 0x8b, 8, 4, 0, 0, 0xff, 6,
+                         ord("B"), ord("C"), 2, len(cdata) + 25)
+    return header + cdata + struct.pack("<II", zlib.crc32(data), len(data))
+
+
+def parse_cigar(cigar):
+    ops, num = [], ""
+    for c in cigar:
+        if c.isdigit():
+            num += c
+        else:
+            ops.append((int(num), CIGAR_OPS.index(c)))
+            num = ""
+    return ops
+
+
+def ref_len(ops):
+    return sum(l for l, op in ops if CIGAR_OPS[op] in "MDN=X")
+
+
+def bam_record(name, flag, pos, mapq, cigar, seq, qual):
+    """pos is 0-based, qual phred values"""
+    ops = parse_cigar(cigar)
+    end = pos + ref_len(ops)
+    packed = bytearray((len(seq) + 1) // 2)
+    for i, b in enumerate(seq):
+        packed[i >> 1] |= NT16.index(b) << (4 * (1 - (i & 1)))
+    rname = name.encode() + b"\0"
+    data = struct.pack("<iiBBHHHiiii", 0, pos, len(rname), mapq,
+                       reg2bin(pos, end), len(ops), flag, len(seq), -1, -1, 0)
+    data += rname
+    data += b"".join(struct.pack("<I", l << 4 | op) for l, op in ops)
+    data += bytes(packed) + bytes(qual)
+    return struct.pack("<i", len(data)) + data, end
+
+
+def ref_seq():
+    with open(REF_FA) as fh:
+        return "".join(l.strip() for l in fh if not l.startswith(">")).upper()
+
+
+def reads(ref):
+    """name, flag, 0-based pos, cigar, seq, qual. sorted by pos"""
+    def alt(seq, i):
+        return seq[:i] + ("A" if seq[i] != "A" else "C") + seq[i+1:]
+    s20 = ref[20:30]
+    result = []
+    # same-strand duplicates, forward and reverse, reference and variant
+    result += [("fwd-ref-%d" % i, 0, 20, "10M", s20, [30] * 10) for i in range(8)]
+    result += [("rev-ref-%d" % i, 16, 20, "10M", s20, [30] * 10) for i in range(6)]
+    result += [("fwd-alt-%d" % i, 0, 20, "10M", alt(s20, 4), [35] * 10) for i in range(5)]
+    result += [("rev-alt-%d" % i, 16, 20, "10M", alt(s20, 4), [35] * 10) for i in range(4)]
+    # same start and sequence, but one base quality differs: not collapsed
+    result += [("fwd-alt-q", 0, 20, "10M", alt(s20, 4), [35] * 9 + [20])]
+    # duplicates with a deletion
+    del_seq = ref[20:24] + ref[25:31]
+    result += [("fwd-del-%d" % i, 0, 20, "4M1D6M", del_seq, [30] * 10) for i in range(3)]
+    # duplicates starting later
+    s22 = ref[22:32]
+    result += [("fwd-late-%d" % i, 0, 22, "10M", alt(s22, 2), [30] * 10) for i in range(3)]
+    return result
+
+
+def main():
+    ref = ref_seq()
+    assert len(ref) == REF_LEN
+    text = ("@HD\tVN:1.6\tSO:coordinate\n@SQ\tSN:%s\tLN:%d\n" % (REF_NAME, REF_LEN)).encode()
+    name = REF_NAME.encode() + b"\0"
+    header = (b"BAM\1" + struct.pack("<i", len(text)) + text + struct.pack("<i", 1) +
+              struct.pack("<i", len(name)) + name + struct.pack("<i", REF_LEN))
+    records, max_end, bins = b"", 0, set()
+    rs = reads(ref)
+    for name, flag, pos, cigar, seq, qual in rs:
+        rec, end = bam_record(name, flag, pos, 60, cigar, seq, qual)
+        records += rec
+        max_end = max(max_end, end)
+        bins.add(reg2bin(pos, end))
+    assert bins == {4681} and len(records) < 65536
+
+    block1 = bgzf_block(header)
+    block2 = bgzf_block(records)
+    with open(BAM, "wb") as fh:
+        fh.write(block1 + block2 + BGZF_EOF)
+
+    # all reads are in one block and one bin
+    beg = len(block1) << 16
+    end = (len(block1) + len(block2)) << 16
+    bai = b"BAI\1" + struct.pack("<i", 1)
+    bai += struct.pack("<i", 2)# bins
+    bai += struct.pack("<IiQQ", 4681, 1, beg, end)
+    bai += struct.pack("<IiQQQQ", 37450, 2, beg, end, len(rs), 0)
+    bai += struct.pack("<iQ", 1, beg)# linear index: one 16kb window
+    bai += struct.pack("<Q", 0)# no unplaced reads
+    with open(BAM + ".bai", "wb") as fh:
+        fh.write(bai)
+
+
+if __name__ == "__main__":
+    main()
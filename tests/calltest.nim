@@ -2,9 +2,16 @@
 import unittest
 import osproc
 import tempfile
+import strutils
+import sequtils
+import algorithm
+import json
+import net
+import os
 
 # project specific
 import ../src/lofreqpkg/call
+import ../src/lofreqpkg/api
 
 # third party
 import hts/vcf
@@ -102,3 +109,124 @@ suite "call":
     #echo "Diff command: " & diff_cmd
     check(exitCode == 0)
 
+  test "collapsed vs uncollapsed reads":
+    # dup-reads.bam has same-strand duplicates (see dup-reads.README), so
+    # collapsing actually happens
+    let tmpdir = mkdtemp()
+    let cmd = lofreq & " call -b call_samples/dup-reads.bam -f call_samples/NC_000913.n200.fa -r NC_000913:1-200"
+    var
+      output: TaintedString
+      exitCode: int
+
+    for (kind, opts) in [("json", " -p"), ("vcf", "")]:
+      let plain = tmpdir & "/plain." & kind
+      let collapsed = tmpdir & "/collapsed." & kind
+      let stats = tmpdir & "/stats-" & kind & ".json"
+      (output, exitCode) = execCmdEx(cmd & opts & " > " & plain)
+      check(exitCode == 0)
+      (output, exitCode) = execCmdEx(cmd & opts & " --collapseReads --stats " &
+                                     stats & " > " & collapsed)
+      check(exitCode == 0)
+      check parseFile(stats)["counters"]["reads_collapsed"].getInt > 0
+
+      # header lines only differ in date
+      let records = toSeq(lines(plain)).filterIt(not it.startsWith("##"))
+      check len(records) > 1
+      check records == toSeq(lines(collapsed)).filterIt(not it.startsWith("##"))
+    removeDir(tmpdir)
+
+
+  test "library API gives the same variants as call":
+    var plpParams = defaultPileupParams()
+    plpParams.useMQ = false
+    var callParams = defaultCallParams()
+    callParams.minVarQual = 13
+    let lf = openLoFreq("call_samples/simple-vars.bam",
+                        "call_samples/NC_000913.n200.fa", plpParams, callParams)
+    var apiVars: seq[string]
+    for v in lf.variants("NC_000913:1-200"):
+      apiVars.add($v)
+    # small batches, i.e. several pileups, give the same
+    lf.batchSize = 7
+    lf.resetTests()
+    var batchedVars: seq[string]
+    for v in lf.variants("NC_000913:1-200"):
+      batchedVars.add($v)
+    lf.close()
+
+    let cmd = lofreq & " call -b call_samples/simple-vars.bam -v 13 -f call_samples/NC_000913.n200.fa -r NC_000913:1-200 --noMQ"
+    let cliVars = execProcess(cmd).splitLines().filterIt(it.startsWith("NC_000913\t"))
+    check len(apiVars) > 0
+    check apiVars == cliVars
+    check batchedVars == cliVars
+
+
+  test "dynamic Bonferroni doesn't depend on region order":
+    let base = lofreq & " call -b call_samples/simple-vars.bam -f call_samples/NC_000913.n200.fa --noMQ -v 13 --sig 0.01 --bonf dynamic -r "
+    var calls: seq[seq[string]]
+    for regs in ["NC_000913:1-100,NC_000913:101-200", "NC_000913:101-200,NC_000913:1-100"]:
+      let vars = execProcess(base & regs).splitLines().filterIt(it.startsWith("NC_000913\t"))
+      calls.add(vars.sorted())
+    check calls[0] == calls[1]
+    # chunks of a checkpoint are final, but the number of tests isn't
+    let (_, exitCode) = execCmdEx(base & "NC_000913:1-200 --checkpointDir " & mkdtemp())
+    check exitCode != 0
+
+
+  test "sites report the same statistics as call":
+    var tmpfd: File
+    var tmpname: string
+    (tmpfd, tmpname) = mkstemp()
+    tmpfd.close
+    let cmd = lofreq & " call -b call_samples/simple-vars.bam -v 13 -f call_samples/NC_000913.n200.fa -r NC_000913:1-200 --noMQ"
+    discard execCmdEx(cmd & " > " & tmpname)
+    let calledVars = readFile(tmpname).splitLines().filterIt(it.startsWith("NC_000913\t"))
+    # with thresholds that wouldn't call anything
+    let sitesCmd = lofreq & " call -b call_samples/simple-vars.bam -v 100 -a 0.9 -f call_samples/NC_000913.n200.fa --noMQ --sites " & tmpname
+    let siteVars = execProcess(sitesCmd).splitLines().filterIt(it.startsWith("NC_000913\t"))
+    check len(calledVars) > 0
+    check siteVars == calledVars
+    # sites failing coverage filters are marked, with their real coverage
+    let lowCov = execProcess(sitesCmd & " --minCov 3").splitLines().filterIt(it.startsWith("NC_000913\t"))
+    check lowCov == calledVars.mapIt(it.split('\t')).mapIt((it[0..5] & "minCov" & it[7..^1]).join("\t"))
+
+
+  test "serve gives the same variants as call":
+    let socket = mkdtemp() & "/lofreq.sock"
+    let server = startProcess(lofreq, args = ["serve", "-f", "call_samples/NC_000913.n200.fa",
+      "-b", "call_samples/simple-vars.bam", "-s", socket, "--workers", "2"],
+      options = {poParentStreams})
+    for i in 0..<100:
+      if fileExists(socket):
+        break
+      sleep(100)
+    check fileExists(socket)
+    sleep(200)# listen() follows bind()
+
+    proc request(line: string): seq[string] =
+      # reply lines including the final #OK or #ERROR line
+      let client = newSocket(AF_UNIX, SOCK_STREAM, IPPROTO_IP)
+      client.connectUnix(socket)
+      client.send(line & "\n")
+      while true:
+        let reply = client.recvLine(timeout = 10000)
+        if len(reply) == 0:# connection closed
+          break
+        result.add(reply)
+        if reply.startsWith("#"):
+          break
+      client.close()
+
+    let served = request("region=NC_000913:1-200 minVarQual=13 noMQ=true")
+    let cmd = lofreq & " call -b call_samples/simple-vars.bam -v 13 -f call_samples/NC_000913.n200.fa -r NC_000913:1-200 --noMQ"
+    let cliVars = execProcess(cmd).splitLines().filterIt(it.startsWith("NC_000913\t"))
+    check len(cliVars) > 0
+    check served == cliVars & @["#OK " & $len(cliVars)]
+    let unknown = request("region=chrX:1-10")
+    check len(unknown) == 1 and unknown[0].startsWith("#ERROR")
+
+    # SIGTERM stops the workers and removes the socket
+    server.terminate()
+    discard server.waitForExit()
+    server.close()
+    check not fileExists(socket)
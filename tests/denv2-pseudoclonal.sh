@@ -14,7 +14,7 @@ odir=$(mktemp -d)
 echo "Running tests in $odir"
 outvcf=$odir/denv2-pseudoclonal.vcf.gz
 log=$odir/denv2-pseudoclonal.log
-/usr/bin/time -v $LOFREQ call -a 0.001 -f $REFFA -b $BAM -l "$BED" 2>$log | bgzip > $outvcf
+/usr/bin/time -v $LOFREQ call ${CALL_OPTS:-} -a 0.001 -f $REFFA -b $BAM -l "$BED" 2>$log | bgzip > $outvcf
 tabix $outvcf
 
 testvcf=$odir/denv2-pseudoclonal.flt.vcf.gz
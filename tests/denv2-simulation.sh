@@ -13,7 +13,7 @@ odir=$(mktemp -d)
 echo "Running tests in $odir"
 outvcf=$odir/denv2-10haplo.vcf.gz
 log=$odir/denv2-10haplo.log
-/usr/bin/time -v $LOFREQ call -a 0.0 -f $REFFA -b $BAM -r "$REG" 2>$log | bgzip > $outvcf
+/usr/bin/time -v $LOFREQ call ${CALL_OPTS:-} -a 0.0 -f $REFFA -b $BAM -r "$REG" 2>$log | bgzip > $outvcf
 tabix $outvcf
 
 testvcf=$odir/denv2-10haplo.flt.vcf.gz
@@ -0,0 +1,401 @@
+# Micro-benchmarks and equivalence checks for the C kernels: viterbi(),
+# kpa_ext_glocal() and bam_prob_realn_core_ext() (which includes idaq()).
+# Random and adversarial inputs (homopolymers, tandem repeats, ambiguous
+# bases, Q2 tails) over several read lengths and indel loads are run through
+# the live kernels in src/lofreqpkg and through frozen copies of the
+# reference implementation (kernels/frozen, see kernels/README). All outputs
+# have to agree bit for bit. With -d:kernelBench each kernel is also timed
+# per call and per read base.
+
+# standard library
+import unittest
+import random
+import strformat
+import monotimes
+import times
+
+# project specific
+import ../src/lofreqpkg/bam_md_ext# live bam_md_ext.c and kprobaln_ext.c
+import ../src/lofreqpkg/viterbi# live viterbi.c
+
+# third party
+#/
+
+
+{.compile: "kernels/frozen_viterbi.c".}
+{.compile: "kernels/frozen_kprobaln_ext.c".}
+{.compile: "kernels/frozen_bam_md_ext.c".}
+
+
+const kernelSeed {.intdefine.} = 42
+const kernelCases {.intdefine.} = 20# per read length, indel load and ref type
+
+when defined(kernelBench):
+  const READ_LENGTHS = [36, 100, 250, 1000]
+else:
+  const READ_LENGTHS = [36, 100, 250]
+const INDEL_RATES = [0.0, 0.01, 0.05]# indel events per read base
+
+const BAM_CMATCH = 0
+const BAM_CINS = 1
+const BAM_CDEL = 2
+const BAM_CSOFT_CLIP = 4
+
+const BASES = "ACGT"
+
+
+type KpaPar {.bycopy.} = object
+  ## kpa_ext_par_t
+  d, e: float32
+  bw: cint
+
+type ViterbiFn = proc (sref, squery: cstring, bqual: ptr uint8, aln: cstring,
+                       defQual: cint): cint {.cdecl.}
+type KpaFn = proc (r: ptr uint8, lRef: cint, q: ptr uint8, lQuery: cint,
+                   iqual: ptr uint8, c: ptr KpaPar, state: ptr cint,
+                   qOut: ptr uint8, pd: ptr ptr cdouble,
+                   retBw: ptr cint): cint {.cdecl.}
+type RealnFn = proc (b: ptr bam_lf_t, refSq: cstring,
+                     baqFlag, baqExtended, idaqFlag: cint,
+                     baqStr, adStr, aiStr: cstring): cint {.cdecl.}
+
+proc viterbiLive(sref, squery: cstring, bqual: ptr uint8, aln: cstring,
+                 defQual: cint): cint {.cdecl, importc: "viterbi".}
+proc viterbiFrozen(sref, squery: cstring, bqual: ptr uint8, aln: cstring,
+                   defQual: cint): cint {.cdecl, importc: "frozen_viterbi".}
+proc kpaLive(r: ptr uint8, lRef: cint, q: ptr uint8, lQuery: cint,
+             iqual: ptr uint8, c: ptr KpaPar, state: ptr cint,
+             qOut: ptr uint8, pd: ptr ptr cdouble,
+             retBw: ptr cint): cint {.cdecl, importc: "kpa_ext_glocal".}
+proc kpaFrozen(r: ptr uint8, lRef: cint, q: ptr uint8, lQuery: cint,
+               iqual: ptr uint8, c: ptr KpaPar, state: ptr cint,
+               qOut: ptr uint8, pd: ptr ptr cdouble,
+               retBw: ptr cint): cint {.cdecl, importc: "frozen_kpa_ext_glocal".}
+proc realnLive(b: ptr bam_lf_t, refSq: cstring,
+               baqFlag, baqExtended, idaqFlag: cint,
+               baqStr, adStr, aiStr: cstring): cint {.cdecl,
+               importc: "bam_prob_realn_core_ext".}
+proc realnFrozen(b: ptr bam_lf_t, refSq: cstring,
+                 baqFlag, baqExtended, idaqFlag: cint,
+                 baqStr, adStr, aiStr: cstring): cint {.cdecl,
+                 importc: "frozen_bam_prob_realn_core_ext".}
+proc cFree(p: pointer) {.importc: "free", header: "<stdlib.h>".}
+
+
+type RefKind = enum
+  rkRandom = "random"
+  rkHomopolymer = "homopolymer"
+  rkTandem = "tandem"
+  rkAmbiguous = "ambiguous"
+
+type Case = object
+  ## One read and its reference, plus the derived inputs of each kernel
+  name: string
+  refSq: string
+  pos: int# zero-based start of the alignment
+  query: string# including soft clips
+  quals: seq[uint8]# phred
+  cigar: seq[uint32]# BAM encoded
+  packed: seq[uint8]# query, 4-bit encoded as in BAM
+  # viterbi: reference context and query without soft clip, as in viterbi.nim
+  vRef: string
+  vQuery: string
+  vQuals: seq[uint8]
+  # kpa_ext_glocal: 0-4 encoded banded reference and query, as in bam_md_ext.c
+  kRef: seq[uint8]
+  kQuery: seq[uint8]
+  kPar: KpaPar
+
+type Group = object
+  readLen: int
+  indelRate: float
+  cases: seq[Case]
+
+type Timing = object
+  calls: int
+  bases: int
+  ns: int64
+
+
+proc makeRef(r: var Rand, n: int, kind: RefKind): string =
+  case kind
+  of rkRandom:
+    for i in 0..<n:
+      result.add(BASES[r.rand(3)])
+  of rkHomopolymer:
+    while len(result) < n:
+      let b = BASES[r.rand(3)]
+      for j in 0..<r.rand(3..30):
+        result.add(b)
+  of rkTandem:
+    while len(result) < n:
+      var unit = ""
+      for j in 0..<r.rand(1..4):
+        unit.add(BASES[r.rand(3)])
+      for j in 0..<r.rand(2..15):
+        result.add(unit)
+  of rkAmbiguous:
+    for i in 0..<n:
+      result.add(if r.rand(1.0) < 0.1: 'N' else: BASES[r.rand(3)])
+  result.setLen(n)
+
+
+proc addOp(cigar: var seq[uint32], op, oplen: int) =
+  if len(cigar) > 0 and int(cigar[^1] and 0xf) == op:
+    cigar[^1] += uint32(oplen) shl 4
+  else:
+    cigar.add(uint32(oplen) shl 4 or uint32(op))
+
+
+proc nt16(b: char): uint8 =
+  case b
+  of 'A': 1
+  of 'C': 2
+  of 'G': 4
+  of 'T': 8
+  else: 15
+
+
+proc nt4(b: char): uint8 =
+  case b
+  of 'A': 0
+  of 'C': 1
+  of 'G': 2
+  of 'T': 3
+  else: 4
+
+
+proc prepare(c: var Case) =
+  ## Derives the kernel inputs the way the callers in src/lofreqpkg do
+  c.packed = newSeq[uint8]((len(c.query) + 1) div 2)
+  for i, b in c.query:
+    c.packed[i shr 1] = c.packed[i shr 1] or (nt16(b) shl ((not i and 1) shl 2))
+
+  var clip, numIndels = 0
+  var x = c.pos
+  var y = 0
+  var xb, xe, yb, ye = -1
+  for ce in c.cigar:
+    let op = int(ce and 0xf)
+    let l = int(ce shr 4)
+    case op
+    of BAM_CMATCH:
+      if yb < 0: yb = y
+      if xb < 0: xb = x
+      ye = y + l
+      xe = x + l
+      x += l
+      y += l
+    of BAM_CINS:
+      y += l
+      numIndels += l
+    of BAM_CDEL:
+      x += l
+      numIndels += l
+    of BAM_CSOFT_CLIP:
+      y += l
+      clip += l
+    else:
+      doAssert false
+
+  let s = max(0, c.pos - 10)
+  let e = min(x + 10 + numIndels, len(c.refSq) - 1)
+  c.vRef = c.refSq[s..e]
+  c.vQuery = c.query[clip..^1]
+  c.vQuals = c.quals[clip..^1]
+
+  let lq = len(c.query)
+  var bw = 7
+  if abs((xe - xb) - (ye - yb)) > bw:
+    bw = abs((xe - xb) - (ye - yb)) + 3
+  xb -= yb + bw div 2
+  if xb < 0: xb = 0
+  xe += lq - ye + bw div 2
+  if xe - xb - lq > bw:
+    xb += (xe - xb - lq - bw) div 2
+    xe -= (xe - xb - lq - bw) div 2
+  xe = min(xe, len(c.refSq))
+  c.kRef = @[]
+  for i in xb..<xe:
+    c.kRef.add(nt4(c.refSq[i]))
+  c.kQuery = @[]
+  for b in c.query:
+    c.kQuery.add(nt4(b))
+  c.kPar = KpaPar(d: 0.00001, e: 0.4, bw: cint(bw))# kpa_ext_par_lofreq_illumina
+
+
+proc makeCase(r: var Rand, readLen: int, indelRate: float,
+              kind: RefKind): Case =
+  result.refSq = makeRef(r, 3 * readLen + 100, kind)
+  result.pos = r.rand(10..50)
+  if r.rand(1.0) < 0.2:
+    let clip = r.rand(1..5)
+    for i in 0..<clip:
+      result.query.add(BASES[r.rand(3)])
+    result.cigar.addOp(BAM_CSOFT_CLIP, clip)
+  # alignment starts and ends with a match and indels are never adjacent
+  var x = result.pos
+  var lastOp = -1
+  while len(result.query) < readLen:
+    let remaining = readLen - len(result.query)
+    if lastOp == BAM_CMATCH and remaining > 5 and r.rand(1.0) < indelRate:
+      if r.rand(1) == 0:
+        let l = min(r.rand(1..4), remaining - 1)
+        for i in 0..<l:
+          result.query.add(BASES[r.rand(3)])
+        result.cigar.addOp(BAM_CINS, l)
+        lastOp = BAM_CINS
+      else:
+        let l = r.rand(1..4)
+        x += l
+        result.cigar.addOp(BAM_CDEL, l)
+        lastOp = BAM_CDEL
+    else:
+      var b = result.refSq[x]
+      if r.rand(1.0) < 0.01:
+        b = BASES[r.rand(3)]# sequencing error
+      result.query.add(b)
+      inc x
+      result.cigar.addOp(BAM_CMATCH, 1)
+      lastOp = BAM_CMATCH
+
+  for i in 0..<readLen:
+    result.quals.add(uint8(r.rand(2..41)))
+  if r.rand(1.0) < 0.3:
+    # Illumina's Q2 tail
+    for i in readLen - r.rand(1..readLen div 2)..<readLen:
+      result.quals[i] = 2
+  result.prepare()
+
+
+proc makeGroups(): seq[Group] =
+  var r = initRand(kernelSeed)
+  for readLen in READ_LENGTHS:
+    for indelRate in INDEL_RATES:
+      var g = Group(readLen: readLen, indelRate: indelRate)
+      for kind in RefKind:
+        for i in 0..<kernelCases:
+          var c = makeCase(r, readLen, indelRate, kind)
+          c.name = &"len={readLen} indels={indelRate} ref={kind} #{i} seed={kernelSeed}"
+          g.cases.add(c)
+      result.add(g)
+
+
+template timed(t: var Timing, nbases: int, body: untyped) =
+  when defined(kernelBench):
+    let t0 = getMonoTime()
+    body
+    t.ns += inNanoseconds(getMonoTime() - t0)
+    inc t.calls
+    t.bases += nbases
+  else:
+    body
+
+
+proc report(kernel: string, g: Group, live, frozen: Timing) =
+  when defined(kernelBench):
+    proc perCall(t: Timing): float = float(t.ns) / 1000.0 / float(t.calls)
+    proc perBase(t: Timing): float = float(t.ns) / float(t.bases)
+    echo &"{kernel:<24} len={g.readLen:<5} indels={g.indelRate:<5} " &
+      &"live {perCall(live):10.2f} us/call {perBase(live):9.1f} ns/base   " &
+      &"frozen {perCall(frozen):10.2f} us/call {perBase(frozen):9.1f} ns/base   " &
+      &"speedup {float(frozen.ns) / float(live.ns):5.2f}x"
+
+
+proc runViterbi(f: ViterbiFn, c: Case, t: var Timing): (cint, string) =
+  var aln = newString(len(c.vRef) + len(c.vQuery) + 1)
+  var quals = c.vQuals
+  var shift: cint
+  timed(t, len(c.vQuery)):
+    shift = f(c.vRef, c.vQuery, addr quals[0], aln, 20)
+  (shift, aln)
+
+
+type KpaResult = object
+  pr, bw: cint
+  state: seq[cint]
+  q: seq[uint8]
+  pd: seq[seq[uint64]]# bit patterns of the doubles
+
+
+proc runKpa(f: KpaFn, c: Case, t: var Timing): KpaResult =
+  let lq = len(c.kQuery)
+  var kRef = c.kRef
+  var kQuery = c.kQuery
+  var quals = c.quals
+  var par = c.kPar
+  result.state = newSeq[cint](lq)
+  result.q = newSeq[uint8](lq)
+  var pd = newSeq[ptr cdouble](lq + 1)
+  timed(t, lq):
+    result.pr = f(addr kRef[0], cint(len(kRef)), addr kQuery[0], cint(lq),
+                  addr quals[0], addr par, addr result.state[0],
+                  addr result.q[0], addr pd[0], addr result.bw)
+  let rowLen = (int(result.bw) * 2 + 1) * 3 + 6
+  for row in pd:
+    var vals = newSeq[uint64](rowLen)
+    copyMem(addr vals[0], row, rowLen * sizeof(cdouble))
+    result.pd.add(vals)
+    cFree(row)
+
+
+proc runRealn(f: RealnFn, c: Case, extended: bool,
+              t: var Timing): (cint, string, string, string) =
+  var cigar = c.cigar
+  var quals = c.quals
+  var packed = c.packed
+  var b = bam_lf_t(cigar: addr cigar[0], qual: addr quals[0],
+                   seq: addr packed[0], pos: int32(c.pos),
+                   l_qseq: int32(len(c.query)))
+  b.n_cigar = uint32(len(cigar))
+  var baq = newString(len(c.query) + 1)
+  var ad = newString(len(c.query) + 1)
+  var ai = newString(len(c.query) + 1)
+  var rc: cint
+  timed(t, len(c.query)):
+    rc = f(addr b, c.refSq, 1, cint(extended), 1, baq, ad, ai)
+  (rc, baq, ad, ai)
+
+
+suite "C kernels: live vs. frozen reference":
+  let groups = makeGroups()
+
+  test "viterbi":
+    var mismatches = 0
+    for g in groups:
+      var live, frozen: Timing
+      for c in g.cases:
+        let a = runViterbi(viterbiLive, c, live)
+        let b = runViterbi(viterbiFrozen, c, frozen)
+        if a != b:
+          inc mismatches
+          checkpoint(&"viterbi differs for {c.name}: {a} vs. {b}")
+      report("viterbi", g, live, frozen)
+    check mismatches == 0
+
+  test "kpa_ext_glocal":
+    var mismatches = 0
+    for g in groups:
+      var live, frozen: Timing
+      for c in g.cases:
+        let a = runKpa(kpaLive, c, live)
+        let b = runKpa(kpaFrozen, c, frozen)
+        if a != b:
+          inc mismatches
+          checkpoint(&"kpa_ext_glocal differs for {c.name}")
+      report("kpa_ext_glocal", g, live, frozen)
+    check mismatches == 0
+
+  test "bam_prob_realn_core_ext":
+    var mismatches = 0
+    for extended in [false, true]:
+      for g in groups:
+        var live, frozen: Timing
+        for c in g.cases:
+          let a = runRealn(realnLive, c, extended, live)
+          let b = runRealn(realnFrozen, c, extended, frozen)
+          if a != b:
+            inc mismatches
+            checkpoint(&"bam_prob_realn_core_ext (extended={extended}) differs for {c.name}: {a} vs. {b}")
+        report(if extended: "realn (extended BAQ)" else: "realn", g, live, frozen)
+    check mismatches == 0
@@ -0,0 +1,25 @@
+/* Renames all external symbols of the frozen kernels (see README), so that
+ * they can be linked next to the live ones in src/lofreqpkg
+ */
+#ifndef FROZEN_NAMES_H
+#define FROZEN_NAMES_H
+
+#define argmax_d frozen_argmax_d
+#define left_align_indels frozen_left_align_indels
+#define viterbi frozen_viterbi
+#define viterbi_test frozen_viterbi_test
+
+#define kpa_ext_glocal frozen_kpa_ext_glocal
+#define kpa_ext_par_def frozen_kpa_ext_par_def
+#define kpa_ext_par_alt frozen_kpa_ext_par_alt
+#define kpa_ext_par_lofreq_illumina frozen_kpa_ext_par_lofreq_illumina
+#define kpa_ext_par_lofreq_pacbio frozen_kpa_ext_par_lofreq_pacbio
+
+#define seq_nt16_table frozen_seq_nt16_table
+#define seq_nt16_str frozen_seq_nt16_str
+#define seq_nt16_int frozen_seq_nt16_int
+#define u_within_limits frozen_u_within_limits
+#define idaq frozen_idaq
+#define bam_prob_realn_core_ext frozen_bam_prob_realn_core_ext
+
+#endif
@@ -0,0 +1,2 @@
+#include "frozen_names.h"
+#include "frozen/viterbi.c"